@@ -0,0 +1,391 @@
+// Microbenchmarks for the storage layers, run in-process without FUSE.
+//
+// Usage: nufs_bench [-r repetitions] [-w warmup] [image]
+//
+// Formats a fresh image (bench.nufs by default), then times bitmap scans,
+// block and inode allocation at several fill levels, directory and path
+// lookups, and storage reads and writes of several sizes. Each benchmark
+// runs warmup untimed batches and then repetitions timed batches of
+// operations; the per-operation time of each batch is one sample. The
+// results go to stdout as JSON, one benchmark per line, so that the output
+// of two builds can be diffed.
+//
+// Writeback is disabled (DURABILITY_NONE), so the numbers measure the
+// in-memory paths, not the disk.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "directory.h"
+#include "inode.h"
+#include "journal.h"
+#include "stats.h"
+#include "storage.h"
+
+#define BENCH_IMAGE_SIZE (1024L * 1024 * 1024)
+#define BENCH_INODES (256 * 1024)
+#define BENCH_BITMAP_BITS (1 << 20)
+#define BENCH_ALLOC_BATCH 256
+#define BENCH_IO_FILE_SIZE (64 * 1024 * 1024)
+
+static int repetitions = 50;
+static int warmup = 5;
+static int results = 0; // benchmarks printed so far
+
+// performs ops operations of a benchmark
+typedef void (*bench_fn)(void *arg, int ops);
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+// xorshift64, so every run uses the same sequence
+static unsigned long long rng() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static int double_cmp(const void *a, const void *b) {
+	double da = *(const double *) a;
+	double db = *(const double *) b;
+	return (da > db) - (da < db);
+}
+
+// the sample at percentile pct of sorted samples (nearest rank)
+static double percentile(const double *sorted, int count, double pct) {
+	int rank = (int) (pct / 100 * count + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	}
+	return sorted[(rank < count ? rank : count) - 1];
+}
+
+// Times a benchmark and prints its result. Every batch runs fn for ops
+// operations, then after (if given) outside the timed region.
+static void bench(const char *name, const char *param, bench_fn fn,
+		bench_fn after, void *arg, int ops) {
+	double *samples = malloc(repetitions * sizeof(double));
+	for (int ii = -warmup; ii < repetitions; ++ii) {
+		uint64_t start = stats_now();
+		fn(arg, ops);
+		uint64_t elapsed = stats_now() - start;
+		if (after) {
+			after(arg, ops);
+		}
+		if (ii >= 0) {
+			samples[ii] = (double) elapsed / ops;
+		}
+	}
+	qsort(samples, repetitions, sizeof(double), double_cmp);
+	double sum = 0;
+	for (int ii = 0; ii < repetitions; ++ii) {
+		sum += samples[ii];
+	}
+	printf("%s    {\"name\": \"%s\", \"param\": \"%s\", \"ops\": %d, \"samples\": %d, "
+			"\"min_ns\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, "
+			"\"max_ns\": %.1f, \"mean_ns\": %.1f}",
+			results++ ? ",\n" : "", name, param, ops, repetitions,
+			samples[0], percentile(samples, repetitions, 50),
+			percentile(samples, repetitions, 90),
+			percentile(samples, repetitions, 99), samples[repetitions - 1],
+			sum / repetitions);
+	fflush(stdout);
+	free(samples);
+}
+
+// --- bitmaps ---
+
+typedef struct bitmap_bench {
+	uint64_t *bm;
+	int nbits;
+	long sink; // keeps the scans from being optimized out
+} bitmap_bench_t;
+
+static void bench_bitmap_get(void *arg, int ops) {
+	bitmap_bench_t *bb = arg;
+	for (int ii = 0; ii < ops; ++ii) {
+		bb->sink += bitmap_get(bb->bm, ii % bb->nbits);
+	}
+}
+
+static void bench_bitmap_put(void *arg, int ops) {
+	bitmap_bench_t *bb = arg;
+	for (int ii = 0; ii < ops; ++ii) {
+		bitmap_put(bb->bm, ii % bb->nbits, ii & 1);
+	}
+}
+
+// finds the one clear bit at the end of an otherwise full bitmap
+static void bench_bitmap_find(void *arg, int ops) {
+	bitmap_bench_t *bb = arg;
+	for (int ii = 0; ii < ops; ++ii) {
+		bb->sink += bitmap_find_free(bb->bm, 0, bb->nbits);
+	}
+}
+
+static void bench_bitmaps() {
+	bitmap_bench_t bb = {aligned_alloc(64, BENCH_BITMAP_BITS / 8), BENCH_BITMAP_BITS, 0};
+	memset(bb.bm, 0x5a, BENCH_BITMAP_BITS / 8);
+	char param[32];
+	snprintf(param, sizeof(param), "bits=%d", bb.nbits);
+	bench("bitmap_get", param, bench_bitmap_get, NULL, &bb, bb.nbits);
+	bench("bitmap_put", param, bench_bitmap_put, NULL, &bb, bb.nbits);
+	memset(bb.bm, 0xff, BENCH_BITMAP_BITS / 8);
+	bitmap_put(bb.bm, bb.nbits - 1, 0);
+	bench("bitmap_find_free", param, bench_bitmap_find, NULL, &bb, 16);
+	free(bb.bm);
+}
+
+// --- directories and paths ---
+
+// creates count empty files named f0, f1, ... in a new directory
+static void make_directory(const char *path, int count) {
+	char name[64];
+	if (storage_mknod(path, 040755) != 0) {
+		fprintf(stderr, "nufs_bench: cannot create %s\n", path);
+		exit(1);
+	}
+	for (int ii = 0; ii < count; ++ii) {
+		snprintf(name, sizeof(name), "%s/f%d", path, ii);
+		if (storage_mknod(name, 0100644) != 0) {
+			fprintf(stderr, "nufs_bench: cannot create %s\n", name);
+			exit(1);
+		}
+	}
+}
+
+typedef struct lookup_bench {
+	inode_t *dir; // for directory_lookup
+	int entries;
+	const char *path; // for inode_path_lookup
+	long sink;
+} lookup_bench_t;
+
+// looks up random existing names, scanning the directory every time
+static void bench_directory_lookup(void *arg, int ops) {
+	lookup_bench_t *lb = arg;
+	char name[16];
+	for (int ii = 0; ii < ops; ++ii) {
+		int len = snprintf(name, sizeof(name), "f%d", (int) (rng() % lb->entries));
+		lb->sink += directory_lookup(lb->dir, name, len);
+	}
+}
+
+static void bench_path_lookup(void *arg, int ops) {
+	lookup_bench_t *lb = arg;
+	for (int ii = 0; ii < ops; ++ii) {
+		lb->sink += inode_path_lookup(lb->path);
+	}
+}
+
+static void bench_directories() {
+	int sizes[] = {10, 1000, 100000};
+	for (int ii = 0; ii < 3; ++ii) {
+		char path[32];
+		snprintf(path, sizeof(path), "/dir%d", sizes[ii]);
+		make_directory(path, sizes[ii]);
+		lookup_bench_t lb = {get_inode(inode_path_lookup(path)), sizes[ii], NULL, 0};
+		char param[32];
+		snprintf(param, sizeof(param), "entries=%d", sizes[ii]);
+		bench("directory_lookup", param, bench_directory_lookup, NULL, &lb, 1000);
+	}
+}
+
+// Times lookups of a file at the end of a chain of directories /c/c/.../f,
+// through the dentry cache, which the warmup fills.
+static void bench_paths() {
+	int depths[] = {1, 4, 16, 32};
+	char path[256] = "";
+	int depth = 1;
+	for (int ii = 0; ii < 4; ++ii) {
+		for (; depth < depths[ii]; ++depth) {
+			strcat(path, "/c");
+			storage_mknod(path, 040755);
+		}
+		char file[260];
+		snprintf(file, sizeof(file), "%s/f", path);
+		storage_mknod(file, 0100644);
+		lookup_bench_t lb = {NULL, 0, file, 0};
+		char param[32];
+		snprintf(param, sizeof(param), "depth=%d", depths[ii]);
+		bench("inode_path_lookup", param, bench_path_lookup, NULL, &lb, 1000);
+	}
+}
+
+// --- reads and writes ---
+
+typedef struct io_bench {
+	char *buf;
+	size_t size;
+} io_bench_t;
+
+// a random offset in the file, aligned to the request size
+static off_t io_offset(size_t size) {
+	return (off_t) (rng() % (BENCH_IO_FILE_SIZE / size)) * size;
+}
+
+static void bench_write(void *arg, int ops) {
+	io_bench_t *io = arg;
+	for (int ii = 0; ii < ops; ++ii) {
+		storage_write("/io", io->buf, io->size, io_offset(io->size));
+	}
+}
+
+static void bench_read(void *arg, int ops) {
+	io_bench_t *io = arg;
+	for (int ii = 0; ii < ops; ++ii) {
+		storage_read("/io", io->buf, io->size, io_offset(io->size));
+	}
+}
+
+static void bench_io() {
+	io_bench_t io = {malloc(1 << 20), 1 << 20};
+	memset(io.buf, 'x', io.size);
+	storage_mknod("/io", 0100644);
+	for (off_t off = 0; off < BENCH_IO_FILE_SIZE; off += io.size) {
+		storage_write("/io", io.buf, io.size, off);
+	}
+	for (io.size = 4096; io.size <= (1 << 20); io.size *= 4) {
+		char param[32];
+		snprintf(param, sizeof(param), "size=%zu", io.size);
+		int ops = (int) ((4 << 20) / io.size);
+		bench("storage_write", param, bench_write, NULL, &io, ops);
+		bench("storage_read", param, bench_read, NULL, &io, ops);
+	}
+	free(io.buf);
+}
+
+// --- allocation ---
+
+typedef struct alloc_bench {
+	int nums[BENCH_ALLOC_BATCH];
+} alloc_bench_t;
+
+static void bench_alloc_block(void *arg, int ops) {
+	alloc_bench_t *ab = arg;
+	journal_begin();
+	for (int ii = 0; ii < ops; ++ii) {
+		ab->nums[ii] = alloc_block();
+	}
+	journal_end();
+}
+
+// frees the batch and commits, so the blocks can be reused
+static void release_block_batch(void *arg, int ops) {
+	alloc_bench_t *ab = arg;
+	journal_begin();
+	for (int ii = 0; ii < ops; ++ii) {
+		if (ab->nums[ii] >= 0) {
+			free_block(ab->nums[ii]);
+		}
+	}
+	journal_end();
+	journal_commit();
+}
+
+static void bench_alloc_inode(void *arg, int ops) {
+	alloc_bench_t *ab = arg;
+	journal_begin();
+	for (int ii = 0; ii < ops; ++ii) {
+		ab->nums[ii] = alloc_inode(0100644, 0);
+	}
+	journal_end();
+}
+
+static void release_inodes(void *arg, int ops) {
+	alloc_bench_t *ab = arg;
+	journal_begin();
+	for (int ii = 0; ii < ops; ++ii) {
+		if (ab->nums[ii] >= 0) {
+			free_inode(ab->nums[ii]);
+		}
+	}
+	journal_end();
+	journal_commit();
+}
+
+// Times allocation with the data blocks and inodes filled to 50%, 90% and
+// 99%. The space is taken for good, so this runs last.
+static void bench_alloc() {
+	superblock_t *sb = blocks_superblock();
+	int data_blocks = sb->block_count - sb->data_start;
+	int levels[] = {50, 90, 99};
+	alloc_bench_t ab;
+	for (int ii = 0; ii < 3; ++ii) {
+		int free_blocks, free_inodes;
+		blocks_usage(&free_blocks, &free_inodes);
+		// one operation per allocation, so the transactions stay small
+		while (free_blocks > (long) data_blocks * (100 - levels[ii]) / 100) {
+			int want = free_blocks - data_blocks * (100 - levels[ii]) / 100;
+			int got;
+			journal_begin();
+			int start = alloc_blocks(0, want < 1024 ? want : 1024, &got);
+			journal_end();
+			if (start < 0) {
+				break;
+			}
+			free_blocks -= got;
+		}
+		while (free_inodes > (long) sb->inode_count * (100 - levels[ii]) / 100) {
+			journal_begin();
+			int inum = alloc_inode(0100644, 0);
+			journal_end();
+			if (inum < 0) {
+				break;
+			}
+			free_inodes--;
+		}
+		journal_commit();
+
+		char param[32];
+		snprintf(param, sizeof(param), "fill=%d%%", levels[ii]);
+		bench("alloc_block", param, bench_alloc_block, release_block_batch, &ab, BENCH_ALLOC_BATCH);
+		bench("alloc_inode", param, bench_alloc_inode, release_inodes, &ab, BENCH_ALLOC_BATCH);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "r:w:")) != -1) {
+		switch (opt) {
+		case 'r': repetitions = atoi(optarg); break;
+		case 'w': warmup = atoi(optarg); break;
+		default: goto usage;
+		}
+	}
+	if (argc - optind > 1 || repetitions < 1 || warmup < 0) {
+		goto usage;
+	}
+	const char *image = argc > optind ? argv[optind] : "bench.nufs";
+
+	if (unlink(image) != 0 && errno != ENOENT) {
+		perror(image);
+		return 1;
+	}
+	if (blocks_format(image, BENCH_IMAGE_SIZE, NUFS_DEFAULT_BLOCK_SIZE, BENCH_INODES, 0, 0) != 0 ||
+			storage_init(image) != 0) {
+		return 1;
+	}
+	storage_set_durability(DURABILITY_NONE, 0);
+
+	printf("{\n  \"block_size\": %d, \"repetitions\": %d, \"warmup\": %d,\n"
+			"  \"benchmarks\": [\n", BLOCK_SIZE, repetitions, warmup);
+	bench_bitmaps();
+	bench_directories();
+	bench_paths();
+	bench_io();
+	bench_alloc();
+	printf("\n  ]\n}\n");
+
+	storage_destroy();
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-r repetitions] [-w warmup] [image]\n", argv[0]);
+	return 1;
+}
@@ -6,6 +6,7 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "bitmap.h"
 
@@ -47,3 +48,147 @@ void bitmap_print(void *bm, int size) {
     }
   }
 }
+
+// Mask of the bits at or above bit n of a word.
+#define bits_from(n) (~0ULL << (n))
+
+// Scan whole words from word w for one with a clear bit; returns nwords if none.
+static int scan_words_generic(const uint64_t *words, int w, int nwords) {
+  while (w < nwords && words[w] == ~0ULL) {
+    w++;
+  }
+  return w;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+// Same as scan_words_generic, skipping full 256-bit chunks with AVX2.
+__attribute__((target("avx2")))
+static int scan_words_avx2(const uint64_t *words, int w, int nwords) {
+  const __m256i ones = _mm256_set1_epi64x(-1);
+  while (w + 4 <= nwords) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (words + w));
+    if (!_mm256_testc_si256(v, ones)) {
+      break;
+    }
+    w += 4;
+  }
+  return scan_words_generic(words, w, nwords);
+}
+
+static int scan_words(const uint64_t *words, int w, int nwords) {
+  static int has_avx2 = -1;
+  if (has_avx2 < 0) {
+    has_avx2 = __builtin_cpu_supports("avx2");
+  }
+  return has_avx2 ? scan_words_avx2(words, w, nwords)
+                  : scan_words_generic(words, w, nwords);
+}
+#else
+#define scan_words scan_words_generic
+#endif
+
+// Find the first clear bit in [start, nbits).
+int bitmap_find_free(void *bm, int start, int nbits) {
+  const uint64_t *words = (const uint64_t *) bm;
+  int nwords = (nbits + 63) / 64;
+
+  if (start >= nbits) {
+    return -1;
+  }
+
+  // the first word may only be partially in range
+  int w = start / 64;
+  uint64_t open = ~words[w] & bits_from(start % 64);
+  if (open == 0) {
+    w = scan_words(words, w + 1, nwords);
+    if (w >= nwords) {
+      return -1;
+    }
+    open = ~words[w];
+  }
+
+  int i = w * 64 + __builtin_ctzll(open);
+  return i < nbits ? i : -1;
+}
+
+// Find a clear bit in [start, end) using the summary to skip full words.
+static int index_search(bitmap_index_t *ix, int start, int end) {
+  int nwords = (ix->nbits + 63) / 64;
+  int w = start / 64;
+
+  // remaining bits of the first word
+  uint64_t open = ~ix->bm[w] & bits_from(start % 64);
+  while (open == 0) {
+    // next word that is not marked full
+    w = bitmap_find_free(ix->full, w + 1, nwords);
+    if (w < 0) {
+      return -1;
+    }
+    open = ~ix->bm[w];
+  }
+
+  int i = w * 64 + __builtin_ctzll(open);
+  return i < end ? i : -1;
+}
+
+// Build the summary for a bitmap.
+void bitmap_index_init(bitmap_index_t *ix, void *bm, int nbits) {
+  int nwords = (nbits + 63) / 64;
+
+  ix->bm = (uint64_t *) bm;
+  ix->nbits = nbits;
+  ix->full = calloc((nwords + 63) / 64, sizeof(uint64_t));
+  ix->hint = 0;
+
+  for (int w = 0; w < nwords; w++) {
+    uint64_t word = ix->bm[w];
+    // bits past the end of the bitmap count as used
+    if (w == nwords - 1 && nbits % 64 != 0) {
+      word |= bits_from(nbits % 64);
+    }
+    if (word == ~0ULL) {
+      bitmap_put(ix->full, w, 1);
+    }
+  }
+}
+
+// Release the memory held by an index.
+void bitmap_index_destroy(bitmap_index_t *ix) {
+  free(ix->full);
+  ix->full = 0;
+}
+
+// Find a clear bit near goal or from the next-fit cursor.
+int bitmap_index_find(bitmap_index_t *ix, int goal) {
+  if (goal >= 0 && goal < ix->nbits && !bitmap_get(ix->bm, goal)) {
+    return goal;
+  }
+
+  int i = index_search(ix, ix->hint, ix->nbits);
+  if (i < 0 && ix->hint > 0) {
+    // wrap around to the front
+    i = index_search(ix, 0, ix->hint);
+  }
+  return i;
+}
+
+// Set a bit, keeping the summary and cursor up to date.
+void bitmap_index_put(bitmap_index_t *ix, int i, int v) {
+  int w = i / 64;
+
+  bitmap_put(ix->bm, i, v);
+  if (v) {
+    uint64_t word = ix->bm[w];
+    if (w == (ix->nbits - 1) / 64 && ix->nbits % 64 != 0) {
+      word |= bits_from(ix->nbits % 64);
+    }
+    if (word == ~0ULL) {
+      bitmap_put(ix->full, w, 1);
+    }
+    ix->hint = i + 1 < ix->nbits ? i + 1 : 0;
+  } else {
+    bitmap_put(ix->full, w, 0);
+  }
+}
@@ -7,6 +7,8 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <stdint.h>
+
 /**
  * Get the given bit from the bitmap.
  *
@@ -34,4 +36,69 @@ void bitmap_put(void *bm, int i, int v);
  */
 void bitmap_print(void *bm, int size);
 
+/**
+ * Find the first clear bit in [start, nbits).
+ *
+ * Scans a 64-bit word at a time (256 bits at a time on CPUs with AVX2).
+ * Bit i lives in bit i % 64 of word i / 64 on little-endian machines, and
+ * the bitmap must be 8-byte aligned.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start First bit index to consider.
+ * @param nbits Number of bits in the bitmap.
+ *
+ * @return The index of the first clear bit, or -1 if there is none.
+ */
+int bitmap_find_free(void *bm, int start, int nbits);
+
+/**
+ * An allocation index over a bitmap.
+ *
+ * Keeps a summary with one bit per bitmap word that is set while the word
+ * is completely full, so searches skip full regions 4096 bits at a time,
+ * and a next-fit cursor so successive allocations do not rescan the front.
+ */
+typedef struct bitmap_index {
+  uint64_t *bm;   // the indexed bitmap
+  int nbits;      // number of bits in the bitmap
+  uint64_t *full; // summary: bit w set when bm[w] has no clear bits
+  int hint;       // next-fit cursor
+} bitmap_index_t;
+
+/**
+ * Build the summary for a bitmap.
+ *
+ * @param ix Index to initialize.
+ * @param bm Pointer to the start of the bitmap (8-byte aligned).
+ * @param nbits Number of bits in the bitmap.
+ */
+void bitmap_index_init(bitmap_index_t *ix, void *bm, int nbits);
+
+/**
+ * Release the memory held by an index.
+ *
+ * @param ix Index to destroy.
+ */
+void bitmap_index_destroy(bitmap_index_t *ix);
+
+/**
+ * Find a clear bit, preferring goal and otherwise searching from the
+ * next-fit cursor, wrapping around once.  The bit is not changed.
+ *
+ * @param ix Index to search.
+ * @param goal Preferred bit, or -1 for none.
+ *
+ * @return A clear bit index, or -1 if the bitmap is full.
+ */
+int bitmap_index_find(bitmap_index_t *ix, int goal);
+
+/**
+ * Set a bit through the index, keeping the summary and cursor up to date.
+ *
+ * @param ix Index of the bitmap.
+ * @param i Bit index.
+ * @param v Value the bit should be set to (0 or 1).
+ */
+void bitmap_index_put(bitmap_index_t *ix, int i, int v);
+
 #endif
@@ -26,5 +26,18 @@ int main(int argc, char **argv) {
   bitmap_put(bm, 255, 1);
   bitmap_print(bm, SIZE);
 
+  printf("\nFirst free bit: %d\n", bitmap_find_free(bm, 0, SIZE));
+  printf("First free bit from 65: %d\n", bitmap_find_free(bm, 65, SIZE));
+
+  printf("\nFilling bits 0 to 199 through an index: \n");
+  bitmap_index_t ix;
+  bitmap_index_init(&ix, bm, SIZE);
+  for (int i = 0; i < 200; i++) {
+    bitmap_index_put(&ix, i, 1);
+  }
+  bitmap_print(bm, SIZE);
+  printf("\nNext free bit: %d\n", bitmap_index_find(&ix, -1));
+  bitmap_index_destroy(&ix);
+
   return 0;
 }
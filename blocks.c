@@ -1,4 +1,4 @@
-**
+/**
  * @file blocks.c
  * @author CS3650 staff
  *
@@ -9,10 +9,13 @@
 #include <string.h>
 
 #include <assert.h>
+#include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -21,16 +24,38 @@
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "freemap.h"
+#include "inode.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
-const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
-
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
+int BLOCK_COUNT = 0; // loaded from the superblock
+int BLOCK_SIZE = 0;  // loaded from the superblock
 
 static int blocks_fd = -1;
-static void *blocks_base = 0;
+static void *blocks_base = 0;  // shared mapping, for file data
+static void *meta_base = 0;    // private mapping, for metadata
+static size_t blocks_size = 0; // bytes mapped
+// data blocks written since they were last synced
+static uint64_t *data_dirty = 0;
+
+// In-memory state of an allocation group, kept a cache line apart from its
+// neighbours.
+typedef struct alloc_group {
+	pthread_mutex_t lock;  // guards both indexes and the group descriptor
+	freemap_t free;        // free extents, less blocks awaiting a commit
+	bitmap_index_t inodes; // free-inode search over the group's inode bits
+} __attribute__((aligned(64))) alloc_group_t;
+
+static alloc_group_t *groups = 0;
+static int group_count = 0;
+static int blocks_per_group = 0;
+static int inodes_per_group = 0;
+// where the search for a top-level directory's group starts, so groups
+// tied on directory count take turns
+static int dir_rotor = 0;
+static int cpu_count = 1;
 
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
@@ -43,67 +68,688 @@ int bytes_to_blocks(int bytes) {
 	}
 }
 
+// Lay out an empty file system on the open image file.
+static int format_image(int fd, size_t size, int block_size, int inode_count,
+		int journal_blocks, int group_blocks) {
+	if (block_size < 4096 || (block_size & (block_size - 1)) != 0) {
+		fprintf(stderr, "nufs: block size %d is not a power of two >= 4096\n",
+				block_size);
+		return -1;
+	}
+	if (inode_count <= 0) {
+		inode_count = size / NUFS_BYTES_PER_INODE;
+		if (inode_count < NUFS_MIN_INODES) {
+			inode_count = NUFS_MIN_INODES;
+		}
+	}
+
+	// work out where each metadata region goes
+	superblock_t sb;
+	memset(&sb, 0, sizeof(sb));
+	size_t block_count = size / block_size;
+	if (block_count > INT32_MAX) {
+		fprintf(stderr, "nufs: image of %zu blocks is too large\n", block_count);
+		return -1;
+	}
+	int journal_given = journal_blocks > 0;
+	if (!journal_given) {
+		journal_blocks = block_count / NUFS_BLOCKS_PER_JOURNAL_BLOCK;
+		if (journal_blocks < NUFS_MIN_JOURNAL_BLOCKS) {
+			journal_blocks = NUFS_MIN_JOURNAL_BLOCKS;
+		}
+		if (journal_blocks > NUFS_MAX_JOURNAL_BLOCKS) {
+			journal_blocks = NUFS_MAX_JOURNAL_BLOCKS;
+		}
+	}
+	// a group's bits start on a word of the bitmap and fit in one block;
+	// by default there is a group per CPU, unless that makes them tiny
+	int bits_per_block = block_size * 8;
+	if (group_blocks <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_CONF);
+		cpus = cpus > 0 ? cpus : 1;
+		group_blocks = (block_count + cpus - 1) / cpus;
+		group_blocks = (group_blocks + 63) / 64 * 64;
+		if (group_blocks < NUFS_MIN_BLOCKS_PER_GROUP) {
+			group_blocks = NUFS_MIN_BLOCKS_PER_GROUP;
+		}
+		if (group_blocks > bits_per_block) {
+			group_blocks = bits_per_block;
+		}
+	} else if (group_blocks % 64 != 0 || group_blocks > bits_per_block) {
+		fprintf(stderr, "nufs: %d blocks per group is not a multiple of 64 "
+				"up to %d\n", group_blocks, bits_per_block);
+		return -1;
+	}
+	int ngroups = (block_count + group_blocks - 1) / group_blocks;
+	int group_inodes = (inode_count + ngroups - 1) / ngroups;
+	group_inodes = (group_inodes + 63) / 64 * 64;
+	size_t group_table_bytes = (size_t) ngroups * sizeof(group_desc_t);
+	sb.magic = NUFS_MAGIC;
+	sb.version = NUFS_VERSION;
+	sb.block_size = block_size;
+	sb.block_count = block_count;
+	sb.inode_count = inode_count;
+	sb.group_count = ngroups;
+	sb.blocks_per_group = group_blocks;
+	sb.inodes_per_group = group_inodes;
+	sb.group_table_start = 1;
+	sb.group_table_blocks = (group_table_bytes + block_size - 1) / block_size;
+	sb.block_bitmap_start = sb.group_table_start + sb.group_table_blocks;
+	sb.block_bitmap_blocks = (block_count + bits_per_block - 1) / bits_per_block;
+	sb.inode_bitmap_start = sb.block_bitmap_start + sb.block_bitmap_blocks;
+	sb.inode_bitmap_blocks = (inode_count + bits_per_block - 1) / bits_per_block;
+	sb.inode_table_start = sb.inode_bitmap_start + sb.inode_bitmap_blocks;
+	sb.inode_table_blocks =
+		((size_t) inode_count * sizeof(inode_t) + block_size - 1) / block_size;
+	// the journal must hold the transaction of any one operation
+	if (journal_blocks < journal_min_blocks(&sb)) {
+		if (journal_given) {
+			fprintf(stderr, "nufs: journal of %d blocks is too small, the image needs %d\n",
+					journal_blocks, journal_min_blocks(&sb));
+			return -1;
+		}
+		journal_blocks = journal_min_blocks(&sb);
+	}
+	sb.journal_start = sb.inode_table_start + sb.inode_table_blocks;
+	sb.journal_blocks = journal_blocks;
+	sb.data_start = sb.journal_start + sb.journal_blocks;
+	if (sb.data_start >= sb.block_count) {
+		fprintf(stderr, "nufs: image of %zu bytes is too small\n", size);
+		return -1;
+	}
+
+	// only ever grow the file, never cut off an existing image
+	struct stat st;
+	int rv = fstat(fd, &st);
+	assert(rv == 0);
+	if ((size_t) st.st_size < size && ftruncate(fd, size) != 0) {
+		perror("nufs: ftruncate");
+		return -1;
+	}
+
+	// clear the metadata region and mark it as allocated
+	size_t meta_size = (size_t) sb.data_start * block_size;
+	uint8_t *meta =
+		mmap(0, meta_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(meta != MAP_FAILED);
+	memset(meta, 0, meta_size);
+	memcpy(meta, &sb, sizeof(sb));
+	void *bbm = meta + (size_t) sb.block_bitmap_start * block_size;
+	for (int ii = 0; ii < sb.data_start; ++ii) {
+		bitmap_put(bbm, ii, 1);
+	}
+	group_desc_t *gdt =
+		(group_desc_t *) (meta + (size_t) sb.group_table_start * block_size);
+	for (int gg = 0; gg < ngroups; ++gg) {
+		size_t first = (size_t) gg * group_blocks;
+		size_t end = first + group_blocks;
+		end = end < block_count ? end : block_count;
+		size_t used = sb.data_start > first ? sb.data_start - first : 0;
+		gdt[gg].free_blocks = used < end - first ? end - first - used : 0;
+		int inodes = inode_count - gg * group_inodes;
+		inodes = inodes < group_inodes ? inodes : group_inodes;
+		gdt[gg].free_inodes = inodes > 0 ? inodes : 0;
+	}
+	journal_format(meta + (size_t) sb.journal_start * block_size);
+	rv = munmap(meta, meta_size);
+	assert(rv == 0);
+	return 0;
+}
+
+// Write a fresh file system to the given disk image.
+int blocks_format(const char *image_path, size_t size, int block_size,
+		int inode_count, int journal_blocks, int blocks_per_group) {
+	int fd = open(image_path, O_CREAT | O_RDWR, 0644);
+	if (fd == -1) {
+		perror(image_path);
+		return -1;
+	}
+	int rv = format_image(fd, size, block_size, inode_count, journal_blocks,
+			blocks_per_group);
+	close(fd);
+	return rv;
+}
+
+// Whether an image file holds nothing but zeros: a new file, or one only
+// sized with truncate. Only such a file is formatted on first mount, so
+// nothing is ever lost to it.
+static int image_is_blank(int fd, size_t size) {
+	size_t chunk = 1 << 20;
+	char *buf = malloc(chunk);
+	int blank = buf != NULL;
+	for (off_t pos = 0; blank && (size_t) pos < size;) {
+		// skip the holes of a sparse file
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0 && errno == ENXIO) {
+			break; // nothing but holes from pos on
+		}
+		data = data < 0 ? pos : data;
+		ssize_t len = pread(fd, buf, chunk, data);
+		if (len <= 0) {
+			blank = len == 0;
+			break;
+		}
+		for (ssize_t ii = 0; ii < len && blank; ++ii) {
+			blank = buf[ii] == 0;
+		}
+		pos = data + len;
+	}
+	free(buf);
+	return blank;
+}
+
 // Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
-	printf("Debug: Initializing blocks with path: %s\n", image_path);
+int blocks_init(const char *image_path) {
+	TRACE_OPEN(image_path);
 	blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-	assert(blocks_fd != -1);
+	if (blocks_fd == -1) {
+		perror(image_path);
+		return -1;
+	}
 
-	// make sure the disk image is exactly 1MB
-	int rv = ftruncate(blocks_fd, NUFS_SIZE);
+	struct stat st;
+	int rv = fstat(blocks_fd, &st);
 	assert(rv == 0);
 
+	// format the image if it is blank; anything else without a superblock
+	// is not ours to overwrite
+	superblock_t sb;
+	if (pread(blocks_fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+			sb.magic != NUFS_MAGIC) {
+		if (!image_is_blank(blocks_fd, st.st_size)) {
+			fprintf(stderr, "nufs: %s: not a nufs image (format it with mkfs.nufs)\n",
+					image_path);
+			close(blocks_fd);
+			return -1;
+		}
+		size_t size = st.st_size ? (size_t) st.st_size : NUFS_DEFAULT_SIZE;
+		if (format_image(blocks_fd, size, NUFS_DEFAULT_BLOCK_SIZE, 0, 0, 0) != 0) {
+			close(blocks_fd);
+			return -1;
+		}
+		rv = pread(blocks_fd, &sb, sizeof(sb), 0);
+		assert(rv == sizeof(sb));
+		rv = fstat(blocks_fd, &st);
+		assert(rv == 0);
+	}
+
+	if (sb.version != NUFS_VERSION) {
+		fprintf(stderr, "nufs: %s: unsupported format version %d (expected %d)\n",
+				image_path, sb.version, NUFS_VERSION);
+		close(blocks_fd);
+		return -1;
+	}
+	blocks_size = (size_t) sb.block_count * sb.block_size;
+	if ((size_t) st.st_size < blocks_size) {
+		fprintf(stderr, "nufs: %s: image is truncated (%zu of %zu bytes)\n",
+				image_path, (size_t) st.st_size, blocks_size);
+		close(blocks_fd);
+		return -1;
+	}
+	BLOCK_COUNT = sb.block_count;
+	BLOCK_SIZE = sb.block_size;
+	TRACE(TRACE_INFO, TRACE_MOUNT, BLOCK_COUNT, BLOCK_SIZE);
+
+	// bring the metadata up to date before anything reads it
+	if (journal_init(blocks_fd, &sb) != 0) {
+		close(blocks_fd);
+		return -1;
+	}
+
 	// map the image to memory
 	blocks_base =
-		mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+		mmap(0, blocks_size, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
 	assert(blocks_base != MAP_FAILED);
+	// metadata pages are copied only once they change, so no swap is
+	// reserved for the whole image
+	meta_base =
+		mmap(0, blocks_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE,
+			blocks_fd, 0);
+	assert(meta_base != MAP_FAILED);
 
-	// block 0 stores the block bitmap and the inode bitmap
-	void *bbm = get_blocks_bitmap();
-	bitmap_put(bbm, 0, 1);
+	// set up the allocation groups
+	group_count = sb.group_count;
+	blocks_per_group = sb.blocks_per_group;
+	inodes_per_group = sb.inodes_per_group;
+	groups = aligned_alloc(64, group_count * sizeof(alloc_group_t));
+	assert(groups != NULL);
+	uint8_t *bbm = get_blocks_bitmap();
+	uint8_t *ibm = get_inode_bitmap();
+	for (int gg = 0; gg < group_count; ++gg) {
+		alloc_group_t *grp = &groups[gg];
+		int first = gg * blocks_per_group;
+		int blocks = BLOCK_COUNT - first;
+		blocks = blocks < blocks_per_group ? blocks : blocks_per_group;
+		int inodes = sb.inode_count - gg * inodes_per_group;
+		inodes = inodes < inodes_per_group ? inodes : inodes_per_group;
+		pthread_mutex_init(&grp->lock, NULL);
+		freemap_build(&grp->free, bbm + first / 8, blocks, first);
+		bitmap_index_init(&grp->inodes,
+				ibm + (size_t) gg * inodes_per_group / 8, inodes > 0 ? inodes : 0);
+	}
+	data_dirty = calloc((BLOCK_COUNT + 63) / 64, sizeof(uint64_t));
+	assert(data_dirty != NULL);
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+	cpu_count = cpus > 0 ? cpus : 1;
+	return 0;
 }
 
-// Close the disk image.
+// Commit outstanding metadata changes and close the disk image.
 void blocks_free() {
-	int rv = munmap(blocks_base, NUFS_SIZE);
+	journal_shutdown();
+	for (int gg = 0; gg < group_count; ++gg) {
+		freemap_destroy(&groups[gg].free);
+		bitmap_index_destroy(&groups[gg].inodes);
+		pthread_mutex_destroy(&groups[gg].lock);
+	}
+	free(groups);
+	groups = 0;
+	group_count = 0;
+	free(data_dirty);
+	data_dirty = 0;
+	int rv = munmap(blocks_base, blocks_size);
 	assert(rv == 0);
+	rv = munmap(meta_base, blocks_size);
+	assert(rv == 0);
+	close(blocks_fd);
+	blocks_fd = -1;
+}
+
+// Return the superblock of the mounted image.
+superblock_t *blocks_superblock() { return (superblock_t *) meta_base; }
+
+// Return the descriptor of an allocation group.
+group_desc_t *blocks_group(int group) {
+	group_desc_t *gdt =
+		blocks_get_block(blocks_superblock()->group_table_start);
+	return &gdt[group];
+}
+
+// Count the free blocks and inodes over all groups.
+void blocks_usage(int *free_blocks, int *free_inodes) {
+	*free_blocks = 0;
+	*free_inodes = 0;
+	for (int gg = 0; gg < group_count; ++gg) {
+		group_desc_t *gd = blocks_group(gg);
+		*free_blocks += __atomic_load_n(&gd->free_blocks, __ATOMIC_RELAXED);
+		*free_inodes += __atomic_load_n(&gd->free_inodes, __ATOMIC_RELAXED);
+	}
+}
+
+// Get a metadata block, returning a pointer to its start.
+void *blocks_get_block(int bnum) {
+	return meta_base + (size_t) BLOCK_SIZE * bnum;
+}
+
+// Get a file data block, returning a pointer to its start.
+void *blocks_get_data(int bnum) {
+	return blocks_base + (size_t) BLOCK_SIZE * bnum;
+}
+
+// Get the file descriptor of the disk image.
+int blocks_data_fd() {
+	return blocks_fd;
 }
 
-// Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+// Record that file data blocks were written.
+void blocks_dirty_data(int bnum, int count) {
+	int end = bnum + count;
+	while (bnum < end) {
+		// a word of the bitmap at a time, for large writes
+		int shift = bnum % 64;
+		int bits = end - bnum < 64 - shift ? end - bnum : 64 - shift;
+		uint64_t mask = (bits == 64 ? ~0ULL : (1ULL << bits) - 1) << shift;
+		// most writes land in blocks that are already dirty
+		if ((__atomic_load_n(&data_dirty[bnum / 64], __ATOMIC_RELAXED) & mask) != mask) {
+			__atomic_fetch_or(&data_dirty[bnum / 64], mask, __ATOMIC_RELAXED);
+		}
+		bnum += bits;
+	}
+}
+
+// writes back count blocks from bnum, waiting for them if asked to
+static int sync_range(int bnum, int count, int wait) {
+	size_t len = (size_t) count * BLOCK_SIZE;
+	off_t off = (off_t) bnum * BLOCK_SIZE;
+	int rv = wait ? msync(blocks_get_data(bnum), len, MS_SYNC)
+	              : sync_file_range(blocks_fd, off, len, SYNC_FILE_RANGE_WRITE);
+	if (rv != 0) {
+		perror("nufs: sync");
+	}
+	return rv;
+}
+
+// Write back the dirty data blocks in a range.
+int blocks_sync_data(int bnum, int count, int wait) {
+	int rv = 0;
+	int run = -1; // first block of the current run of dirty blocks
+	for (int ii = bnum; ii <= bnum + count; ++ii) {
+		if (run < 0 && ii % 64 == 0 && ii + 64 <= bnum + count &&
+				__atomic_load_n(&data_dirty[ii / 64], __ATOMIC_RELAXED) == 0) {
+			ii += 63; // a whole clean word
+			continue;
+		}
+		int dirty = 0;
+		if (ii < bnum + count) {
+			uint64_t bit = 1ULL << (ii % 64);
+			// blocks written again after this are dirty again
+			dirty = wait ? __atomic_fetch_and(&data_dirty[ii / 64], ~bit, __ATOMIC_RELAXED) & bit
+			             : __atomic_load_n(&data_dirty[ii / 64], __ATOMIC_RELAXED) & bit;
+		}
+		if (dirty && run < 0) {
+			run = ii;
+		} else if (!dirty && run >= 0) {
+			rv |= sync_range(run, ii - run, wait);
+			run = -1;
+		}
+	}
+	return rv;
+}
 
 // Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+void *get_blocks_bitmap() {
+	return blocks_get_block(blocks_superblock()->block_bitmap_start);
+}
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
-	uint8_t *block = blocks_get_block(0);
+	return blocks_get_block(blocks_superblock()->inode_bitmap_start);
+}
+
+// The group the calling thread allocates from. CPUs are spread evenly over
+// the groups, so threads on different cores take different group locks and
+// fall back through different groups.
+static int preferred_group() {
+	int cpu = sched_getcpu();
+	if (cpu < 0) {
+		cpu = 0;
+	}
+	return (int) ((long) (cpu % cpu_count) * group_count / cpu_count);
+}
+
+// Marks count blocks from block start on used in the bitmap and the
+// descriptor of group gg, once the group's freemap has handed them out
+// (the group lock is held).
+static void group_take(int gg, int start, int count) {
+	uint8_t *bbm = get_blocks_bitmap();
+	for (int bnum = start; bnum < start + count; ++bnum) {
+		bitmap_put(bbm, bnum, 1);
+	}
+	journal_dirty(bbm + start / 8, (start + count - 1) / 8 - start / 8 + 1);
+	group_desc_t *gd = blocks_group(gg);
+	gd->free_blocks -= count;
+	journal_dirty(gd, sizeof(*gd));
+	TRACE(TRACE_DEBUG, TRACE_ALLOC_BLOCKS, start, count);
+}
+
+// Allocate up to count contiguous blocks within one group: from goal on
+// if it is free, otherwise the best fit for count.
+static int group_alloc_blocks(int gg, int goal, int count, int *got) {
+	alloc_group_t *grp = &groups[gg];
 
-	// The inode bitmap is stored immediately after the block bitmap
-	return (void *) (block + BLOCK_BITMAP_SIZE);
+	pthread_mutex_lock(&grp->lock);
+	int start = goal;
+	*got = goal >= 0 ? freemap_alloc_at(&grp->free, goal, count) : 0;
+	if (*got == 0) {
+		start = freemap_alloc_best(&grp->free, count, got);
+	}
+	if (start >= 0) {
+		group_take(gg, start, *got);
+	}
+	pthread_mutex_unlock(&grp->lock);
+	return start;
 }
 
 // Allocate a new block and return its index.
 int alloc_block() {
-	printf("Debug: Calling alloc_block\n");
-	void *bbm = get_blocks_bitmap();
+	int got;
+	return alloc_blocks(0, 1, &got);
+}
 
-	for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-		if (!bitmap_get(bbm, ii)) {
-			bitmap_put(bbm, ii, 1);
-			printf("+ alloc_block() -> %d\n", ii);
-			return ii;
+// Allocate up to count contiguous blocks, starting at goal if it is free.
+int alloc_blocks(int goal, int count, int *got) {
+	int home = goal > 0 && goal < BLOCK_COUNT ? goal / blocks_per_group
+	                                           : preferred_group();
+	for (int ii = 0; ii < group_count; ++ii) {
+		int gg = (home + ii) % group_count;
+		// unlocked peek to skip full groups; the lock settles it
+		if (__atomic_load_n(&blocks_group(gg)->free_blocks, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		int start = group_alloc_blocks(gg, ii == 0 && goal > 0 ? goal : -1, count, got);
+		if (start >= 0) {
+			stats_record(STAT_ALLOC_BLOCK_SCAN, ii + 1);
+			return start;
 		}
 	}
-
+	stats_record(STAT_ALLOC_BLOCK_SCAN, group_count);
 	return -1;
 }
 
+// Allocate count contiguous blocks, or the longest free run there is.
+int alloc_extent(int goal, int count, int *got) {
+	int home = goal > 0 && goal < BLOCK_COUNT ? goal / blocks_per_group
+	                                           : preferred_group();
+	int best = -1;
+	int best_len = 0;
+	for (int ii = 0; ii < group_count; ++ii) {
+		int gg = (home + ii) % group_count;
+		if (__atomic_load_n(&blocks_group(gg)->free_blocks, __ATOMIC_RELAXED) <= best_len) {
+			continue; // cannot beat the best run so far
+		}
+		alloc_group_t *grp = &groups[gg];
+		pthread_mutex_lock(&grp->lock);
+		int start = -1;
+		if (ii == 0 && goal > 0 && freemap_run_at(&grp->free, goal) >= count) {
+			// carry on from goal if the whole request fits there
+			start = goal;
+			freemap_alloc_at(&grp->free, goal, count);
+		} else {
+			start = freemap_alloc_exact(&grp->free, count);
+		}
+		if (start >= 0) {
+			group_take(gg, start, count);
+			pthread_mutex_unlock(&grp->lock);
+			stats_record(STAT_ALLOC_BLOCK_SCAN, ii + 1);
+			*got = count;
+			return start;
+		}
+		int len = freemap_longest(&grp->free);
+		pthread_mutex_unlock(&grp->lock);
+		if (len > best_len) {
+			best = gg;
+			best_len = len;
+		}
+	}
+	stats_record(STAT_ALLOC_BLOCK_SCAN, group_count);
+	if (best < 0) {
+		return -1;
+	}
+	// no run is long enough: take the longest, or whatever the group has
+	// left by now
+	int start = group_alloc_blocks(best, -1, best_len, got);
+	return start >= 0 ? start : alloc_blocks(0, best_len, got);
+}
+
+// Deallocate count contiguous blocks from block start on.
+void free_blocks(int start, int count) {
+	uint8_t *bbm = get_blocks_bitmap();
+	while (count > 0) {
+		int gg = start / blocks_per_group;
+		int end = (gg + 1) * blocks_per_group;
+		int len = start + count < end ? count : end - start;
+		alloc_group_t *grp = &groups[gg];
+		pthread_mutex_lock(&grp->lock);
+		int freed = 0;
+		for (int bnum = start; bnum < start + len; ++bnum) {
+			if (bitmap_get(bbm, bnum)) {
+				// free on disk now, reusable once that is committed
+				bitmap_put(bbm, bnum, 0);
+				journal_defer_free(bnum);
+				freed++;
+			}
+		}
+		if (freed > 0) {
+			journal_dirty(bbm + start / 8, (start + len - 1) / 8 - start / 8 + 1);
+			group_desc_t *gd = blocks_group(gg);
+			gd->free_blocks += freed;
+			journal_dirty(gd, sizeof(*gd));
+		}
+		pthread_mutex_unlock(&grp->lock);
+		TRACE(TRACE_DEBUG, TRACE_FREE_BLOCK, start, len);
+		start += len;
+		count -= len;
+	}
+}
+
 // Deallocate the block with the given index.
 void free_block(int bnum) {
-	printf("Debug: Calling free_block with bnum: %d\n", bnum);
-	printf("+ free_block(%d)\n", bnum);
-	void *bbm = get_blocks_bitmap();
-	bitmap_put(bbm, bnum, 0);
+	free_blocks(bnum, 1);
+}
+
+// Make blocks freed by a committed transaction available again.
+void release_blocks(int start, int count) {
+	while (count > 0) {
+		int gg = start / blocks_per_group;
+		int end = (gg + 1) * blocks_per_group;
+		int len = start + count < end ? count : end - start;
+		alloc_group_t *grp = &groups[gg];
+		pthread_mutex_lock(&grp->lock);
+		freemap_free(&grp->free, start, len);
+		pthread_mutex_unlock(&grp->lock);
+		start += len;
+		count -= len;
+	}
+}
+
+// Allocate an inode number from the given group, or this CPU's.
+int alloc_inum(int group) {
+	int home = group >= 0 && group < group_count ? group : preferred_group();
+	for (int ii = 0; ii < group_count; ++ii) {
+		int gg = (home + ii) % group_count;
+		group_desc_t *gd = blocks_group(gg);
+		// unlocked peek to skip full groups; the lock settles it
+		if (__atomic_load_n(&gd->free_inodes, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		alloc_group_t *grp = &groups[gg];
+		pthread_mutex_lock(&grp->lock);
+		int inum = gd->free_inodes > 0 ? bitmap_index_find(&grp->inodes, -1) : -1;
+		if (inum >= 0) {
+			bitmap_index_put(&grp->inodes, inum, 1);
+			journal_dirty((uint8_t *) grp->inodes.bm + inum / 8, 1);
+			gd->free_inodes--;
+			journal_dirty(gd, sizeof(*gd));
+		}
+		pthread_mutex_unlock(&grp->lock);
+		if (inum >= 0) {
+			TRACE(TRACE_DEBUG, TRACE_ALLOC_INODE, gg * inodes_per_group + inum, gg);
+			stats_record(STAT_ALLOC_INODE_SCAN, ii + 1);
+			return gg * inodes_per_group + inum;
+		}
+	}
+	stats_record(STAT_ALLOC_INODE_SCAN, group_count);
+	return -1;
+}
+
+// Choose the group for the inode of a new directory (the Orlov policy).
+int find_dir_group(int parent) {
+	long free_inodes = 0;
+	long free_blocks = 0;
+	long dirs = 0;
+	for (int gg = 0; gg < group_count; ++gg) {
+		group_desc_t *gd = blocks_group(gg);
+		free_inodes += __atomic_load_n(&gd->free_inodes, __ATOMIC_RELAXED);
+		free_blocks += __atomic_load_n(&gd->free_blocks, __ATOMIC_RELAXED);
+		dirs += __atomic_load_n(&gd->dirs, __ATOMIC_RELAXED);
+	}
+	long avg_inodes = free_inodes / group_count;
+	long avg_blocks = free_blocks / group_count;
+	int home = inode_group(parent);
+
+	if (parent == 0) {
+		// top-level directories spread out, each starting a new subtree
+		int start = (int) ((unsigned) __atomic_fetch_add(&dir_rotor, 1, __ATOMIC_RELAXED) %
+				group_count);
+		int best = -1;
+		int best_dirs = 0;
+		for (int ii = 0; ii < group_count; ++ii) {
+			int gg = (start + ii) % group_count;
+			group_desc_t *gd = blocks_group(gg);
+			int gd_dirs = __atomic_load_n(&gd->dirs, __ATOMIC_RELAXED);
+			if (__atomic_load_n(&gd->free_inodes, __ATOMIC_RELAXED) >= avg_inodes &&
+					__atomic_load_n(&gd->free_blocks, __ATOMIC_RELAXED) >= avg_blocks &&
+					(best < 0 || gd_dirs < best_dirs)) {
+				best = gg;
+				best_dirs = gd_dirs;
+			}
+		}
+		if (best >= 0) {
+			return best;
+		}
+	} else {
+		// stay near the parent while its group has room to spare
+		long max_dirs = dirs / group_count + inodes_per_group / 16;
+		long min_inodes = avg_inodes - inodes_per_group / 4;
+		long min_blocks = avg_blocks - blocks_per_group / 4;
+		for (int ii = 0; ii < group_count; ++ii) {
+			int gg = (home + ii) % group_count;
+			group_desc_t *gd = blocks_group(gg);
+			int gd_inodes = __atomic_load_n(&gd->free_inodes, __ATOMIC_RELAXED);
+			if (__atomic_load_n(&gd->dirs, __ATOMIC_RELAXED) < max_dirs &&
+					gd_inodes > 0 && gd_inodes >= min_inodes &&
+					__atomic_load_n(&gd->free_blocks, __ATOMIC_RELAXED) >= min_blocks) {
+				return gg;
+			}
+		}
+	}
+	// no group fits the policy: the first with average free inodes
+	for (int ii = 0; ii < group_count; ++ii) {
+		int gg = (home + ii) % group_count;
+		int gd_inodes = __atomic_load_n(&blocks_group(gg)->free_inodes, __ATOMIC_RELAXED);
+		if (gd_inodes > 0 && gd_inodes >= avg_inodes) {
+			return gg;
+		}
+	}
+	return home;
+}
+
+// Count a directory created in or removed from the group of an inode.
+void group_add_dir(int inum, int delta) {
+	int gg = inode_group(inum);
+	alloc_group_t *grp = &groups[gg];
+	group_desc_t *gd = blocks_group(gg);
+	pthread_mutex_lock(&grp->lock);
+	gd->dirs += delta;
+	journal_dirty(gd, sizeof(*gd));
+	pthread_mutex_unlock(&grp->lock);
+}
+
+// Get the group an inode belongs to.
+int inode_group(int inum) {
+	return inum / inodes_per_group;
+}
+
+// Get a goal block near an inode for its first data.
+int inode_block_goal(int inum) {
+	// block 0 is the superblock, and a goal of 0 means none
+	int goal = inode_group(inum) * blocks_per_group;
+	return goal > 0 ? goal : 1;
+}
+
+// Release an inode number.
+void free_inum(int inum) {
+	int gg = inum / inodes_per_group;
+	alloc_group_t *grp = &groups[gg];
+	int bit = inum - gg * inodes_per_group;
+	pthread_mutex_lock(&grp->lock);
+	if (bitmap_get(grp->inodes.bm, bit)) {
+		bitmap_index_put(&grp->inodes, bit, 0);
+		journal_dirty((uint8_t *) grp->inodes.bm + bit / 8, 1);
+		group_desc_t *gd = blocks_group(gg);
+		gd->free_inodes++;
+		journal_dirty(gd, sizeof(*gd));
+	}
+	pthread_mutex_unlock(&grp->lock);
+	TRACE(TRACE_DEBUG, TRACE_FREE_INODE, inum, 0);
 }
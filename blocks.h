@@ -5,23 +5,84 @@
  * A block-based abstraction over a disk image file.
  *
  * The disk image is mmapped, so block data is accessed using pointers.
+ * Block 0 holds the superblock, which records the geometry of the image.
+ *
+ * The image is mapped twice.  File data is read and written in place
+ * through a shared mapping.  Metadata goes through a private mapping, so
+ * changes to it reach the image only once they are committed through the
+ * journal (see journal.h).
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stddef.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT;
-extern const int BLOCK_SIZE;
-extern const int NUFS_SIZE;
-extern const int BLOCK_BITMAP_SIZE;
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 7
 
-//const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-//const int BLOCK_SIZE;  // default = 4K
-//const int NUFS_SIZE;   // default = 1MB
-//const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+#define NUFS_DEFAULT_SIZE (1024 * 1024)    // size of a new, empty image
+#define NUFS_DEFAULT_BLOCK_SIZE 4096
+#define NUFS_BYTES_PER_INODE (16 * 1024)   // inode density of new images
+#define NUFS_MIN_INODES 256
+#define NUFS_BLOCKS_PER_JOURNAL_BLOCK 128 // journal size of new images
+#define NUFS_MIN_JOURNAL_BLOCKS 16
+#define NUFS_MAX_JOURNAL_BLOCKS 8192
+#define NUFS_MIN_BLOCKS_PER_GROUP 512 // smallest group of a default format
 
-/** 
+/**
+ * On-disk superblock, stored at the start of block 0.
+ *
+ * All locations are block numbers.  Metadata is laid out in this order:
+ * superblock, group descriptors, block bitmap, inode bitmap, inode table,
+ * journal, data blocks.
+ *
+ * Blocks and inodes are split into allocation groups.  Group g owns the
+ * blocks [g * blocks_per_group, (g + 1) * blocks_per_group), whose bits are a
+ * word-aligned run of the block bitmap no longer than one block, and likewise
+ * a word-aligned run of inodes_per_group inodes.  Free counts live in the group descriptors, so
+ * allocations in different groups touch disjoint metadata.
+ */
+typedef struct superblock {
+  int magic;               // NUFS_MAGIC
+  int version;             // on-disk format version (NUFS_VERSION)
+  int block_size;          // bytes per block
+  int block_count;         // blocks in the image
+  int inode_count;         // inodes in the inode table
+  int block_bitmap_start;  // first block of the block bitmap
+  int block_bitmap_blocks; // length of the block bitmap
+  int inode_bitmap_start;  // first block of the inode bitmap
+  int inode_bitmap_blocks; // length of the inode bitmap
+  int inode_table_start;   // first block of the inode table
+  int inode_table_blocks;  // length of the inode table
+  int data_start;          // first block available for data
+  int group_count;         // number of allocation groups
+  int blocks_per_group;    // blocks in each group (the last may be short)
+  int inodes_per_group;    // inodes in each group (a multiple of 64)
+  int group_table_start;   // first block of the group descriptor table
+  int group_table_blocks;  // length of the group descriptor table
+  int journal_start;       // first block of the journal
+  int journal_blocks;      // length of the journal
+} superblock_t;
+
+/**
+ * On-disk descriptor of an allocation group.
+ *
+ * Descriptors are padded to 64 bytes so that groups updated by different
+ * threads do not share a cache line.
+ */
+typedef struct group_desc {
+  int free_blocks;   // unallocated blocks in the group
+  int free_inodes;   // unallocated inodes in the group
+  int dirs;          // directories whose inode is in the group
+  int _reserved[13];
+} group_desc_t;
+
+// geometry of the mounted image, loaded from the superblock
+extern int BLOCK_COUNT; // we split the "disk" into blocks
+extern int BLOCK_SIZE;  // default = 4K
+
+/**
  * Compute the number of blocks needed to store the given number of bytes.
  *
  * @param bytes Size of data to store in bytes.
@@ -30,27 +91,116 @@ extern const int BLOCK_BITMAP_SIZE;
  */
 int bytes_to_blocks(int bytes);
 
+/**
+ * Write a fresh superblock and empty bitmaps to the given disk image.
+ *
+ * The image is created or extended to the requested size if needed.
+ *
+ * @param image_path Path to the disk image file.
+ * @param size Size of the image in bytes.
+ * @param block_size Bytes per block (a power of two, at least 4K).
+ * @param inode_count Number of inodes (0 picks one per 16K of image).
+ * @param journal_blocks Length of the journal (0 picks one block per 128).
+ * @param blocks_per_group Blocks in each allocation group, a multiple of 64
+ *        up to 8 * block_size (0 picks about one group per CPU).
+ *
+ * @return 0 on success, -1 on error.
+ */
+int blocks_format(const char *image_path, size_t size, int block_size,
+                  int inode_count, int journal_blocks, int blocks_per_group);
+
 /**
  * Load and initialize the given disk image.
  *
+ * Blank images (new, or holding only zeros) are formatted to their current
+ * size, or NUFS_DEFAULT_SIZE if empty.  Otherwise the geometry is read from
+ * the superblock and committed journal transactions are replayed; a file
+ * with no superblock is refused rather than formatted.
+ *
  * @param image_path Path to the disk image file.
+ *
+ * @return 0 on success, -1 if the image cannot be used.
  */
-void blocks_init(const char *image_path);
+int blocks_init(const char *image_path);
 
 /**
- * Close the disk image.
+ * Commit outstanding metadata changes and close the disk image.
  */
 void blocks_free();
 
 /**
- * Get the block with the given index, returning a pointer to its start.
+ * Return the superblock of the mounted image.
+ *
+ * @return A pointer to the superblock in block 0.
+ */
+superblock_t *blocks_superblock();
+
+/**
+ * Return the descriptor of an allocation group.
+ *
+ * @param group Group number.
+ *
+ * @return A pointer to the group's descriptor.
+ */
+group_desc_t *blocks_group(int group);
+
+/**
+ * Count the free blocks and inodes over all groups.
+ *
+ * @param free_blocks Set to the number of unallocated blocks.
+ * @param free_inodes Set to the number of unallocated inodes.
+ */
+void blocks_usage(int *free_blocks, int *free_inodes);
+
+/**
+ * Get a metadata block, returning a pointer to its start.
+ *
+ * Changes made through the pointer must be reported with journal_dirty().
  *
  * @param bnum Block number (index).
  *
- * @return Pointer to the beginning of the block in memory.
+ * @return Pointer to the beginning of the block in the metadata mapping.
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get a file data block, returning a pointer to its start.
+ *
+ * @param bnum Block number (index).
+ *
+ * @return Pointer to the beginning of the block in the data mapping.
+ */
+void *blocks_get_data(int bnum);
+
+/**
+ * Get the file descriptor of the disk image.  Reading it at a block's
+ * byte offset sees what was written through the data mapping, since both
+ * share the page cache.
+ *
+ * @return The open file descriptor.
+ */
+int blocks_data_fd();
+
+/**
+ * Record that file data blocks were written through the data mapping.
+ *
+ * @param bnum First written block.
+ * @param count Number of written blocks.
+ */
+void blocks_dirty_data(int bnum, int count);
+
+/**
+ * Write back the dirty data blocks in a range.
+ *
+ * @param bnum First block of the range.
+ * @param count Number of blocks in the range.
+ * @param wait Nonzero to wait until the blocks are durable; otherwise
+ *             writeback is only started and the blocks stay dirty.
+ *
+ * @return 0 on success, -1 on an I/O error.
+ */
+int blocks_sync_data(int bnum, int count, int wait);
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -68,17 +218,134 @@ void *get_inode_bitmap();
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Takes the best fitting free block of the calling CPU's allocation
+ * group, moving on to the next group when that one is full.
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block();
 
+/**
+ * Allocate a run of contiguous blocks.
+ *
+ * The run starts at goal if that block is free, otherwise it is the
+ * shortest free extent of goal's group (or of the calling CPU's group if
+ * there is no goal) that holds count blocks, or the group's longest if
+ * none does.  It extends over at most count free blocks.  Runs never
+ * cross a group boundary.
+ *
+ * @param goal Preferred first block (0 for no preference).
+ * @param count Maximum number of blocks to allocate.
+ * @param got Set to the number of blocks actually allocated.
+ *
+ * @return The index of the first block of the run, or -1 if the disk is full.
+ */
+int alloc_blocks(int goal, int count, int *got);
+
+/**
+ * Allocate a run of contiguous blocks, searching every group for one
+ * that holds them all rather than settling for part of the request.
+ *
+ * Takes count blocks at goal if they are all free there, otherwise the
+ * best fitting free extent of count blocks in goal's group (or the
+ * calling CPU's) and then in the following groups.  If no group has such
+ * an extent, takes the longest one there is.
+ *
+ * @param goal Preferred first block (0 for no preference).
+ * @param count Maximum number of blocks to allocate.
+ * @param got Set to the number of blocks actually allocated.
+ *
+ * @return The index of the first block of the run, or -1 if the disk is full.
+ */
+int alloc_extent(int goal, int count, int *got);
+
 /**
  * Deallocate the block with the given number.
  *
+ * The block becomes free in the running transaction, but is only reused
+ * after the transaction has committed.
+ *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Deallocate a run of contiguous blocks, as free_block() does for each.
+ * Blocks of the run that are already free are skipped.
+ *
+ * @param start The first block to deallocate.
+ * @param count Number of blocks.
+ */
+void free_blocks(int start, int count);
+
+/**
+ * Make a run of blocks freed by a committed transaction available again,
+ * merging it with the free extents around it.
+ *
+ * @param start The first block to release.
+ * @param count Number of blocks.
+ */
+void release_blocks(int start, int count);
+
+/**
+ * Choose the group for the inode of a new directory (the Orlov policy).
+ *
+ * Directories created at the root are spread out: each goes to the group
+ * with the fewest directories among those with at least the average
+ * number of free inodes and blocks.  Deeper directories stay in their
+ * parent's group, or the next group after it, as long as that group is not
+ * crowded with directories or short of free inodes or blocks.  Files are
+ * then placed with their directory, so a subtree ends up close together.
+ *
+ * @param parent Inode number of the parent directory.
+ *
+ * @return The group to allocate the directory's inode from.
+ */
+int find_dir_group(int parent);
+
+/**
+ * Count a directory created in (delta 1) or removed from (delta -1) the
+ * group of an inode.
+ *
+ * @param inum The directory's inode number.
+ * @param delta Change to the group's directory count.
+ */
+void group_add_dir(int inum, int delta);
+
+/**
+ * Get the group an inode belongs to.
+ *
+ * @param inum Inode number.
+ *
+ * @return The inode's group.
+ */
+int inode_group(int inum);
+
+/**
+ * Get a goal block for data of an inode with no blocks to follow yet: the
+ * start of the inode's group, so data sits near its inode.
+ *
+ * @param inum Inode number.
+ *
+ * @return A block number to pass as goal to alloc_blocks().
+ */
+int inode_block_goal(int inum);
+
+/**
+ * Allocate an inode number.
+ *
+ * @param group Group to allocate from, or -1 for the calling CPU's group.
+ *              Other groups are tried when it has no free inodes.
+ *
+ * @return The allocated inode number, or -1 if there are no free inodes.
+ */
+int alloc_inum(int group);
+
+/**
+ * Release an inode number.
+ *
+ * @param inum The inode number to deallocate.
+ */
+void free_inum(int inum);
+
 #endif
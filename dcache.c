@@ -0,0 +1,152 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "directory.h"
+#include "stats.h"
+#include "util.h"
+
+// The cache is set associative: a (parent, name) pair hashes to one set
+// and may live in any of its ways.  A full set evicts its least recently
+// used way, so the cache never allocates. Each set has its own spinlock,
+// LRU clock and counters, so lookups in different sets share no writes.
+#define DCACHE_SETS 4096
+#define DCACHE_WAYS 4
+
+typedef struct dcache_entry {
+  int parent;   // directory inum, -1 for an empty way
+  int inum;     // entry inum, -1 for a negative entry
+  unsigned hash;
+  unsigned used; // set tick of the last hit, for LRU eviction
+  int len;
+  char name[DIR_NAME_LENGTH];
+} dcache_entry_t;
+
+typedef struct dcache_set {
+  pthread_spinlock_t lock;
+  unsigned tick; // bumped on every use of a way
+  dcache_stats_t stats;
+  dcache_entry_t ways[DCACHE_WAYS];
+} __attribute__((aligned(64))) dcache_set_t;
+
+static dcache_set_t dcache[DCACHE_SETS];
+static pthread_once_t dcache_once = PTHREAD_ONCE_INIT;
+
+// empties every way of every set
+static void dcache_reset() {
+    for (int ss = 0; ss < DCACHE_SETS; ++ss) {
+        pthread_spin_init(&dcache[ss].lock, PTHREAD_PROCESS_PRIVATE);
+        for (int ww = 0; ww < DCACHE_WAYS; ++ww) {
+            dcache[ss].ways[ww].parent = -1;
+        }
+    }
+}
+
+// hashes the key and locks its set, returning the set
+static dcache_set_t *dcache_lock_set(int parent, const char *name, int len, unsigned *hash) {
+    pthread_once(&dcache_once, dcache_reset);
+    *hash = name_hash(name, len) ^ (unsigned)parent * 0x9e3779b1u;
+    dcache_set_t *set = &dcache[*hash % DCACHE_SETS];
+    pthread_spin_lock(&set->lock);
+    return set;
+}
+
+// finds the way holding the key, or NULL
+static dcache_entry_t *dcache_find(dcache_entry_t *set, int parent, const char *name, int len, unsigned hash) {
+    for (int ww = 0; ww < DCACHE_WAYS; ++ww) {
+        dcache_entry_t *entry = &set[ww];
+        if (entry->parent == parent && entry->hash == hash &&
+            entry->len == len && memcmp(entry->name, name, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// looks up a name in a directory
+int dcache_lookup(int parent, const char *name, int len, int *inum) {
+    unsigned hash;
+    dcache_set_t *set = dcache_lock_set(parent, name, len, &hash);
+    dcache_entry_t *entry = dcache_find(set->ways, parent, name, len, hash);
+    if (entry == NULL) {
+        set->stats.misses++;
+        pthread_spin_unlock(&set->lock);
+        return 0;
+    }
+    entry->used = ++set->tick;
+    *inum = entry->inum;
+    set->stats.hits++;
+    if (*inum < 0) {
+        set->stats.negative++;
+    }
+    pthread_spin_unlock(&set->lock);
+    return 1;
+}
+
+// records the result of a lookup
+void dcache_insert(int parent, const char *name, int len, int inum) {
+    if (len >= DIR_NAME_LENGTH) {
+        return; // longer names are never stored in a directory
+    }
+    unsigned hash;
+    dcache_set_t *set = dcache_lock_set(parent, name, len, &hash);
+    dcache_entry_t *ways = set->ways;
+    dcache_entry_t *entry = dcache_find(ways, parent, name, len, hash);
+    if (entry == NULL) {
+        // take an empty way, or evict the least recently used one
+        entry = &ways[0];
+        for (int ww = 0; ww < DCACHE_WAYS; ++ww) {
+            if (ways[ww].parent == -1) {
+                entry = &ways[ww];
+                break;
+            }
+            if ((int)(ways[ww].used - entry->used) < 0) {
+                entry = &ways[ww];
+            }
+        }
+        entry->parent = parent;
+        entry->hash = hash;
+        entry->len = len;
+        memcpy(entry->name, name, len);
+        entry->name[len] = '\0';
+    }
+    entry->inum = inum;
+    entry->used = ++set->tick;
+    pthread_spin_unlock(&set->lock);
+}
+
+// drops every entry of a directory
+void dcache_purge(int parent) {
+    pthread_once(&dcache_once, dcache_reset);
+    for (int ss = 0; ss < DCACHE_SETS; ++ss) {
+        pthread_spin_lock(&dcache[ss].lock);
+        for (int ww = 0; ww < DCACHE_WAYS; ++ww) {
+            if (dcache[ss].ways[ww].parent == parent) {
+                dcache[ss].ways[ww].parent = -1;
+            }
+        }
+        pthread_spin_unlock(&dcache[ss].lock);
+    }
+}
+
+// reads the hit and miss counters, summed over the sets
+void dcache_get_stats(dcache_stats_t *stats) {
+    pthread_once(&dcache_once, dcache_reset);
+    memset(stats, 0, sizeof(dcache_stats_t));
+    for (int ss = 0; ss < DCACHE_SETS; ++ss) {
+        pthread_spin_lock(&dcache[ss].lock);
+        stats->hits += dcache[ss].stats.hits;
+        stats->negative += dcache[ss].stats.negative;
+        stats->misses += dcache[ss].stats.misses;
+        pthread_spin_unlock(&dcache[ss].lock);
+    }
+}
+
+// copies the counters into their metrics
+void dcache_report_stats() {
+    dcache_stats_t stats;
+    dcache_get_stats(&stats);
+    stats_set_count(STAT_DCACHE_HITS, stats.hits);
+    stats_set_count(STAT_DCACHE_MISSES, stats.misses);
+    stats_set_count(STAT_DCACHE_NEGATIVE_HITS, stats.negative);
+}
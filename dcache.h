@@ -0,0 +1,62 @@
+/**
+ * @file dcache.h
+ *
+ * An in-memory cache of directory entries, keyed by (parent inum, name).
+ *
+ * Path lookups consult the cache before scanning a directory.  Negative
+ * entries (inum -1) remember names that are known not to exist.  The
+ * directory layer keeps the cache coherent: every change to a directory's
+ * entries updates the cache entry for that name.
+ */
+#ifndef DCACHE_H
+#define DCACHE_H
+
+typedef struct dcache_stats {
+  long hits;     // lookups answered by the cache (including negative)
+  long negative; // hits that were negative entries
+  long misses;   // lookups that had to scan the directory
+} dcache_stats_t;
+
+/**
+ * Look up a name in a directory.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Entry name (need not be NUL-terminated).
+ * @param len Length of the name.
+ * @param inum Set to the cached inode number (-1 for a negative entry).
+ *
+ * @return 1 on a hit, 0 on a miss.
+ */
+int dcache_lookup(int parent, const char *name, int len, int *inum);
+
+/**
+ * Record the result of a lookup, replacing any entry for the same name.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Entry name (need not be NUL-terminated).
+ * @param len Length of the name.
+ * @param inum Inode number the name maps to, or -1 if it does not exist.
+ */
+void dcache_insert(int parent, const char *name, int len, int inum);
+
+/**
+ * Drop every entry of a directory, e.g. before its inode number is reused.
+ *
+ * @param parent Inode number of the directory.
+ */
+void dcache_purge(int parent);
+
+/**
+ * Read the hit and miss counters.
+ *
+ * @param stats Filled in with the current counters.
+ */
+void dcache_get_stats(dcache_stats_t *stats);
+
+/**
+ * Copy the counters into the dcache.* metrics (see stats.h); the stats
+ * source while the file system is up.
+ */
+void dcache_report_stats();
+
+#endif
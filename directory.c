@@ -1,104 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/stat.h>
+#include "dcache.h"
 #include "directory.h"
 #include "inode.h"
+#include "journal.h"
 #include "blocks.h"
 #include "bitmap.h"
-#include "slist.h"
+#include "stats.h"
 #include "util.h"
 
+// looks up one path component in a directory, through the dentry cache
+static int lookup_component(int parent, path_name_t *comp) {
+    inode_t *dir = get_inode(parent);
+    if (!S_ISDIR(dir->mode)) {
+        return -1; // not a directory
+    }
+    int inum;
+    // scan the directory only if the dentry cache has no answer
+    if (!dcache_lookup(parent, comp->name, comp->len, &inum)) {
+        // the result is cached before the directory can change again
+        inode_lock_shared(parent);
+        inum = directory_lookup(dir, comp->name, comp->len);
+        dcache_insert(parent, comp->name, comp->len, inum);
+        inode_unlock(parent);
+    }
+    return inum;
+}
+
+// resolves a path in one walk from the root, returning the inode of its
+// last component (or -1). The parent directory's inode is stored in
+// *parent (-1 if it does not exist, as for the root) and the last
+// component in *leaf, both valid even when the leaf itself is missing.
+int inode_path_resolve(const char *path, int *parent, path_name_t *leaf) {
+    STATS_TIME(STAT_PATH_LOOKUP);
+    const char *cursor = path;
+    path_name_t comp;
+    int inum = 0; // Root directory assumed to be at inode 0
+    *parent = -1;
+    leaf->name = path;
+    leaf->len = 0;
+    while (path_next(&cursor, &comp)) {
+        if (inum < 0) {
+            // a directory on the way is missing
+            *parent = -1;
+            return -1;
+        }
+        *parent = inum;
+        *leaf = comp;
+        inum = lookup_component(inum, &comp);
+    }
+    return inum;
+}
+
 // look through directory to find inode based on the given path
 int inode_path_lookup(const char* path) {
-    if (strcmp(path, "/") == 0) {
-        return 0; // Root directory assumed to be at inode 0
-    }
-    slist_t* dir_list = slist_explode(path, '/');	// split by '/', add to linked list
-    slist_t* list_start = dir_list;
-    // directory lookup starting from root inode, stops if lookup fails
-    int inum = 0;
-    while (dir_list != NULL && inum != -1) {
-        inode_t* cur_dir = get_inode(inum);
-        inum = directory_lookup(cur_dir, dir_list->data);
-        dir_list = dir_list->next;
-    }
-    // free linked list
-    slist_free(list_start);
-    return inum;
+    int parent;
+    path_name_t leaf;
+    return inode_path_resolve(path, &parent, &leaf);
 }
 
-// searches through a directory to find an entry with the same name as name
-int directory_lookup(inode_t *dd, const char *name) {
-    // get block associated with *dd
-    dirent_t *directory = (dirent_t *)blocks_get_block(dd->block);
-    // iterate through directory
+// entries per directory block
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(dirent_t))
+// entries per index node
+#define DX_LIMIT ((BLOCK_SIZE - (int)sizeof(dx_node_t)) / (int)sizeof(dx_entry_t))
+
+// position of a leaf in the index: the index nodes leading to it and the
+// entry followed in each
+typedef struct dx_path {
+    int levels;  // interior levels below the root
+    int root_at; // entry followed in the root
+    int node;    // file block of the interior node (levels == 1)
+    int node_at; // entry followed in the interior node
+    int leaf;    // file block of the leaf
+} dx_path_t;
+
+// returns a pointer to the given block of the directory
+static void *dir_block(inode_t *dd, int fblock) {
+    return blocks_get_block(inode_get_bnum(dd, fblock));
+}
+
+// appends a zeroed block to the directory, returning its file block index
+static int dir_add_block(inode_t *dd) {
+    int fblock = bytes_to_blocks(dd->size);
+    if (grow_inode(dd, fblock * BLOCK_SIZE + BLOCK_SIZE - dd->size) == -1) {
+        return -1;
+    }
+    return fblock;
+}
+
+// returns a pointer to the ii-th entry of a linear directory
+static dirent_t *directory_entry(inode_t *dd, int ii) {
+    dirent_t *block = dir_block(dd, ii / DIRENTS_PER_BLOCK);
+    return &block[ii % DIRENTS_PER_BLOCK];
+}
+
+// finds the entry that covers hash in an index node
+static int dx_search(dx_node_t *node, unsigned hash) {
+    // last entry whose lower bound is <= hash; entries[0] covers from 0
+    int lo = 0;
+    int hi = node->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (node->entries[mid].hash <= hash) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// walks the index down to the leaf covering hash
+static void dx_find_leaf(inode_t *dd, unsigned hash, dx_path_t *path) {
+    dx_node_t *root = dir_block(dd, 0);
+    path->levels = root->levels;
+    path->root_at = dx_search(root, hash);
+    path->leaf = root->entries[path->root_at].block;
+    if (root->levels > 0) {
+        path->node = path->leaf;
+        dx_node_t *node = dir_block(dd, path->node);
+        path->node_at = dx_search(node, hash);
+        path->leaf = node->entries[path->node_at].block;
+    }
+}
+
+// inserts an entry into an index node at position at
+static void dx_node_insert(dx_node_t *node, int at, unsigned hash, int block) {
+    memmove(&node->entries[at + 1], &node->entries[at],
+            (node->count - at) * sizeof(dx_entry_t));
+    node->entries[at].hash = hash;
+    node->entries[at].block = block;
+    node->count++;
+    journal_dirty(node, BLOCK_SIZE);
+}
+
+// adds the index entry for a new leaf right after the entry in path,
+// adding an index level or splitting an interior node when they are full
+static int dx_insert_index(inode_t *dd, dx_path_t *path, unsigned hash, int leaf) {
+    dx_node_t *root = dir_block(dd, 0);
+    if (path->levels == 0) {
+        if (root->count < DX_LIMIT) {
+            dx_node_insert(root, path->root_at + 1, hash, leaf);
+            return 0;
+        }
+        // the root is full: move its entries down into a new interior node
+        int fblock = dir_add_block(dd);
+        if (fblock == -1) {
+            return -1;
+        }
+        root = dir_block(dd, 0);
+        dx_node_t *node = dir_block(dd, fblock);
+        memcpy(node, root, BLOCK_SIZE);
+        node->levels = 0;
+        root->levels = 1;
+        root->count = 1;
+        root->entries[0].hash = 0;
+        root->entries[0].block = fblock;
+        journal_dirty(root, BLOCK_SIZE);
+        journal_dirty(node, BLOCK_SIZE);
+        path->levels = 1;
+        path->node = fblock;
+        path->node_at = path->root_at;
+        path->root_at = 0;
+    }
+
+    dx_node_t *node = dir_block(dd, path->node);
+    int at = path->node_at + 1;
+    if (node->count == DX_LIMIT) {
+        // split the interior node in half and index the upper half
+        if (root->count == DX_LIMIT) {
+            return -1; // the directory is at its maximum size
+        }
+        int fblock = dir_add_block(dd);
+        if (fblock == -1) {
+            return -1;
+        }
+        root = dir_block(dd, 0);
+        node = dir_block(dd, path->node);
+        dx_node_t *upper = dir_block(dd, fblock);
+        int half = node->count / 2;
+        upper->count = node->count - half;
+        memcpy(upper->entries, &node->entries[half], upper->count * sizeof(dx_entry_t));
+        node->count = half;
+        journal_dirty(upper, BLOCK_SIZE);
+        journal_dirty(node, BLOCK_SIZE);
+        dx_node_insert(root, path->root_at + 1, upper->entries[0].hash, fblock);
+        if (at > half) {
+            node = upper;
+            at -= half;
+        }
+    }
+    dx_node_insert(node, at, hash, leaf);
+    return 0;
+}
+
+// orders dirents by hash
+static int dirent_hash_cmp(const void *a, const void *b) {
+    unsigned ha = ((const dirent_t *)a)->hash;
+    unsigned hb = ((const dirent_t *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// splits a full leaf by hash, returning the leaf that now covers hash
+static int dx_split_leaf(inode_t *dd, dx_path_t *path, unsigned hash) {
+    dirent_t *leaf = dir_block(dd, path->leaf);
+    int count = DIRENTS_PER_BLOCK;
+    dirent_t sorted[count];
+    memcpy(sorted, leaf, sizeof(sorted));
+    qsort(sorted, count, sizeof(dirent_t), dirent_hash_cmp);
+
+    // split near the middle, keeping equal hashes on the same side
+    int mid = count / 2;
+    while (mid < count && sorted[mid].hash == sorted[mid - 1].hash) {
+        mid++;
+    }
+    if (mid == count) {
+        mid = count / 2;
+        while (mid > 0 && sorted[mid].hash == sorted[mid - 1].hash) {
+            mid--;
+        }
+        if (mid == 0) {
+            return -1; // every entry has the same hash
+        }
+    }
+    unsigned split = sorted[mid].hash;
+
+    int fblock = dir_add_block(dd);
+    if (fblock == -1 || dx_insert_index(dd, path, split, fblock) == -1) {
+        return -1;
+    }
+    leaf = dir_block(dd, path->leaf);
+    dirent_t *upper = dir_block(dd, fblock);
+    memset(leaf, 0, BLOCK_SIZE);
+    memcpy(leaf, sorted, mid * sizeof(dirent_t));
+    memcpy(upper, &sorted[mid], (count - mid) * sizeof(dirent_t));
+    journal_dirty(leaf, BLOCK_SIZE);
+    journal_dirty(upper, BLOCK_SIZE);
+    return hash >= split ? fblock : path->leaf;
+}
+
+// checks whether a dirent holds the given name
+static int dirent_matches(dirent_t *entry, const char *name, int len, unsigned hash) {
+    // the stored hash rules out almost every other name without comparing
+    return entry->hash == hash && entry->name[0] != '\0' &&
+           memcmp(entry->name, name, len) == 0 && entry->name[len] == '\0';
+}
+
+// finds the named entry in a leaf, or NULL
+static dirent_t *dx_leaf_find(dirent_t *leaf, const char *name, int len, unsigned hash) {
+    for (int ii = 0; ii < DIRENTS_PER_BLOCK; ++ii) {
+        if (dirent_matches(&leaf[ii], name, len, hash)) {
+            return &leaf[ii];
+        }
+    }
+    return NULL;
+}
+
+// finds the named entry of a hashed or linear directory, or NULL
+static dirent_t *directory_find(inode_t *dd, const char *name, int len, int *index) {
+    if (len >= DIR_NAME_LENGTH) {
+        return NULL; // too long to be stored
+    }
+    unsigned hash = name_hash(name, len);
+    if (dd->flags & INODE_HASHED) {
+        dx_path_t path;
+        dx_find_leaf(dd, hash, &path);
+        return dx_leaf_find(dir_block(dd, path.leaf), name, len, hash);
+    }
     for (int ii = 0; ii < dd->size / sizeof(dirent_t); ++ii) {
-        dirent_t *entry = &directory[ii];
-	// compare entry name with the name it's looking for
-        if (strcmp(entry->name, name) == 0) {
-            return entry->inum;
+        dirent_t *entry = directory_entry(dd, ii);
+        if (dirent_matches(entry, name, len, hash)) {
+            *index = ii;
+            return entry;
         }
     }
+    return NULL;
+}
+
+// converts a full linear directory to the hashed format
+static int dx_convert(inode_t *dd) {
+    dirent_t entries[DIRENTS_PER_BLOCK];
+    int count = dd->size / sizeof(dirent_t);
+    memcpy(entries, dir_block(dd, 0), count * sizeof(dirent_t));
+
+    // block 0 becomes the root, block 1 the single leaf holding everything
+    if (dir_add_block(dd) == -1) {
+        return -1;
+    }
+    dx_node_t *root = dir_block(dd, 0);
+    memset(root, 0, BLOCK_SIZE);
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = 1;
+    memcpy(dir_block(dd, 1), entries, count * sizeof(dirent_t));
+    dd->flags |= INODE_HASHED;
+    dd->free_slot = 0;
+    dd->holes = 0;
+    journal_dirty(root, BLOCK_SIZE);
+    journal_dirty(dir_block(dd, 1), BLOCK_SIZE);
+    journal_dirty(dd, sizeof(inode_t));
+    return 0;
+}
+
+// fills a free dirent slot of the given block, which holds every other
+// entry with the same hash, giving it the lowest minor they leave unused
+static void dirent_set(dirent_t *block, dirent_t *entry, const char *name, int len,
+                       unsigned hash, int inum) {
+    // fewer than 64 other entries fit in the block
+    unsigned long long used = 0;
+    for (int ii = 0; ii < DIRENTS_PER_BLOCK; ++ii) {
+        if (block[ii].name[0] != '\0' && block[ii].hash == hash) {
+            used |= 1ULL << block[ii].minor;
+        }
+    }
+    int minor = 0;
+    while (used & (1ULL << minor)) {
+        minor++;
+    }
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    entry->inum = inum;
+    entry->hash = hash;
+    entry->minor = minor;
+    journal_dirty(entry, sizeof(dirent_t));
+}
+
+// adds an entry to a hashed directory
+static int dx_put(inode_t *dd, const char *name, int len, unsigned hash, int inum) {
+    dx_path_t path;
+    dx_find_leaf(dd, hash, &path);
+    dirent_t *leaf = dir_block(dd, path.leaf);
+    dirent_t *slot = NULL;
+    for (int ii = 0; ii < DIRENTS_PER_BLOCK && slot == NULL; ++ii) {
+        if (leaf[ii].name[0] == '\0') {
+            slot = &leaf[ii];
+        }
+    }
+    if (slot == NULL) {
+        // the leaf is full; after the split one half has room
+        int fblock = dx_split_leaf(dd, &path, hash);
+        if (fblock == -1) {
+            return -1;
+        }
+        leaf = dir_block(dd, fblock);
+        for (int ii = 0; slot == NULL; ++ii) {
+            if (leaf[ii].name[0] == '\0') {
+                slot = &leaf[ii];
+            }
+        }
+    }
+    dirent_set(leaf, slot, name, len, hash, inum);
+    return 0;
+}
+
+// The directory functions below expect the caller to hold the directory's
+// inode lock: shared for lookups, exclusive for changes. Changes must be
+// made within a journal operation.
+
+// searches through a directory to find an entry with the same name as name
+int directory_lookup(inode_t *dd, const char *name, int len) {
+    int index;
+    dirent_t *entry = directory_find(dd, name, len, &index);
     // no such file exists
-    return -1;
+    return entry ? entry->inum : -1;
 }
 
 // adds a new entry to this directory with the given name and inode index
-int directory_put(inode_t *dd, const char *name, int inum) {
-    // calculate size after adding entry
-    int new_size = dd->size + sizeof(dirent_t);
-    // add the given inode
-    if (grow_inode(dd, sizeof(dirent_t)) == -1) {
-	    return -1;
-    }
-    // gets the block associated with *dd
-    dirent_t *directory = (dirent_t *)blocks_get_block(dd->block);
-    dirent_t *new_entry = &directory[dd->size / sizeof(dirent_t)];
-    // assign a name and inode index to the directory
-    strncpy(new_entry->name, name, DIR_NAME_LENGTH);
-    new_entry->inum = inum;
-    // update size
-    dd->size = new_size;
+int directory_put(inode_t *dd, const char *name, int len, int inum) {
+    if (len == 0 || len >= DIR_NAME_LENGTH) {
+        return -1; // name does not fit in a dirent
+    }
+    unsigned hash = name_hash(name, len);
+    // a directory that outgrows its first block gets a hashed index
+    if (!(dd->flags & INODE_HASHED) && dd->free_slot == 0 &&
+        dd->size + sizeof(dirent_t) > BLOCK_SIZE) {
+        if (dx_convert(dd) == -1) {
+            return -1;
+        }
+    }
+    if (dd->flags & INODE_HASHED) {
+        if (dx_put(dd, name, len, hash, inum) == -1) {
+            return -1;
+        }
+    } else if (dd->free_slot != 0) {
+        // take the first free slot off the list
+        dirent_t *entry = directory_entry(dd, dd->free_slot - 1);
+        dd->free_slot = entry->inum;
+        dd->holes--;
+        journal_dirty(dd, sizeof(inode_t));
+        dirent_set(dir_block(dd, 0), entry, name, len, hash, inum);
+    } else {
+        // index of the new entry
+        int ii = dd->size / sizeof(dirent_t);
+        // make room for the entry, growing into a new block if needed
+        if (grow_inode(dd, sizeof(dirent_t)) == -1) {
+            return -1;
+        }
+        // assign a name and inode index to the directory
+        dirent_set(dir_block(dd, 0), directory_entry(dd, ii), name, len, hash, inum);
+    }
+    // replaces a cached negative entry for the name
+    dcache_insert(inode_get_inum(dd), name, len, inum);
     // sucessful
     return 0;
 }
 
-// deletes an entry with the specified name in the directory. Updates the other entries accordingly
-int directory_delete(inode_t *dd, const char *name) {
-    // gets the block associated with *dd
-    dirent_t *directory = (dirent_t *)blocks_get_block(dd->block);
-    // number of directory entries
-    int entries = dd->size / sizeof(dirent_t);
-    // iterate through entries
-    for (int ii = 0; ii < entries; ++ii) {
-        dirent_t *entry = &directory[ii];
-	// if it finds the entry to delete, it is deleted
-        if (strcmp(entry->name, name) == 0) {
-	    // the remaining entries' are shifted
-            for (int jj = ii; jj < entries - 1; ++jj) {
-                directory[jj] = directory[jj + 1];
+// points an existing entry at another inode, in place; no slot is taken,
+// so this cannot run out of space
+int directory_replace(inode_t *dd, const char *name, int len, int inum) {
+    int index;
+    dirent_t *entry = directory_find(dd, name, len, &index);
+    if (entry == NULL) {
+        return -1;
+    }
+    entry->inum = inum;
+    journal_dirty(entry, sizeof(dirent_t));
+    dcache_insert(inode_get_inum(dd), name, len, inum);
+    return 0;
+}
+
+// gives back the free slots at the end of a linear directory, releasing
+// the block once it is empty, and relinks the free slots left below the
+// new end. No live entry changes slot, so readdir offsets stay valid.
+static void directory_trim(inode_t *dd) {
+    int slots = dd->size / sizeof(dirent_t);
+    int end = slots;
+    while (end > 0 && directory_entry(dd, end - 1)->name[0] == '\0') {
+        end--;
+    }
+    // the list is rebuilt lowest slot first
+    dd->free_slot = 0;
+    dd->holes = 0;
+    for (int ii = end - 1; ii >= 0; --ii) {
+        dirent_t *entry = directory_entry(dd, ii);
+        if (entry->name[0] == '\0') {
+            entry->inum = dd->free_slot;
+            dd->free_slot = ii + 1;
+            dd->holes++;
+            journal_dirty(entry, sizeof(dirent_t));
+        }
+    }
+    journal_dirty(dd, sizeof(inode_t));
+    shrink_inode(dd, (slots - end) * sizeof(dirent_t));
+}
+
+// deletes an entry with the specified name in the directory
+int directory_delete(inode_t *dd, const char *name, int len) {
+    int index;
+    dirent_t *entry = directory_find(dd, name, len, &index);
+    if (entry == NULL) {
+        // entry not found
+        return -1;
+    }
+    // the slot is freed in place; hashed leaves need nothing more
+    memset(entry, 0, sizeof(dirent_t));
+    journal_dirty(entry, sizeof(dirent_t));
+    if (!(dd->flags & INODE_HASHED)) {
+        if (index == dd->size / sizeof(dirent_t) - 1) {
+            // the last slot is given back, with any free slots before it
+            directory_trim(dd);
+        } else {
+            // the slot goes on the free list, and the other entries stay put
+            entry->inum = dd->free_slot;
+            dd->free_slot = index + 1;
+            dd->holes++;
+            journal_dirty(dd, sizeof(inode_t));
+        }
+    }
+    // the name is now known not to exist
+    dcache_insert(inode_get_inum(dd), name, len, -1);
+    return 0;
+}
+
+// the readdir position of an entry
+static long dirent_key(const dirent_t *entry) {
+    return (long)entry->hash << 16 | entry->minor;
+}
+
+// orders dirent pointers by key
+static int dirent_key_cmp(const void *a, const void *b) {
+    long ka = dirent_key(*(dirent_t *const *)a);
+    long kb = dirent_key(*(dirent_t *const *)b);
+    return (ka > kb) - (ka < kb);
+}
+
+// visits the entries of one block with a key of at least pos, in key order
+static int visit_block(dirent_t *block, int count, long pos, dirent_visit_fn visit, void *ctx) {
+    dirent_t *sorted[DIRENTS_PER_BLOCK];
+    int n = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        if (block[ii].name[0] != '\0' && dirent_key(&block[ii]) >= pos) {
+            sorted[n++] = &block[ii];
+        }
+    }
+    qsort(sorted, n, sizeof(dirent_t *), dirent_key_cmp);
+    for (int ii = 0; ii < n; ++ii) {
+        if (visit(ctx, sorted[ii]->name, sorted[ii]->inum, dirent_key(sorted[ii]) + 1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Walks the entries of a directory in order of their key (hash, minor),
+// starting at the first entry whose key is at least pos. The key does not
+// depend on where the entry is stored, so it stays valid as a resume point
+// while entries move: a leaf split or the switch to a hashed index changes
+// only the block an entry is in. A hashed directory keeps each hash range
+// in one leaf and its index in hash order, so the walk starts at the leaf
+// covering pos and visits the leaves after it in index order.
+int directory_iterate(inode_t *dd, long pos, dirent_visit_fn visit, void *ctx) {
+    if (!(dd->flags & INODE_HASHED)) {
+        int slots = dd->size / (int)sizeof(dirent_t);
+        return slots > 0 && visit_block(dir_block(dd, 0), slots, pos, visit, ctx);
+    }
+    if ((unsigned long)pos >> 48 != 0) {
+        return 0; // past every key
+    }
+    dx_path_t path;
+    dx_find_leaf(dd, (unsigned)(pos >> 16), &path);
+    dx_node_t *root = dir_block(dd, 0);
+    for (int rr = path.root_at; rr < root->count; ++rr) {
+        if (root->levels == 0) {
+            if (visit_block(dir_block(dd, root->entries[rr].block), DIRENTS_PER_BLOCK, pos,
+                            visit, ctx)) {
+                return 1;
+            }
+            continue;
+        }
+        dx_node_t *node = dir_block(dd, root->entries[rr].block);
+        for (int nn = rr == path.root_at ? path.node_at : 0; nn < node->count; ++nn) {
+            if (visit_block(dir_block(dd, node->entries[nn].block), DIRENTS_PER_BLOCK, pos,
+                            visit, ctx)) {
+                return 1;
             }
-	    // update size
-            dd->size -= sizeof(dirent_t);
-            return 0;
         }
     }
-    // entry not found
-    return -1;
+    return 0;
 }
 
-// separate the path by a forward slash and create a list
-slist_t* directory_list(const char* path) {
-    return slist_explode(path, '/');
+// prints an entry for print_directory
+static int print_entry(void *ctx, const char *name, int inum, long next) {
+    printf("%s\n", name);
+    return 0;
 }
 
 // prints a directory's data
 void print_directory(inode_t *dd) {
-    slist_t *list = directory_list("..."); // Path to the directory
-    // iterate and print each entry's data
-    for (slist_t *it = list; it != NULL; it = it->next) {
-        printf("%s\n", it->data);
-    }
-    // free memory
-    slist_free(list);
+    directory_iterate(dd, 0, print_entry, NULL);
 }
-
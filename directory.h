@@ -10,19 +10,56 @@
 
 #include "blocks.h"
 #include "inode.h"
-#include "slist.h"
+#include "path.h"
 
 typedef struct dirent {
-  char name[DIR_NAME_LENGTH];
-  int inum;
-  char _reserved[12];
+  char name[DIR_NAME_LENGTH]; // empty name = free slot
+  int inum;                   // of a free linear slot: next free slot + 1
+  unsigned hash;              // name_hash() of the name
+  unsigned short minor;       // unique among the entries with the same hash
+  char _reserved[6];
 } dirent_t;
 
+// readdir walks a directory in order of (hash, minor), which stays the
+// same however the entries are moved between blocks; see
+// directory_iterate.
+
+// Directories that outgrow one block switch to a hashed index (like ext3's
+// htree) and set INODE_HASHED. File block 0 then holds the root index node,
+// which maps hash ranges to leaf blocks, either directly or through one
+// level of interior index nodes. Leaf blocks are arrays of dirents with
+// free slots; all entries with the same hash live in the same leaf.
+
+// one hash range of an index node
+typedef struct dx_entry {
+  unsigned hash; // lowest hash covered by the block
+  int block;     // file block index of the child
+} dx_entry_t;
+
+typedef struct dx_node {
+  int levels; // interior levels below the root (root node only)
+  int count;  // entries in use, sorted by hash; entries[0].hash is 0
+  dx_entry_t entries[];
+} dx_node_t;
+
+// A directory that fits in one block is a linear array of dirents. A
+// deleted entry leaves a free slot behind rather than moving the entries
+// after it; the free slots form a list (inode_t::free_slot), and new
+// entries fill them before the array grows. Free slots at the end are
+// given back, so the array shrinks without any entry changing its slot.
+
 void directory_init();
-int directory_lookup(inode_t *di, const char *name);
-int directory_put(inode_t *di, const char *name, int inum);
-int directory_delete(inode_t *di, const char *name);
-slist_t *directory_list(const char *path);
+// names are (pointer, length) views and need not be NUL-terminated
+int directory_lookup(inode_t *di, const char *name, int len);
+int directory_put(inode_t *di, const char *name, int len, int inum);
+int directory_delete(inode_t *di, const char *name, int len);
+int directory_replace(inode_t *di, const char *name, int len, int inum);
+int inode_path_lookup(const char *path);
+int inode_path_resolve(const char *path, int *parent, path_name_t *leaf);
+// called by directory_iterate for each entry with the position to resume
+// after it; returning nonzero stops the walk
+typedef int (*dirent_visit_fn)(void *ctx, const char *name, int inum, long next);
+int directory_iterate(inode_t *dd, long pos, dirent_visit_fn visit, void *ctx);
 void print_directory(inode_t *dd);
 
 #endif
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "directory.h"
+#include "inode.h"
+#include "storage.h"
+
+#define TEST_NAME "directory_test.img"
+#define SLOTS_PER_BLOCK (NUFS_DEFAULT_BLOCK_SIZE / (int) sizeof(dirent_t))
+
+// names collected by a readdir, which stops after limit entries
+typedef struct listing {
+  char names[512][DIR_NAME_LENGTH];
+  int count;
+  int limit;
+  off_t next; // where to resume
+} listing_t;
+
+int collect(void *buf, const char *name, const struct stat *st, off_t next) {
+  listing_t *ls = buf;
+  if (ls->count == ls->limit) {
+    return 1;
+  }
+  if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    strcpy(ls->names[ls->count++], name);
+  }
+  ls->next = next;
+  return 0;
+}
+
+// how often name shows up in a listing
+int seen(listing_t *ls, const char *name) {
+  int times = 0;
+  for (int i = 0; i < ls->count; i++) {
+    times += strcmp(ls->names[i], name) == 0;
+  }
+  return times;
+}
+
+void create(const char *dir, const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  storage_mknod(path, S_IFREG | 0644);
+}
+
+void delete(const char *dir, const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  storage_unlink(path);
+}
+
+int exists(const char *dir, const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  return inode_path_lookup(path) >= 0;
+}
+
+void print_state(const char *what, inode_t *dd) {
+  if (dd->flags & INODE_HASHED) {
+    printf("%s: hashed, %d blocks\n", what, bytes_to_blocks(dd->size));
+  } else {
+    printf("%s: linear, %d slots, %d holes, free list head %d\n", what,
+           dd->size / (int) sizeof(dirent_t), dd->holes, dd->free_slot);
+  }
+}
+
+// prints the entries of a linear directory in slot order
+void print_slots(inode_t *dd) {
+  dirent_t *block = blocks_get_block(inode_get_bnum(dd, 0));
+  for (int i = 0; i < dd->size / (int) sizeof(dirent_t); i++) {
+    if (block[i].name[0] != '\0') {
+      printf(" %s@%d", block[i].name, i);
+    }
+  }
+  putchar('\n');
+}
+
+int main(int argc, char **argv) {
+  unlink(TEST_NAME);
+  if (blocks_format(TEST_NAME, 8 << 20, NUFS_DEFAULT_BLOCK_SIZE, 0, 0, 0) != 0 ||
+      storage_init(TEST_NAME) != 0) {
+    printf("Could not set up the image\n");
+    return 1;
+  }
+  int failed = 0;
+  char name[32];
+
+  // deleted entries leave holes that new entries fill, most recent first
+  storage_mknod("/lin", S_IFDIR | 0755);
+  inode_t *lin = get_inode(inode_path_lookup("/lin"));
+  for (int i = 0; i < 10; i++) {
+    snprintf(name, sizeof(name), "f%02d", i);
+    create("/lin", name);
+  }
+  delete("/lin", "f03");
+  delete("/lin", "f06");
+  print_state("Deleted f03 and f06", lin);
+  failed |= lin->holes != 2 || lin->free_slot != 7;
+  create("/lin", "g1");
+  create("/lin", "g2");
+  print_state("Created g1 and g2", lin);
+  printf("Slots (expected g1@6, g2@3):");
+  print_slots(lin);
+  failed |= lin->holes != 0 || lin->size != 10 * sizeof(dirent_t);
+
+  // entries keep their slots; only free slots at the end are given back
+  const char *doomed[] = {"f00", "f01", "f02", "f04", "f05", "f07"};
+  for (int i = 0; i < 6; i++) {
+    delete("/lin", doomed[i]);
+  }
+  print_state("Deleted six entries", lin);
+  failed |= lin->holes != 6 || lin->size != 10 * sizeof(dirent_t);
+  delete("/lin", "f09");
+  delete("/lin", "f08");
+  print_state("Deleted f09 and f08", lin);
+  printf("Slots after trimming (expected g2@3, g1@6):");
+  print_slots(lin);
+  failed |= lin->holes != 5 || lin->size != 7 * sizeof(dirent_t);
+  failed |= !exists("/lin", "g1") || !exists("/lin", "g2");
+  create("/lin", "g3");
+  failed |= !exists("/lin", "g3") || lin->holes != 4 || lin->size != 7 * sizeof(dirent_t);
+
+  // a readdir resumed after deletes sees every remaining entry once
+  storage_mknod("/rd", S_IFDIR | 0755);
+  for (int i = 0; i < 20; i++) {
+    snprintf(name, sizeof(name), "r%02d", i);
+    create("/rd", name);
+  }
+  static listing_t ls;
+  ls.limit = 5;
+  storage_readdir("/rd", 0, collect, &ls);
+  // one entry already listed goes, and two that are not
+  char gone[3][DIR_NAME_LENGTH];
+  strcpy(gone[0], ls.names[0]);
+  for (int i = 0, n = 1; n < 3; i++) {
+    snprintf(name, sizeof(name), "r%02d", i);
+    if (!seen(&ls, name)) {
+      strcpy(gone[n++], name);
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    delete("/rd", gone[i]);
+  }
+  ls.limit = 512;
+  storage_readdir("/rd", ls.next, collect, &ls);
+  int resumed_ok = ls.count == 17 + 1; // gone[0] was listed before it went
+  for (int i = 0; i < 20; i++) {
+    snprintf(name, sizeof(name), "r%02d", i);
+    int want = strcmp(name, gone[1]) == 0 || strcmp(name, gone[2]) == 0 ? 0 : 1;
+    resumed_ok &= seen(&ls, name) == want;
+  }
+  printf("Readdir resumed across deletes: %d entries, %s\n", ls.count,
+         resumed_ok ? "each once" : "WRONG");
+  failed |= !resumed_ok;
+
+  // rm -rf: unlink each batch a readdir returns, resuming after it, while
+  // the entries in the last slots go early and the block is trimmed
+  storage_mknod("/rm", S_IFDIR | 0755);
+  for (int i = 0; i < SLOTS_PER_BLOCK; i++) {
+    snprintf(name, sizeof(name), "m%02d", i);
+    create("/rm", name);
+  }
+  int removed = 0;
+  int twice = 0;
+  off_t pos = 0;
+  for (int round = 0;; round++) {
+    memset(&ls, 0, sizeof(ls));
+    ls.limit = 8;
+    ls.next = pos;
+    storage_readdir("/rm", pos, collect, &ls);
+    if (ls.count == 0) {
+      break;
+    }
+    for (int i = 0; i < ls.count; i++) {
+      if (exists("/rm", ls.names[i])) {
+        delete("/rm", ls.names[i]);
+        removed++;
+      } else {
+        twice++;
+      }
+    }
+    if (round == 0) {
+      for (int i = SLOTS_PER_BLOCK - 8; i < SLOTS_PER_BLOCK; i++) {
+        snprintf(name, sizeof(name), "m%02d", i);
+        if (exists("/rm", name)) {
+          delete("/rm", name);
+          removed++;
+        }
+      }
+    }
+    pos = ls.next;
+  }
+  int still = 0;
+  for (int i = 0; i < SLOTS_PER_BLOCK; i++) {
+    snprintf(name, sizeof(name), "m%02d", i);
+    still += exists("/rm", name);
+  }
+  printf("Readdir and unlink: removed %d, still present %d, listed twice %d\n",
+         removed, still, twice);
+  failed |= removed != SLOTS_PER_BLOCK || still != 0 || twice != 0;
+
+  // a full block with holes fills them before it converts to hashed
+  storage_mknod("/hx", S_IFDIR | 0755);
+  inode_t *hx = get_inode(inode_path_lookup("/hx"));
+  for (int i = 0; i < SLOTS_PER_BLOCK; i++) {
+    snprintf(name, sizeof(name), "h%03d", i);
+    create("/hx", name);
+  }
+  delete("/hx", "h010");
+  delete("/hx", "h020");
+  print_state("Full block less two", hx);
+  create("/hx", "x1");
+  create("/hx", "x2");
+  print_state("Holes refilled", hx);
+  failed |= (hx->flags & INODE_HASHED) != 0;
+  create("/hx", "x3");
+  print_state("One more entry", hx);
+  failed |= !(hx->flags & INODE_HASHED);
+
+  // leaves split as the hashed directory grows
+  for (int i = SLOTS_PER_BLOCK; i < 400; i++) {
+    snprintf(name, sizeof(name), "h%03d", i);
+    create("/hx", name);
+  }
+  int found = 0;
+  for (int i = 0; i < 400; i++) {
+    snprintf(name, sizeof(name), "h%03d", i);
+    found += exists("/hx", name);
+  }
+  memset(&ls, 0, sizeof(ls));
+  ls.limit = 512;
+  storage_readdir("/hx", 0, collect, &ls);
+  printf("Hashed: %d blocks, %d of 398 names found, %d listed (expected 401)\n",
+         bytes_to_blocks(hx->size), found, ls.count);
+  failed |= found != 398 || ls.count != 401 || bytes_to_blocks(hx->size) < 8;
+
+  // a readdir resumed while the directory converts to hashed and its
+  // leaves split sees every entry that was there all along exactly once
+  storage_mknod("/gr", S_IFDIR | 0755);
+  for (int i = 0; i < 60; i++) {
+    snprintf(name, sizeof(name), "old%02d", i);
+    create("/gr", name);
+  }
+  static listing_t all;
+  off_t next = 0;
+  for (int added = 0;; added += 40) {
+    memset(&ls, 0, sizeof(ls));
+    ls.limit = 10;
+    ls.next = next;
+    storage_readdir("/gr", next, collect, &ls);
+    if (ls.count == 0) {
+      break;
+    }
+    for (int i = 0; i < ls.count && all.count < 512; i++) {
+      strcpy(all.names[all.count++], ls.names[i]);
+    }
+    for (int i = added; i < added + 40 && i < 400; i++) {
+      snprintf(name, sizeof(name), "new%03d", i);
+      create("/gr", name);
+    }
+    next = ls.next;
+  }
+  int growing_ok = 1;
+  for (int i = 0; i < 60; i++) {
+    snprintf(name, sizeof(name), "old%02d", i);
+    growing_ok &= seen(&all, name) == 1;
+  }
+  for (int i = 0; i < 400; i++) {
+    snprintf(name, sizeof(name), "new%03d", i);
+    growing_ok &= seen(&all, name) <= 1;
+  }
+  printf("Readdir resumed while growing: %d listed, %s\n", all.count,
+         growing_ok ? "each once" : "WRONG");
+  failed |= !growing_ok;
+
+  storage_destroy();
+  unlink(TEST_NAME);
+  printf("%s\n", failed ? "FAILED" : "All checks passed");
+  return failed;
+}
@@ -0,0 +1,349 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "freemap.h"
+
+// the two trees an extent is linked into
+#define BY_START 0
+#define BY_SIZE 1
+
+// A free extent. The same node is linked into both trees, with a set of
+// child links and a height for each.
+struct freemap_node {
+  int start;
+  int length;
+  freemap_node_t *left[2];
+  freemap_node_t *right[2];
+  int height[2];
+};
+
+// orders two extents within tree t
+static int node_cmp(int t, const freemap_node_t *a, const freemap_node_t *b) {
+  if (t == BY_SIZE && a->length != b->length) {
+    return a->length < b->length ? -1 : 1;
+  }
+  return (a->start > b->start) - (a->start < b->start);
+}
+
+static int height(int t, freemap_node_t *n) {
+  return n ? n->height[t] : 0;
+}
+
+static void update(int t, freemap_node_t *n) {
+  int hl = height(t, n->left[t]);
+  int hr = height(t, n->right[t]);
+  n->height[t] = (hl > hr ? hl : hr) + 1;
+}
+
+static freemap_node_t *rotate_right(int t, freemap_node_t *n) {
+  freemap_node_t *l = n->left[t];
+  n->left[t] = l->right[t];
+  l->right[t] = n;
+  update(t, n);
+  update(t, l);
+  return l;
+}
+
+static freemap_node_t *rotate_left(int t, freemap_node_t *n) {
+  freemap_node_t *r = n->right[t];
+  n->right[t] = r->left[t];
+  r->left[t] = n;
+  update(t, n);
+  update(t, r);
+  return r;
+}
+
+// restores the AVL balance of a subtree whose children are balanced
+static freemap_node_t *rebalance(int t, freemap_node_t *n) {
+  update(t, n);
+  int diff = height(t, n->left[t]) - height(t, n->right[t]);
+  if (diff > 1) {
+    if (height(t, n->left[t]->left[t]) < height(t, n->left[t]->right[t])) {
+      n->left[t] = rotate_left(t, n->left[t]);
+    }
+    return rotate_right(t, n);
+  }
+  if (diff < -1) {
+    if (height(t, n->right[t]->right[t]) < height(t, n->right[t]->left[t])) {
+      n->right[t] = rotate_right(t, n->right[t]);
+    }
+    return rotate_left(t, n);
+  }
+  return n;
+}
+
+static freemap_node_t *tree_insert(int t, freemap_node_t *root, freemap_node_t *n) {
+  if (root == NULL) {
+    n->left[t] = n->right[t] = NULL;
+    n->height[t] = 1;
+    return n;
+  }
+  if (node_cmp(t, n, root) < 0) {
+    root->left[t] = tree_insert(t, root->left[t], n);
+  } else {
+    root->right[t] = tree_insert(t, root->right[t], n);
+  }
+  return rebalance(t, root);
+}
+
+// unlinks the leftmost node of a subtree into *min
+static freemap_node_t *tree_remove_min(int t, freemap_node_t *root, freemap_node_t **min) {
+  if (root->left[t] == NULL) {
+    *min = root;
+    return root->right[t];
+  }
+  root->left[t] = tree_remove_min(t, root->left[t], min);
+  return rebalance(t, root);
+}
+
+static freemap_node_t *tree_remove(int t, freemap_node_t *root, freemap_node_t *n) {
+  assert(root != NULL);
+  int c = node_cmp(t, n, root);
+  if (c < 0) {
+    root->left[t] = tree_remove(t, root->left[t], n);
+  } else if (c > 0) {
+    root->right[t] = tree_remove(t, root->right[t], n);
+  } else {
+    if (root->left[t] == NULL) {
+      return root->right[t];
+    }
+    if (root->right[t] == NULL) {
+      return root->left[t];
+    }
+    freemap_node_t *next;
+    freemap_node_t *right = tree_remove_min(t, root->right[t], &next);
+    next->left[t] = root->left[t];
+    next->right[t] = right;
+    return rebalance(t, next);
+  }
+  return rebalance(t, root);
+}
+
+static void link_node(freemap_t *fm, freemap_node_t *n) {
+  fm->by_start = tree_insert(BY_START, fm->by_start, n);
+  fm->by_size = tree_insert(BY_SIZE, fm->by_size, n);
+  fm->extents++;
+}
+
+static void unlink_node(freemap_t *fm, freemap_node_t *n) {
+  fm->by_start = tree_remove(BY_START, fm->by_start, n);
+  fm->by_size = tree_remove(BY_SIZE, fm->by_size, n);
+  fm->extents--;
+}
+
+static void add_extent(freemap_t *fm, int start, int length) {
+  freemap_node_t *n = malloc(sizeof(freemap_node_t));
+  assert(n != NULL);
+  n->start = start;
+  n->length = length;
+  link_node(fm, n);
+}
+
+// changes the bounds of an extent; its place among the others by start
+// stays the same, so only the size tree is updated
+static void resize_extent(freemap_t *fm, freemap_node_t *n, int start, int length) {
+  fm->by_size = tree_remove(BY_SIZE, fm->by_size, n);
+  n->start = start;
+  n->length = length;
+  fm->by_size = tree_insert(BY_SIZE, fm->by_size, n);
+}
+
+// the extent with the greatest start at or before bnum, or NULL
+static freemap_node_t *find_at_or_before(freemap_t *fm, int bnum) {
+  freemap_node_t *best = NULL;
+  freemap_node_t *n = fm->by_start;
+  while (n != NULL) {
+    if (n->start <= bnum) {
+      best = n;
+      n = n->right[BY_START];
+    } else {
+      n = n->left[BY_START];
+    }
+  }
+  return best;
+}
+
+// the extent with the smallest start after bnum, or NULL
+static freemap_node_t *find_after(freemap_t *fm, int bnum) {
+  freemap_node_t *best = NULL;
+  freemap_node_t *n = fm->by_start;
+  while (n != NULL) {
+    if (n->start > bnum) {
+      best = n;
+      n = n->left[BY_START];
+    } else {
+      n = n->right[BY_START];
+    }
+  }
+  return best;
+}
+
+// the shortest extent of at least count blocks, or NULL
+static freemap_node_t *find_fit(freemap_t *fm, int count) {
+  freemap_node_t *best = NULL;
+  freemap_node_t *n = fm->by_size;
+  while (n != NULL) {
+    if (n->length >= count) {
+      best = n;
+      n = n->left[BY_SIZE];
+    } else {
+      n = n->right[BY_SIZE];
+    }
+  }
+  return best;
+}
+
+// the longest extent (the rightmost by size), or NULL
+static freemap_node_t *find_longest(freemap_t *fm) {
+  freemap_node_t *n = fm->by_size;
+  while (n != NULL && n->right[BY_SIZE] != NULL) {
+    n = n->right[BY_SIZE];
+  }
+  return n;
+}
+
+// Build the index from a bitmap, where clear bits are free blocks.
+void freemap_build(freemap_t *fm, const void *bm, int nbits, int base) {
+  const uint64_t *words = (const uint64_t *) bm;
+  fm->by_start = NULL;
+  fm->by_size = NULL;
+  fm->extents = 0;
+  fm->blocks = 0;
+
+  int run = -1; // start of the free run being scanned, -1 if none
+  for (int i = 0; i < nbits;) {
+    uint64_t word = words[i / 64];
+    if (i % 64 == 0 && nbits - i >= 64 && (word == 0 || word == ~0ULL)) {
+      // a whole word continues or ends the run
+      if (word == 0 && run < 0) {
+        run = i;
+      } else if (word != 0 && run >= 0) {
+        add_extent(fm, base + run, i - run);
+        fm->blocks += i - run;
+        run = -1;
+      }
+      i += 64;
+      continue;
+    }
+    int used = (word >> (i % 64)) & 1;
+    if (!used && run < 0) {
+      run = i;
+    } else if (used && run >= 0) {
+      add_extent(fm, base + run, i - run);
+      fm->blocks += i - run;
+      run = -1;
+    }
+    i++;
+  }
+  if (run >= 0) {
+    add_extent(fm, base + run, nbits - run);
+    fm->blocks += nbits - run;
+  }
+}
+
+static void free_subtree(freemap_node_t *n) {
+  if (n != NULL) {
+    free_subtree(n->left[BY_START]);
+    free_subtree(n->right[BY_START]);
+    free(n);
+  }
+}
+
+// Release the memory held by an index.
+void freemap_destroy(freemap_t *fm) {
+  free_subtree(fm->by_start);
+  fm->by_start = NULL;
+  fm->by_size = NULL;
+  fm->extents = 0;
+  fm->blocks = 0;
+}
+
+// Allocate the free blocks from start on, up to count of them.
+int freemap_alloc_at(freemap_t *fm, int start, int count) {
+  freemap_node_t *n = find_at_or_before(fm, start);
+  if (n == NULL || start >= n->start + n->length) {
+    return 0;
+  }
+  int end = n->start + n->length;
+  int take = end - start < count ? end - start : count;
+  if (start == n->start) {
+    if (take == n->length) {
+      unlink_node(fm, n);
+      free(n);
+    } else {
+      resize_extent(fm, n, start + take, n->length - take);
+    }
+  } else {
+    // split: the head keeps the node, the tail (if any) gets a new one
+    resize_extent(fm, n, n->start, start - n->start);
+    if (start + take < end) {
+      add_extent(fm, start + take, end - (start + take));
+    }
+  }
+  fm->blocks -= take;
+  return take;
+}
+
+// Allocate exactly count contiguous blocks by best fit.
+int freemap_alloc_exact(freemap_t *fm, int count) {
+  freemap_node_t *n = find_fit(fm, count);
+  if (n == NULL) {
+    return -1;
+  }
+  int start = n->start;
+  freemap_alloc_at(fm, start, count);
+  return start;
+}
+
+// Allocate count contiguous blocks by best fit, or the longest extent.
+int freemap_alloc_best(freemap_t *fm, int count, int *got) {
+  freemap_node_t *n = find_fit(fm, count);
+  if (n == NULL) {
+    n = find_longest(fm); // nothing is long enough
+  }
+  if (n == NULL) {
+    return -1;
+  }
+  int start = n->start;
+  *got = freemap_alloc_at(fm, start, count);
+  return start;
+}
+
+// Return blocks to the index, merging them with their free neighbours.
+void freemap_free(freemap_t *fm, int start, int count) {
+  freemap_node_t *prev = find_at_or_before(fm, start);
+  freemap_node_t *next = find_after(fm, start);
+  assert(prev == NULL || prev->start + prev->length <= start);
+  assert(next == NULL || next->start >= start + count);
+  int joins_prev = prev != NULL && prev->start + prev->length == start;
+  int joins_next = next != NULL && next->start == start + count;
+  if (joins_prev && joins_next) {
+    int length = prev->length + count + next->length;
+    unlink_node(fm, next);
+    free(next);
+    resize_extent(fm, prev, prev->start, length);
+  } else if (joins_prev) {
+    resize_extent(fm, prev, prev->start, prev->length + count);
+  } else if (joins_next) {
+    resize_extent(fm, next, start, next->length + count);
+  } else {
+    add_extent(fm, start, count);
+  }
+  fm->blocks += count;
+}
+
+// Get the length of the longest free extent.
+int freemap_longest(freemap_t *fm) {
+  freemap_node_t *n = find_longest(fm);
+  return n ? n->length : 0;
+}
+
+// Count the free blocks from bnum to the end of its free extent.
+int freemap_run_at(freemap_t *fm, int bnum) {
+  freemap_node_t *n = find_at_or_before(fm, bnum);
+  if (n == NULL || bnum >= n->start + n->length) {
+    return 0;
+  }
+  return n->start + n->length - bnum;
+}
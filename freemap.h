@@ -0,0 +1,108 @@
+/**
+ * @file freemap.h
+ *
+ * An in-memory index of the free extents (maximal runs of free blocks) in a
+ * range of blocks.
+ *
+ * Every extent sits in two AVL trees: one ordered by first block, to find
+ * the extent holding a block and the neighbours a freed run coalesces with,
+ * and one ordered by length (then first block), for best-fit and
+ * longest-run searches.  All operations take O(log n) in the number of
+ * free extents.
+ *
+ * The index is not persistent.  It is built from the block bitmap at mount,
+ * and the caller updates the bitmap alongside it.  It takes no locks.
+ */
+#ifndef FREEMAP_H
+#define FREEMAP_H
+
+typedef struct freemap_node freemap_node_t;
+
+typedef struct freemap {
+  freemap_node_t *by_start; // extents ordered by first block
+  freemap_node_t *by_size;  // extents ordered by length, then first block
+  int extents;              // number of free extents
+  long blocks;              // number of free blocks
+} freemap_t;
+
+/**
+ * Build the index from a bitmap, where clear bits are free blocks.
+ *
+ * @param fm Index to initialize.
+ * @param bm The bitmap (8-byte aligned).
+ * @param nbits Number of bits to index.
+ * @param base Block number of bit 0.
+ */
+void freemap_build(freemap_t *fm, const void *bm, int nbits, int base);
+
+/**
+ * Release the memory held by an index.
+ *
+ * @param fm Index to destroy.
+ */
+void freemap_destroy(freemap_t *fm);
+
+/**
+ * Allocate the free blocks from start on, up to count of them.
+ *
+ * @param fm Index to allocate from.
+ * @param start First block wanted.
+ * @param count Maximum number of blocks to take.
+ *
+ * @return The number of blocks taken, 0 if start is not free.
+ */
+int freemap_alloc_at(freemap_t *fm, int start, int count);
+
+/**
+ * Allocate exactly count contiguous blocks from the shortest free extent
+ * that holds them (best fit).
+ *
+ * @param fm Index to allocate from.
+ * @param count Number of blocks.
+ *
+ * @return The first block allocated, or -1 if no extent is long enough.
+ */
+int freemap_alloc_exact(freemap_t *fm, int count);
+
+/**
+ * Allocate count contiguous blocks by best fit, or the whole longest free
+ * extent if none holds count blocks.
+ *
+ * @param fm Index to allocate from.
+ * @param count Number of blocks wanted.
+ * @param got Set to the number of blocks allocated.
+ *
+ * @return The first block allocated, or -1 if nothing is free.
+ */
+int freemap_alloc_best(freemap_t *fm, int count, int *got);
+
+/**
+ * Return blocks to the index, merging them with the free extents on
+ * either side.  The blocks must not be free already.
+ *
+ * @param fm Index to free into.
+ * @param start First block.
+ * @param count Number of blocks.
+ */
+void freemap_free(freemap_t *fm, int start, int count);
+
+/**
+ * Get the length of the longest free extent.
+ *
+ * @param fm Index to query.
+ *
+ * @return The length in blocks, 0 if nothing is free.
+ */
+int freemap_longest(freemap_t *fm);
+
+/**
+ * Count the free blocks from a block to the end of its free extent.
+ *
+ * @param fm Index to query.
+ * @param bnum Block number.
+ *
+ * @return The number of free blocks from bnum on, 0 if bnum is not free.
+ */
+int freemap_run_at(freemap_t *fm, int bnum);
+
+#endif
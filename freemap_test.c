@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bitmap.h"
+#include "freemap.h"
+
+#define SIZE 4096
+
+// checks the index against the bitmap it mirrors
+int matches(freemap_t *fm, uint64_t *bm) {
+  long free_blocks = 0;
+  for (int i = 0; i < SIZE; i++) {
+    int is_free = !bitmap_get(bm, i);
+    free_blocks += is_free;
+    if ((freemap_run_at(fm, i) > 0) != is_free) {
+      return 0;
+    }
+  }
+  return free_blocks == fm->blocks;
+}
+
+void take(uint64_t *bm, int start, int count) {
+  for (int i = 0; i < count; i++) {
+    bitmap_put(bm, start + i, 1);
+  }
+}
+
+int main(int argc, char **argv) {
+  uint64_t bm[SIZE / 64] = {0};
+  // used: 0-9, 100, 200-299
+  take(bm, 0, 10);
+  take(bm, 100, 1);
+  take(bm, 200, 100);
+
+  freemap_t fm;
+  freemap_build(&fm, bm, SIZE, 0);
+  printf("Built: %d extents, %ld free, longest %d\n", fm.extents, fm.blocks,
+         freemap_longest(&fm));
+
+  int start = freemap_alloc_exact(&fm, 50);
+  printf("Exactly 50 blocks (best fit): %d\n", start);
+  take(bm, start, 50);
+
+  start = freemap_alloc_exact(&fm, 99);
+  printf("Exactly 99 blocks (best fit): %d\n", start);
+  take(bm, start, 99);
+
+  int got;
+  start = freemap_alloc_best(&fm, 5000, &got);
+  printf("Best run of 5000 blocks: %d (got %d)\n", start, got);
+  take(bm, start, got);
+
+  printf("At 60 (free) and 150 (used): got %d and %d\n", freemap_alloc_at(&fm, 60, 10),
+         freemap_alloc_at(&fm, 150, 10));
+  take(bm, 60, 10);
+  printf("Extents: %d, free %ld, longest %d\n", fm.extents, fm.blocks, freemap_longest(&fm));
+
+  printf("Freeing 300-4095 and 10-69 (coalescing)\n");
+  freemap_free(&fm, 300, SIZE - 300);
+  freemap_free(&fm, 10, 60);
+  for (int i = 10; i < 70; i++) {
+    bitmap_put(bm, i, 0);
+  }
+  for (int i = 300; i < SIZE; i++) {
+    bitmap_put(bm, i, 0);
+  }
+  printf("Extents: %d, free %ld, longest %d\n", fm.extents, fm.blocks, freemap_longest(&fm));
+
+  // random single-block churn
+  srand(1);
+  for (int i = 0; i < 100000; i++) {
+    int b = rand() % SIZE;
+    if (bitmap_get(bm, b)) {
+      if (b >= 10) {
+        freemap_free(&fm, b, 1);
+        bitmap_put(bm, b, 0);
+      }
+    } else if (freemap_alloc_at(&fm, b, 1) == 1) {
+      bitmap_put(bm, b, 1);
+    }
+  }
+  printf("After churn: %d extents, index %s the bitmap\n", fm.extents,
+         matches(&fm, bm) ? "matches" : "DOES NOT MATCH");
+
+  freemap_t rebuilt;
+  freemap_build(&rebuilt, bm, SIZE, 0);
+  printf("Rebuilt: %d extents, longest %d (was %d)\n", rebuilt.extents,
+         freemap_longest(&rebuilt), freemap_longest(&fm));
+  freemap_destroy(&rebuilt);
+  freemap_destroy(&fm);
+  return 0;
+}
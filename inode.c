@@ -1,89 +1,940 @@
 #include "inode.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "journal.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 // The main inode.c implementations
 
-const int INODE_COUNT = 256;
+_Static_assert(sizeof(inode_t) == 128, "inode_t must stay 128 bytes");
+
+// Inode locks are reader/writer locks hashed by inum. Operations that
+// lock several inodes take them with inode_lock_many, which always
+// acquires in ascending lock order, so they cannot deadlock each other.
+#define INODE_LOCKS 4096
+static pthread_rwlock_t inode_locks[INODE_LOCKS];
+
+// open handles per inode; pinned inodes survive their last unlink
+static int* inode_pins;
 
 // gets an inode based on the given inum index
 inode_t* get_inode(int inum) {
-	void* inodes = blocks_get_block(1); // Assuming inode list is stored in block 1
+	void* inodes = blocks_get_block(blocks_superblock()->inode_table_start);
 	return (inode_t*)(inodes + (sizeof(inode_t) * inum));
 }
 
-// searches for a free inode, updates bitmap, initializes the inode and allocates a block
-int alloc_inode(int mode) {
-    // gets bitmap
-    void* ibm = get_inode_bitmap();
-    // iterate through inode numbers to look for a free inode
-    for (int ii = 1; ii < INODE_COUNT; ++ii) {
-        if (!bitmap_get(ibm, ii)) {
-	    // sets the free inode's correspoinding bit in the bitmap
-            bitmap_put(ibm, ii, 1);
-	    // initializes the newly created inode
-            inode_t* new_inode = get_inode(ii);
-            new_inode->refs = 1;
-            new_inode->mode = mode;
-            new_inode->size = 0;
-            new_inode->block = alloc_block();
-	    // handle if inode allocation fails
-            if (new_inode->block == -1) {
-                bitmap_put(ibm, ii, 0);
-                return -1;
-            }
-	    // return inode number (success)
-            return ii;
-        }
+// sets up the inode locks and creates the root directory (inode 0) on a
+// freshly formatted image
+void inodes_init() {
+	superblock_t* sb = blocks_superblock();
+	inode_pins = calloc(sb->inode_count, sizeof(int));
+	for (int ii = 0; ii < INODE_LOCKS; ++ii) {
+		pthread_rwlock_init(&inode_locks[ii], NULL);
+	}
+	if (bitmap_get(get_inode_bitmap(), 0)) {
+		return;
+	}
+	// the first inode of an empty group 0 is inode 0
+	int inum = alloc_inum(0);
+	assert(inum == 0);
+	inode_t* root = get_inode(0);
+	memset(root, 0, sizeof(inode_t));
+	root->refs = 1;
+	root->mode = 040755;
+	group_add_dir(0, 1);
+	// no operation can run yet, so this needs no journal_begin()
+	journal_dirty(root, sizeof(inode_t));
+}
+
+// takes an inode's lock shared, for reading it
+void inode_lock_shared(int inum) {
+	pthread_rwlock_rdlock(&inode_locks[inum % INODE_LOCKS]);
+}
+
+// takes an inode's lock exclusively, for changing it
+void inode_lock(int inum) {
+	pthread_rwlock_wrlock(&inode_locks[inum % INODE_LOCKS]);
+}
+
+// releases an inode's lock
+void inode_unlock(int inum) {
+	pthread_rwlock_unlock(&inode_locks[inum % INODE_LOCKS]);
+}
+
+// collects the distinct lock slots of the given inodes, in ascending order
+static int lock_slots(const int* inums, int count, int* slots) {
+	int nslots = 0;
+	for (int ii = 0; ii < count; ++ii) {
+		if (inums[ii] < 0) {
+			continue;
+		}
+		int slot = inums[ii] % INODE_LOCKS;
+		int at = nslots;
+		while (at > 0 && slots[at - 1] > slot) {
+			at--;
+		}
+		if (at > 0 && slots[at - 1] == slot) {
+			continue; // already taken through another inode
+		}
+		memmove(&slots[at + 1], &slots[at], (nslots - at) * sizeof(int));
+		slots[at] = slot;
+		nslots++;
+	}
+	return nslots;
+}
+
+// takes the locks of several inodes exclusively; negative inums are skipped
+void inode_lock_many(const int* inums, int count) {
+	int slots[count];
+	int nslots = lock_slots(inums, count, slots);
+	for (int ii = 0; ii < nslots; ++ii) {
+		pthread_rwlock_wrlock(&inode_locks[slots[ii]]);
+	}
+}
+
+// releases the locks taken by inode_lock_many
+void inode_unlock_many(const int* inums, int count) {
+	int slots[count];
+	int nslots = lock_slots(inums, count, slots);
+	for (int ii = nslots - 1; ii >= 0; --ii) {
+		pthread_rwlock_unlock(&inode_locks[slots[ii]]);
+	}
+}
+
+// records a change to an inode in the running transaction
+static void inode_dirty(inode_t* node) {
+	journal_dirty(node, sizeof(inode_t));
+}
+
+// gets the inum of an inode from its position in the inode table
+int inode_get_inum(inode_t* node) {
+	return node - get_inode(0);
+}
+
+// maximum number of extents an inode can map (inline + overflow block)
+static int max_extents() {
+	return INODE_EXTENTS + BLOCK_SIZE / sizeof(extent_t);
+}
+
+// returns the ii-th extent slot of an inode, or NULL if it is not backed yet
+// (an inline inode has no extent map)
+static extent_t* inode_extent(inode_t* node, int ii) {
+	if (node->flags & INODE_INLINE) {
+		return NULL;
+	}
+	if (ii < INODE_EXTENTS) {
+		return &node->extents[ii];
+	}
+	if (node->overflow == 0 || ii >= max_extents()) {
+		return NULL;
+	}
+	extent_t* more = (extent_t*)blocks_get_block(node->overflow);
+	return &more[ii - INODE_EXTENTS];
+}
+
+// counts the extents in use; they are packed at the front of the map
+static int extent_count(inode_t* node) {
+	int count = 0;
+	extent_t* ext;
+	while ((ext = inode_extent(node, count)) != NULL && ext->length != 0) {
+		count++;
+	}
+	return count;
+}
+
+// number of blocks currently mapped by an inode
+static int inode_blocks(inode_t* node) {
+	int blocks = 0;
+	extent_t* ext;
+	for (int ii = 0; (ext = inode_extent(node, ii)) != NULL && ext->length != 0; ++ii) {
+		blocks += ext->length;
+	}
+	return blocks;
+}
+
+// searches for a free inode, updates bitmap and initializes the inode
+int alloc_inode(int mode, int parent) {
+    // find a free inode number and mark it used: a directory in the group
+    // the Orlov policy picks, anything else next to its parent
+    int group = S_ISDIR(mode) ? find_dir_group(parent) : inode_group(parent);
+    int ii = alloc_inum(group);
+    if (ii < 0) {
+        // no free inodes
+        return -1;
+    }
+    if (S_ISDIR(mode)) {
+        group_add_dir(ii, 1);
+    }
+    // initializes the newly created inode; blocks are allocated on grow
+    inode_t* new_inode = get_inode(ii);
+    memset(new_inode, 0, sizeof(inode_t));
+    new_inode->refs = 1;
+    new_inode->mode = mode;
+    // regular files keep their data inline until it outgrows the inode
+    if (S_ISREG(mode)) {
+        new_inode->flags = INODE_INLINE;
     }
-    // no free inodes
-    return -1;
+    inode_dirty(new_inode);
+    // return inode number (success)
+    return ii;
 }
 
-// marks an inode as free, frees the block associated with the inode, and then resets the block pointer
+// marks an inode as free and releases every extent it maps
 void free_inode(int inum) {
-	printf("+ free_inode(%d)\n", inum);
-	// gets the inode bitmap
-	void* ibm = get_inode_bitmap();
-	// frees the inode
-	bitmap_put(ibm, inum, 0);
 	// gets the inode based on inum
 	inode_t* node = get_inode(inum);
-	free_block(node->block); // Freeing the block associated with the inode
-	// reset block pointer
-	node->block = 0;
+	// release all data blocks and the overflow extent block
+	shrink_inode(node, node->size);
+	if (S_ISDIR(node->mode)) {
+		group_add_dir(inum, -1);
+	}
+	// frees the inode
+	free_inum(inum);
+}
+
+// keeps an inode allocated while it is open or known to the kernel. The
+// caller holds the inode lock, or the lock of a directory linking to it,
+// which keeps the inode from being freed meanwhile.
+void inode_pin(int inum) {
+	__atomic_add_fetch(&inode_pins[inum], 1, __ATOMIC_RELAXED);
+}
+
+// releases a pin, freeing the inode if it was unlinked while open
+// (caller holds the inode lock)
+void inode_unpin(int inum) {
+	if (__atomic_sub_fetch(&inode_pins[inum], 1, __ATOMIC_RELAXED) == 0 &&
+			get_inode(inum)->refs <= 0) {
+		free_inode(inum);
+	}
+}
+
+// adds a link to an inode (caller holds the inode lock)
+void inode_link(int inum) {
+	inode_t* node = get_inode(inum);
+	node->refs++;
+	inode_dirty(node);
+}
+
+// drops a link to an inode, freeing it once it has no links and no pins
+// (caller holds the inode lock)
+void inode_unlink(int inum) {
+	inode_t* node = get_inode(inum);
+	node->refs--;
+	inode_dirty(node);
+	if (node->refs <= 0 && __atomic_load_n(&inode_pins[inum], __ATOMIC_RELAXED) == 0) {
+		free_inode(inum);
+	}
+}
+
+// copies the extent map of an inode into map, returning its length
+static int load_extents(inode_t* node, extent_t* map) {
+	int count = 0;
+	extent_t* ext;
+	while ((ext = inode_extent(node, count)) != NULL && ext->length != 0) {
+		map[count++] = *ext;
+	}
+	return count;
+}
+
+// whether extent b continues extent a, so the two can be one
+static int extents_merge(extent_t* a, extent_t* b) {
+	if (a->start == EXTENT_HOLE) {
+		return b->start == EXTENT_HOLE;
+	}
+	return b->start != EXTENT_HOLE && a->start + a->length == b->start &&
+			a->unwritten == b->unwritten;
+}
+
+// replaces the extent map of an inode with map, dropping empty entries and
+// merging neighbours that continue each other. Fails, leaving the inode
+// and map as they were, if the result does not fit or no overflow block is
+// free.
+static int store_extents(inode_t* node, extent_t* map, int count) {
+	int merged = 0;
+	extent_t* prev = NULL;
+	for (int ii = 0; ii < count; ++ii) {
+		if (map[ii].length == 0) {
+			continue;
+		}
+		if (prev == NULL || !extents_merge(prev, &map[ii])) {
+			merged++;
+		}
+		prev = &map[ii];
+	}
+	if (merged > max_extents()) {
+		return -1;
+	}
+	// spill into the overflow block once the inline slots are used up
+	if (merged > INODE_EXTENTS && node->overflow == 0) {
+		int got;
+		int ov = alloc_blocks(inode_block_goal(inode_get_inum(node)), 1, &got);
+		if (ov < 0) {
+			return -1;
+		}
+		memset(blocks_get_block(ov), 0, BLOCK_SIZE);
+		journal_dirty(blocks_get_block(ov), BLOCK_SIZE);
+		node->overflow = ov;
+		inode_dirty(node);
+	}
+	merged = 0;
+	for (int ii = 0; ii < count; ++ii) {
+		if (map[ii].length == 0) {
+			continue;
+		}
+		if (merged > 0 && extents_merge(&map[merged - 1], &map[ii])) {
+			map[merged - 1].length += map[ii].length;
+		} else {
+			map[merged++] = map[ii];
+		}
+	}
+	int old = extent_count(node);
+	for (int ii = 0; ii < merged || ii < old; ++ii) {
+		extent_t* ext = inode_extent(node, ii);
+		extent_t value = {0, 0, 0};
+		if (ii < merged) {
+			value = map[ii];
+		}
+		if (ext->start != value.start || ext->length != value.length ||
+				ext->unwritten != value.unwritten) {
+			*ext = value;
+			journal_dirty(ext, sizeof(extent_t));
+		}
+	}
+	// the overflow block goes once the inline slots suffice again
+	if (merged <= INODE_EXTENTS && node->overflow != 0) {
+		free_block(node->overflow);
+		node->overflow = 0;
+		inode_dirty(node);
+	}
+	return 0;
+}
+
+// releases the last blocks of an inode until only keep blocks remain
+static void trim_extents(inode_t* node, int keep) {
+	extent_t map[max_extents()];
+	int count = load_extents(node, map);
+	int blocks = 0;
+	for (int ii = 0; ii < count; ++ii) {
+		int from = keep - blocks; // blocks of this extent that stay
+		if (from < 0) {
+			from = 0;
+		}
+		blocks += map[ii].length;
+		if (from >= map[ii].length) {
+			continue;
+		}
+		if (map[ii].start != EXTENT_HOLE) {
+			free_blocks(map[ii].start + from, map[ii].length - from);
+		}
+		map[ii].length = from;
+	}
+	// a shorter map always fits where the longer one did
+	store_extents(node, map, count);
+}
+
+// zeroes len bytes from offset within block bnum of an inode. Directory
+// blocks are metadata and go through the journal; file data is cleared in
+// place.
+static void zero_blocks(inode_t* node, int bnum, int offset, size_t len) {
+	if (S_ISDIR(node->mode)) {
+		char* data = (char*)blocks_get_block(bnum) + offset;
+		memset(data, 0, len);
+		journal_dirty(data, len);
+	} else {
+		memset((char*)blocks_get_data(bnum) + offset, 0, len);
+		blocks_dirty_data(bnum, bytes_to_blocks(offset + len));
+	}
+}
+
+// an extent map being rebuilt, and which of its extents got new blocks
+typedef struct extent_list {
+	extent_t* map;
+	char* fresh;
+	int count;
+	int cap;
+} extent_list_t;
+
+// appends an extent to a list unless it is empty
+static int push_extent(extent_list_t* list, int start, int length, int unwritten) {
+	if (length == 0) {
+		return 0;
+	}
+	if (list->count == list->cap) {
+		return -1;
+	}
+	extent_t* ext = &list->map[list->count++];
+	ext->start = start;
+	ext->length = length;
+	ext->unwritten = unwritten;
+	return 0;
+}
+
+// zeroes the bytes of the blocks from bnum, which hold file bytes
+// [pos, end), that lie outside [lo, hi), the range about to be written
+static void zero_outside(inode_t* node, int bnum, off_t pos, off_t end, off_t lo, off_t hi) {
+	if (lo >= end || hi <= pos) {
+		zero_blocks(node, bnum, 0, end - pos);
+		return;
+	}
+	if (lo > pos) {
+		zero_blocks(node, bnum, 0, lo - pos);
+	}
+	if (hi < end) {
+		zero_blocks(node, bnum, hi - pos, end - hi);
+	}
+}
+
+// picks where new blocks for the end of a list should go: right after the
+// last data extent before them, so the file stays contiguous, or near the
+// inode when no data precedes them
+static int data_goal(inode_t* node, extent_list_t* list) {
+	for (int ii = list->count - 1; ii >= 0; --ii) {
+		extent_t* ext = &list->map[ii];
+		if (ext->start != EXTENT_HOLE) {
+			return ext->start + ext->length;
+		}
+	}
+	return inode_block_goal(inode_get_inum(node));
+}
+
+// allocates want blocks for the file blocks starting at byte pos, appending
+// them to a list as fresh extents. Unwritten blocks are taken from the
+// longest free runs and left as they are; others are zeroed, except for
+// the bytes [lo, hi) the caller is about to write.
+static int alloc_run(inode_t* node, extent_list_t* list, int want, off_t pos,
+		off_t lo, off_t hi, int unwritten) {
+	while (want > 0) {
+		int goal = data_goal(node, list);
+		int got = 0;
+		int start = unwritten ? alloc_extent(goal, want, &got) : alloc_blocks(goal, want, &got);
+		if (start < 0) {
+			return -1;
+		}
+		if (push_extent(list, start, got, unwritten) != 0) {
+			free_blocks(start, got);
+			return -1;
+		}
+		list->fresh[list->count - 1] = 1;
+		off_t end = pos + (off_t)got * BLOCK_SIZE;
+		if (!unwritten) {
+			zero_outside(node, start, pos, end, lo, hi);
+		}
+		pos = end;
+		want -= got;
+	}
+	return 0;
+}
+
+// gives back the blocks of the fresh extents of a list, after a change to
+// the extent map failed
+static void release_fresh(extent_list_t* list) {
+	for (int ii = 0; ii < list->count; ++ii) {
+		if (!list->fresh[ii]) {
+			continue;
+		}
+		free_blocks(list->map[ii].start, list->map[ii].length);
+	}
 }
 
-// increases the size of an inode
+// moves the data of an inline inode into a data block, which becomes its
+// first extent (an empty one simply gets an empty extent map)
+static int inode_uninline(inode_t* node) {
+	if (node->size == 0) {
+		node->flags &= ~INODE_INLINE;
+		memset(node->extents, 0, sizeof(node->extents));
+		inode_dirty(node);
+		return 0;
+	}
+	int got;
+	int bnum = alloc_blocks(inode_block_goal(inode_get_inum(node)), 1, &got);
+	if (bnum < 0) {
+		return -1;
+	}
+	char* data = blocks_get_data(bnum);
+	memcpy(data, node->inline_data, node->size);
+	memset(data + node->size, 0, BLOCK_SIZE - node->size);
+	blocks_dirty_data(bnum, 1);
+	node->flags &= ~INODE_INLINE;
+	memset(node->extents, 0, sizeof(node->extents));
+	node->extents[0].start = bnum;
+	node->extents[0].length = 1;
+	inode_dirty(node);
+	return 0;
+}
+
+// increases the size of an inode. Regular files grow by a hole, which gets
+// blocks only when written; directories get zeroed blocks right away.
 int grow_inode(inode_t* node, int size) {
-	// Assuming size increase doesn't require new block allocation
-	node->size += size;
-	return node->size; 
+	int new_size = node->size + size;
+	if (node->flags & INODE_INLINE) {
+		if (new_size <= INODE_INLINE_SIZE) {
+			// the bytes past the old end are already zero
+			node->size = new_size;
+			inode_dirty(node);
+			return node->size;
+		}
+		if (inode_uninline(node) != 0) {
+			return -1;
+		}
+	}
+	int need = bytes_to_blocks(new_size);
+	int blocks = inode_blocks(node);
+	if (blocks < need) {
+		int cap = max_extents() + 1;
+		extent_t map[cap];
+		char fresh[cap];
+		memset(fresh, 0, cap);
+		extent_list_t list = {map, fresh, load_extents(node, map), cap};
+		int rv;
+		if (S_ISDIR(node->mode)) {
+			off_t pos = (off_t)blocks * BLOCK_SIZE;
+			rv = alloc_run(node, &list, need - blocks, pos, pos, pos, 0);
+		} else {
+			rv = push_extent(&list, EXTENT_HOLE, need - blocks, 0);
+		}
+		if (rv == 0) {
+			rv = store_extents(node, map, list.count);
+		}
+		if (rv != 0) {
+			release_fresh(&list);
+			return -1;
+		}
+	}
+
+	node->size = new_size;
+	inode_dirty(node);
+	return node->size;
 }
 
-// reduces the size of an inode
+// reduces the size of an inode, freeing the extents past the new end
 int shrink_inode(inode_t* node, int size) {
-	// Reducing size without affecting the block
-	if (node->size > size) {
-		node->size -= size;
+	int new_size = node->size - size;
+	if (new_size < 0) {
+		new_size = 0;
+	}
+	if (node->flags & INODE_INLINE) {
+		// keep the bytes past the end zero, so a later grow reads zeros
+		memset(node->inline_data + new_size, 0, node->size - new_size);
+		node->size = new_size;
+		inode_dirty(node);
+		return node->size;
+	}
+	int keep = bytes_to_blocks(new_size);
+	trim_extents(node, keep);
+	if (new_size == 0 && S_ISREG(node->mode)) {
+		// an emptied file starts over inline, e.g. when rewritten with O_TRUNC
+		memset(node->extents, 0, sizeof(node->extents));
+		node->flags |= INODE_INLINE;
+		node->size = 0;
+		inode_dirty(node);
+		return 0;
 	}
+	// clear the tail of the last block so a later grow reads zeros
+	int tail = new_size % BLOCK_SIZE;
+	int last = tail != 0 ? inode_get_bnum(node, keep - 1) : -1;
+	if (last >= 0) {
+		zero_blocks(node, last, tail, BLOCK_SIZE - tail);
+	}
+	node->size = new_size;
+	inode_dirty(node);
 	return node->size;
 }
 
-// writes data into a file 
-void write_to_file(inode_t* node, const char *buf, size_t size, off_t offset) {
-	// gets the block associated with node
-	void* block = blocks_get_block(node->block);
-	// make a copy of size amount of node's data 
-	memcpy(block + offset, buf, size);
+// finds the extent holding a file block and the block's index within it,
+// or NULL past the end of the extent map
+static extent_t* extent_at(inode_t* node, int file_bnum, int* within) {
+	extent_t* ext;
+	for (int ii = 0; (ext = inode_extent(node, ii)) != NULL && ext->length != 0; ++ii) {
+		if (file_bnum < ext->length) {
+			*within = file_bnum;
+			return ext;
+		}
+		file_bnum -= ext->length;
+	}
+	return NULL;
+}
+
+// maps a block index within the file to a block number on disk, or -1 if
+// it is past the end or in a hole
+int inode_get_bnum(inode_t* node, int file_bnum) {
+	int within;
+	extent_t* ext = extent_at(node, file_bnum, &within);
+	if (ext == NULL || ext->start == EXTENT_HOLE) {
+		return -1;
+	}
+	return ext->start + within;
+}
+
+// counts the blocks holding the data of an inode, holes excluded
+int inode_stored_blocks(inode_t* node) {
+	int blocks = 0;
+	extent_t* ext;
+	for (int ii = 0; (ext = inode_extent(node, ii)) != NULL && ext->length != 0; ++ii) {
+		if (ext->start != EXTENT_HOLE) {
+			blocks += ext->length;
+		}
+	}
+	return blocks;
+}
+
+// whether any of the file blocks first..last is a hole or unwritten, or,
+// when reserving, lies past the end of the extent map
+static int range_unfilled(inode_t* node, int first, int last, int reserve) {
+	int pos = 0;
+	extent_t* ext;
+	for (int ii = 0; (ext = inode_extent(node, ii)) != NULL && ext->length != 0; ++ii) {
+		if (pos > last) {
+			return 0;
+		}
+		if (pos + ext->length > first &&
+				(ext->start == EXTENT_HOLE || (ext->unwritten && !reserve))) {
+			return 1;
+		}
+		pos += ext->length;
+	}
+	return reserve && pos <= last;
+}
+
+// Gives blocks to the file blocks first..last of an inode. For a write of
+// the bytes [lo, hi), holes get new blocks and unwritten blocks become
+// written, with the bytes the write leaves of them zeroed. When reserving,
+// holes (and the blocks past the end of the map) get unwritten blocks.
+static int fill_range(inode_t* node, int first, int last, off_t lo, off_t hi, int reserve) {
+	if (!range_unfilled(node, first, last, reserve)) {
+		return 0; // the common case: nothing in the way
+	}
+
+	// each extent touched splits in up to three, and its middle may take
+	// several runs; the result is checked against the map capacity when
+	// stored
+	int count = extent_count(node);
+	extent_t* map = malloc((count + 1) * sizeof(extent_t));
+	load_extents(node, map);
+	int blocks = inode_blocks(node);
+	if (blocks <= last) {
+		// reserving past the end of the map: pretend it ends in a hole
+		map[count].start = EXTENT_HOLE;
+		map[count].length = last + 1 - blocks;
+		map[count].unwritten = 0;
+		count++;
+	}
+	int cap = 2 * max_extents() + 2;
+	extent_list_t list = {malloc(cap * sizeof(extent_t)), calloc(cap, 1), 0, cap};
+	int rv = 0;
+	int pos = 0;
+	for (int ii = 0; ii < count && rv == 0; ++ii) {
+		extent_t* ext = &map[ii];
+		int end = pos + ext->length; // file block past the extent
+		int hole = ext->start == EXTENT_HOLE;
+		if (end <= first || pos > last || (!hole && (!ext->unwritten || reserve))) {
+			rv = push_extent(&list, ext->start, ext->length, ext->unwritten);
+			pos = end;
+			continue;
+		}
+		// the extent keeps what lies outside [first, last]
+		int from = first > pos ? first : pos;
+		int to = last < end - 1 ? last : end - 1;
+		int len = to + 1 - from;
+		off_t at = (off_t)from * BLOCK_SIZE;
+		rv = push_extent(&list, ext->start, from - pos, ext->unwritten);
+		if (rv == 0 && hole) {
+			rv = alloc_run(node, &list, len, at, lo, hi, reserve);
+		} else if (rv == 0) {
+			int bnum = ext->start + (from - pos);
+			zero_outside(node, bnum, at, at + (off_t)len * BLOCK_SIZE, lo, hi);
+			rv = push_extent(&list, bnum, len, 0);
+		}
+		if (rv == 0) {
+			int rest = hole ? EXTENT_HOLE : ext->start + (to + 1 - pos);
+			rv = push_extent(&list, rest, end - 1 - to, ext->unwritten);
+		}
+		pos = end;
+	}
+	if (rv == 0) {
+		rv = store_extents(node, list.map, list.count);
+	}
+	if (rv != 0) {
+		release_fresh(&list);
+	}
+	free(list.fresh);
+	free(list.map);
+	free(map);
+	return rv;
+}
+
+// copies between buf and the file, one memcpy per extent touched
+static int copy_extents(inode_t* node, char* buf, size_t size, off_t offset, int to_file) {
+	size_t done = 0;
+	off_t ext_off = 0; // file offset of the current extent
+	extent_t* ext;
+	for (int ii = 0; done < size && (ext = inode_extent(node, ii)) != NULL && ext->length != 0; ++ii) {
+		off_t ext_len = (off_t)ext->length * BLOCK_SIZE;
+		off_t pos = offset + done;
+		if (pos < ext_off + ext_len) {
+			// part of the request falls into this extent
+			off_t within = pos - ext_off;
+			size_t chunk = ext_len - within;
+			if (chunk > size - done) {
+				chunk = size - done;
+			}
+			char* data = (char*)blocks_get_data(ext->start) + within;
+			if (ext->start == EXTENT_HOLE || ext->unwritten) {
+				// holes read as zeros; writes fill them first
+				assert(!to_file);
+				memset(buf + done, 0, chunk);
+			} else if (to_file) {
+				memcpy(data, buf + done, chunk);
+				blocks_dirty_data(ext->start + within / BLOCK_SIZE,
+						bytes_to_blocks(within % BLOCK_SIZE + chunk));
+			} else {
+				memcpy(buf + done, data, chunk);
+			}
+			done += chunk;
+		}
+		ext_off += ext_len;
+	}
+	return done;
+}
+
+// copies between buf and the data of an inline inode. Inline data is
+// metadata, so writes go through the journal.
+static int copy_inline(inode_t* node, char* buf, size_t size, off_t offset, int to_file) {
+	if (offset >= node->size) {
+		return 0;
+	}
+	if (size > node->size - offset) {
+		size = node->size - offset;
+	}
+	if (to_file) {
+		memcpy(node->inline_data + offset, buf, size);
+		journal_dirty(node->inline_data + offset, size);
+	} else {
+		memcpy(buf, node->inline_data + offset, size);
+	}
+	return size;
+}
+
+// writes data into a file
+int write_to_file(inode_t* node, const char *buf, size_t size, off_t offset) {
+	if (node->flags & INODE_INLINE) {
+		return copy_inline(node, (char*)buf, size, offset, 1);
+	}
+	if (size > 0 && fill_range(node, offset / BLOCK_SIZE, (offset + size - 1) / BLOCK_SIZE,
+			offset, offset + size, 0) != 0) {
+		return -1;
+	}
+	return copy_extents(node, (char*)buf, size, offset, 1);
 }
 
 // reads data from a file
-void read_from_file(inode_t* node, char *buf, size_t size, off_t offset) {
-	// gets the block associated with inode
-	void* block = blocks_get_block(node->block);
-	// copy size amount of data from offset into buffer
-	memcpy(buf, block + offset, size);
+int read_from_file(inode_t* node, char *buf, size_t size, off_t offset) {
+	if (node->flags & INODE_INLINE) {
+		return copy_inline(node, buf, size, offset, 0);
+	}
+	return copy_extents(node, buf, size, offset, 0);
 }
 
+// writes data into a file as write_to_file() does, but has source copy it
+// straight into the data blocks, one call per extent touched
+int write_to_file_from(inode_t* node, file_source_t source, void* arg, size_t size, off_t offset) {
+	if (node->flags & INODE_INLINE) {
+		char buf[INODE_INLINE_SIZE];
+		if (size > sizeof(buf) || source(arg, buf, size) != 0) {
+			return -1;
+		}
+		return copy_inline(node, buf, size, offset, 1);
+	}
+	if (size > 0 && fill_range(node, offset / BLOCK_SIZE, (offset + size - 1) / BLOCK_SIZE,
+			offset, offset + size, 0) != 0) {
+		return -1;
+	}
+	size_t done = 0;
+	off_t ext_off = 0; // file offset of the current extent
+	extent_t* ext;
+	for (int ii = 0; done < size && (ext = inode_extent(node, ii)) != NULL && ext->length != 0; ++ii) {
+		off_t ext_len = (off_t)ext->length * BLOCK_SIZE;
+		off_t pos = offset + done;
+		if (pos < ext_off + ext_len) {
+			off_t within = pos - ext_off;
+			size_t chunk = ext_len - within;
+			if (chunk > size - done) {
+				chunk = size - done;
+			}
+			// fill_range gave the whole range written blocks
+			assert(ext->start != EXTENT_HOLE && !ext->unwritten);
+			int rv = source(arg, (char*)blocks_get_data(ext->start) + within, chunk);
+			blocks_dirty_data(ext->start + within / BLOCK_SIZE,
+					bytes_to_blocks(within % BLOCK_SIZE + chunk));
+			if (rv != 0) {
+				break;
+			}
+			done += chunk;
+		}
+		ext_off += ext_len;
+	}
+	return done > 0 || size == 0 ? (int)done : -1;
+}
+
+// maps the bytes [offset, offset + size) of a file onto the image file,
+// merging extents that are adjacent there. Holes and unwritten extents
+// become runs of zeros. runs needs room for size / BLOCK_SIZE + 2 entries,
+// and the data of inline files is not in the image file, so they map to
+// nothing. Returns the number of runs.
+int inode_map_data(inode_t* node, size_t size, off_t offset, file_run_t* runs) {
+	int count = 0;
+	if (node->flags & INODE_INLINE) {
+		return 0;
+	}
+	size_t done = 0;
+	off_t ext_off = 0; // file offset of the current extent
+	extent_t* ext;
+	for (int ii = 0; done < size && (ext = inode_extent(node, ii)) != NULL && ext->length != 0; ++ii) {
+		off_t ext_len = (off_t)ext->length * BLOCK_SIZE;
+		off_t pos = offset + done;
+		if (pos < ext_off + ext_len) {
+			off_t within = pos - ext_off;
+			size_t chunk = ext_len - within;
+			if (chunk > size - done) {
+				chunk = size - done;
+			}
+			off_t at = ext->start == EXTENT_HOLE || ext->unwritten
+					? -1 : (off_t)ext->start * BLOCK_SIZE + within;
+			file_run_t* last = count > 0 ? &runs[count - 1] : NULL;
+			int joins = last != NULL && (at < 0 ? last->pos < 0
+					: last->pos >= 0 && last->pos + (off_t)last->len == at);
+			if (joins) {
+				last->len += chunk;
+			} else {
+				runs[count].pos = at;
+				runs[count].len = chunk;
+				count++;
+			}
+			done += chunk;
+		}
+		ext_off += ext_len;
+	}
+	return count;
+}
+
+// reserves blocks for the bytes [offset, offset + len) of a file, as
+// unwritten extents taken from the longest free runs. The size is left
+// alone; the map may reach past it.
+int inode_reserve(inode_t* node, off_t offset, off_t len) {
+	if ((node->flags & INODE_INLINE) && inode_uninline(node) != 0) {
+		return -1;
+	}
+	if (len <= 0) {
+		return 0;
+	}
+	return fill_range(node, offset / BLOCK_SIZE, (offset + len - 1) / BLOCK_SIZE, 0, 0, 1);
+}
+
+// zeroes the file bytes [from, to), which lie within one block, unless
+// they are already read as zeros
+static void zero_file_bytes(inode_t* node, off_t from, off_t to) {
+	int within;
+	extent_t* ext = extent_at(node, from / BLOCK_SIZE, &within);
+	if (ext != NULL && ext->start != EXTENT_HOLE && !ext->unwritten) {
+		zero_blocks(node, ext->start + within, from % BLOCK_SIZE, to - from);
+	}
+}
+
+// deallocates the bytes [offset, offset + len) of a file, leaving its size
+// alone: whole blocks in the range become a hole, and the parts of blocks
+// at its edges are zeroed
+int inode_punch(inode_t* node, off_t offset, off_t len) {
+	off_t end = offset + len;
+	if (node->flags & INODE_INLINE) {
+		if (end > node->size) {
+			end = node->size;
+		}
+		if (offset < end) {
+			memset(node->inline_data + offset, 0, end - offset);
+			journal_dirty(node->inline_data + offset, end - offset);
+		}
+		return 0;
+	}
+	// nothing past the end of the extent map, which may reach past the end
+	// of the file, is allocated
+	off_t map_end = (off_t)inode_blocks(node) * BLOCK_SIZE;
+	if (end > map_end) {
+		end = map_end;
+	}
+	if (offset >= end) {
+		return 0;
+	}
+	long first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE; // first whole block
+	long last = end / BLOCK_SIZE - 1;                     // last whole block
+	off_t head_end = (off_t)first * BLOCK_SIZE < end ? (off_t)first * BLOCK_SIZE : end;
+	off_t tail_start = end - end % BLOCK_SIZE;
+	if (offset < head_end) {
+		zero_file_bytes(node, offset, head_end);
+	}
+	if (tail_start < end && tail_start >= head_end) {
+		zero_file_bytes(node, tail_start, end);
+	}
+	if (first > last) {
+		return 0;
+	}
+
+	// split the extents around the range; the blocks inside are freed once
+	// the new map is in place
+	int count = extent_count(node);
+	extent_t* map = malloc(count * sizeof(extent_t));
+	load_extents(node, map);
+	int cap = count + 2;
+	extent_list_t list = {malloc(cap * sizeof(extent_t)), calloc(cap, 1), 0, cap};
+	extent_list_t punched = {malloc(cap * sizeof(extent_t)), NULL, 0, cap};
+	int rv = 0;
+	int pos = 0;
+	for (int ii = 0; ii < count && rv == 0; ++ii) {
+		extent_t* ext = &map[ii];
+		int next = pos + ext->length;
+		if (next <= first || pos > last || ext->start == EXTENT_HOLE) {
+			rv = push_extent(&list, ext->start, ext->length, ext->unwritten);
+			pos = next;
+			continue;
+		}
+		int from = first > pos ? first : pos;
+		int to = last < next - 1 ? last : next - 1;
+		push_extent(&punched, ext->start + (from - pos), to + 1 - from, 0);
+		rv = push_extent(&list, ext->start, from - pos, ext->unwritten);
+		if (rv == 0) {
+			rv = push_extent(&list, EXTENT_HOLE, to + 1 - from, 0);
+		}
+		if (rv == 0) {
+			rv = push_extent(&list, ext->start + (to + 1 - pos), next - 1 - to, ext->unwritten);
+		}
+		pos = next;
+	}
+	if (rv == 0) {
+		rv = store_extents(node, list.map, list.count);
+	}
+	if (rv == 0) {
+		for (int ii = 0; ii < punched.count; ++ii) {
+			free_blocks(punched.map[ii].start, punched.map[ii].length);
+		}
+	}
+	free(punched.map);
+	free(list.fresh);
+	free(list.map);
+	free(map);
+	return rv;
+}
+
+// writes back the dirty data blocks of a file, waiting for them if asked to
+int inode_sync(inode_t* node, int wait) {
+	int rv = 0;
+	extent_t* ext;
+	for (int ii = 0; (ext = inode_extent(node, ii)) != NULL && ext->length != 0; ++ii) {
+		if (ext->start == EXTENT_HOLE) {
+			continue;
+		}
+		rv |= blocks_sync_data(ext->start, ext->length, wait);
+	}
+	return rv;
+}
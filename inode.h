@@ -6,21 +6,89 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <sys/types.h>
+
 #include "blocks.h"
 
+// number of extents stored directly in the inode
+#define INODE_EXTENTS 13
+// bytes of file data an inline inode holds, in place of its extent map
+#define INODE_INLINE_SIZE (INODE_EXTENTS * 8)
+
+// inode flags
+#define INODE_HASHED 0x1 // directory uses the hashed index format
+#define INODE_INLINE 0x2 // file data lives in the inode, not in blocks
+
+// a run of physically contiguous blocks backing consecutive file blocks
+typedef struct extent {
+  int start;              // first block of the run, or EXTENT_HOLE
+  int length : 31;        // number of blocks in the run (0 = unused slot)
+  unsigned unwritten : 1; // reserved by fallocate, never written since
+} extent_t;
+
+// start of an extent of file blocks that were never written. Holes read as
+// zeros and take no space; writes give them blocks. Block 0 holds the
+// superblock, so it never backs file data. Unwritten extents have blocks
+// but still read as zeros, until a write covers them. The map may reach
+// past the end of the file, with blocks reserved for it to grow into.
+#define EXTENT_HOLE 0
+
+// 128 bytes, so an inode never straddles a block or a cache line pair.
+// Regular files start out inline: their data is kept in inline_data (and
+// journaled with the inode) until it outgrows INODE_INLINE_SIZE bytes,
+// when it moves to a data block and the extent map takes its place.
 typedef struct inode {
-  int refs;  // reference count
-  int mode;  // permission & type
-  int size;  // bytes
-  int block; // single block pointer (if max file size <= 4K)
+  int refs;     // reference count
+  int mode;     // permission & type
+  int size;     // bytes
+  int flags;    // INODE_* flags
+  int overflow; // block holding further extents (0 = none)
+  // linear directories: the list of free dirent slots (see directory.c)
+  short free_slot; // first free slot + 1 (0 = none)
+  short holes;     // free slots in the list
+  union {
+    extent_t extents[INODE_EXTENTS];     // extent map, in file order
+    char inline_data[INODE_INLINE_SIZE]; // with INODE_INLINE
+  };
 } inode_t;
 
+// a run of file data as stored: len bytes at byte pos of the image file,
+// or len bytes of zeros if pos is -1
+typedef struct file_run {
+  off_t pos;
+  size_t len;
+} file_run_t;
+
+// copies the next len bytes of the data being written to dst, returning 0,
+// or -1 if they cannot be had
+typedef int (*file_source_t)(void *arg, char *dst, size_t len);
+
 void print_inode(inode_t *node);
+void inodes_init();
+void inode_lock_shared(int inum);
+void inode_lock(int inum);
+void inode_unlock(int inum);
+void inode_lock_many(const int *inums, int count);
+void inode_unlock_many(const int *inums, int count);
 inode_t *get_inode(int inum);
-int alloc_inode();
-void free_inode();
+int inode_get_inum(inode_t *node);
+int alloc_inode(int mode, int parent);
+void free_inode(int inum);
+void inode_pin(int inum);
+void inode_unpin(int inum);
+void inode_link(int inum);
+void inode_unlink(int inum);
 int grow_inode(inode_t *node, int size);
 int shrink_inode(inode_t *node, int size);
 int inode_get_bnum(inode_t *node, int file_bnum);
+int inode_stored_blocks(inode_t *node);
+int inode_reserve(inode_t *node, off_t offset, off_t len);
+int inode_punch(inode_t *node, off_t offset, off_t len);
+int read_from_file(inode_t *node, char *buf, size_t size, off_t offset);
+int write_to_file(inode_t *node, const char *buf, size_t size, off_t offset);
+int write_to_file_from(inode_t *node, file_source_t source, void *arg, size_t size,
+                       off_t offset);
+int inode_map_data(inode_t *node, size_t size, off_t offset, file_run_t *runs);
+int inode_sync(inode_t *node, int wait);
 
 #endif
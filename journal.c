@@ -0,0 +1,615 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
+
+// The journal region starts with a header block.  Transactions follow it
+// back to back, each made of descriptor blocks (listing the home block
+// numbers of the after-images that follow them) and a closing commit block
+// holding a checksum over the whole transaction.  Transactions are
+// numbered; the header holds the number of the first one after it, so
+// leftovers of earlier laps around the region never match.
+#define JOURNAL_MAGIC 0x4c4e524a  // "JRNL", header block
+#define JOURNAL_DESC 0x43534544   // "DESC", descriptor block
+#define JOURNAL_COMMIT 0x544d4f43 // "COMT", commit block
+
+// longest time a transaction stays open, by default
+#define JOURNAL_INTERVAL_MS 1000
+
+// metadata blocks an operation changes besides the block bitmap and the
+// group descriptors: inodes, inode bitmap, directory and extent blocks
+#define JOURNAL_OP_BLOCKS 24
+
+typedef struct journal_header {
+    int magic;          // JOURNAL_MAGIC
+    unsigned first_seq; // number of the transaction right after the header
+} journal_header_t;
+
+typedef struct journal_desc {
+    int magic;    // JOURNAL_DESC
+    unsigned seq; // transaction number
+    int count;    // after-images following this block
+    int bnums[];  // their home block numbers
+} journal_desc_t;
+
+typedef struct journal_commit {
+    int magic;         // JOURNAL_COMMIT
+    unsigned seq;      // transaction number
+    unsigned checksum; // over the transaction's descriptors and images
+} journal_commit_t;
+
+static int journal_fd = -1;
+static int journal_start = 0;  // block of the journal header
+static int journal_blocks = 0; // length of the region, header included
+static int journal_head = 1;   // where the next transaction goes
+static unsigned journal_seq;   // number of the next transaction
+static int commit_interval = JOURNAL_INTERVAL_MS;
+static int flush_enabled = 1;  // fdatasync commits
+
+// Operations hold the barrier shared; a commit holds it exclusively for
+// as long as it takes to copy the changed blocks.
+static pthread_rwlock_t barrier;
+static pthread_once_t barrier_once = PTHREAD_ONCE_INIT;
+
+// Reads that use data blocks after dropping the inode lock hold this
+// shared; a commit takes it exclusively before releasing freed blocks, so
+// none is reused while a read started earlier still sends from it.
+static pthread_rwlock_t readers;
+
+// the running transaction, guarded by list_lock
+static uint64_t *dirty_map = 0; // blocks changed by the transaction
+static int *dirty_list = 0;
+static int dirty_count = 0;
+static int dirty_cap = 0;
+static int *freed_list = 0;     // blocks freed by the transaction
+static int freed_count = 0;
+static int freed_cap = 0;
+static int commit_threshold = 0; // changed blocks that trigger a commit early
+static int commit_limit = 0;     // most changed blocks the journal holds
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Each running operation reserves op_blocks of the journal, so that the
+// transaction never outgrows it however many operations overlap.
+static int op_blocks = 0;
+static int reserved = 0;
+
+// set once a transaction could not be committed; later ones build on it,
+// so none is committed after it
+static int journal_failed = 0;
+
+// blocks logged since the journal was last reset, guarded by commit_lock;
+// replay would write them home again
+static uint64_t *lap_map = 0;
+
+// the commit thread, and one commit at a time
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t committer;
+static int committer_running = 0;
+static int stopping = 0;
+
+// number of home block numbers a descriptor block holds
+static int desc_capacity() {
+    return (BLOCK_SIZE - (int)sizeof(journal_desc_t)) / (int)sizeof(int);
+}
+
+// the most blocks a single operation changes: freeing or allocating may
+// touch all of the block bitmap and the group descriptor table
+static int op_budget(const superblock_t *sb) {
+    return sb->block_bitmap_blocks + sb->group_table_blocks + JOURNAL_OP_BLOCKS;
+}
+
+// Return the shortest journal that holds the transaction of one operation.
+int journal_min_blocks(const superblock_t *sb) {
+    int per_desc = (sb->block_size - (int)sizeof(journal_desc_t)) / (int)sizeof(int);
+    int count = op_budget(sb);
+    // header, descriptors, after-images and commit block
+    return 1 + (count + per_desc - 1) / per_desc + count + 1;
+}
+
+// extends a running FNV-1a checksum over len bytes
+static unsigned checksum(unsigned hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t ii = 0; ii < len; ++ii) {
+        hash = (hash ^ bytes[ii]) * 16777619u;
+    }
+    return hash;
+}
+
+// writes count blocks from buf to the image, starting at block bnum
+static int write_blocks(const void *buf, int bnum, int count) {
+    size_t len = (size_t)count * BLOCK_SIZE;
+    off_t off = (off_t)bnum * BLOCK_SIZE;
+    for (size_t done = 0; done < len;) {
+        ssize_t rv = pwrite(journal_fd, (const char *)buf + done, len - done, off + done);
+        if (rv <= 0) {
+            perror("nufs: journal write");
+            return -1;
+        }
+        done += rv;
+    }
+    return 0;
+}
+
+// reads count blocks of the image into buf, starting at block bnum
+static int read_blocks(void *buf, int bnum, int count) {
+    size_t len = (size_t)count * BLOCK_SIZE;
+    off_t off = (off_t)bnum * BLOCK_SIZE;
+    for (size_t done = 0; done < len;) {
+        ssize_t rv = pread(journal_fd, (char *)buf + done, len - done, off + done);
+        if (rv <= 0) {
+            perror("nufs: journal read");
+            return -1;
+        }
+        done += rv;
+    }
+    return 0;
+}
+
+// makes everything written so far durable
+static int flush_image() {
+    if (flush_enabled && fdatasync(journal_fd) != 0) {
+        perror("nufs: fdatasync");
+        return -1;
+    }
+    return 0;
+}
+
+// starts a new lap: the next transaction goes right after the header.
+// Everything in the journal must already be durable at home.
+static int journal_reset() {
+    char *block = calloc(1, BLOCK_SIZE);
+    journal_header_t *hdr = (journal_header_t *)block;
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->first_seq = journal_seq;
+    int rv = write_blocks(block, journal_start, 1);
+    free(block);
+    if (rv == 0) {
+        rv = flush_image();
+    }
+    journal_head = 1;
+    if (lap_map != NULL) {
+        memset(lap_map, 0, (BLOCK_COUNT + 63) / 64 * sizeof(uint64_t));
+    }
+    return rv;
+}
+
+// Write the empty journal of a freshly formatted image.
+void journal_format(void *journal) {
+    journal_header_t *hdr = journal;
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->first_seq = 1;
+}
+
+// writes the after-images of a transaction (laid out as in the journal,
+// starting at buf) to their home blocks
+static int checkpoint(char *buf, int length) {
+    int pos = 0;
+    while (pos < length) {
+        journal_desc_t *desc = (journal_desc_t *)(buf + (size_t)pos * BLOCK_SIZE);
+        if (desc->magic != JOURNAL_DESC) {
+            break; // the commit block
+        }
+        for (int ii = 0; ii < desc->count; ++ii) {
+            if (write_blocks(buf + (size_t)(pos + 1 + ii) * BLOCK_SIZE, desc->bnums[ii], 1) != 0) {
+                return -1;
+            }
+        }
+        pos += 1 + desc->count;
+    }
+    return 0;
+}
+
+// records the home blocks of a transaction written to the journal (laid
+// out as in the journal, starting at buf) in lap_map
+static void lap_mark(const char *buf, int length) {
+    for (int pos = 0; pos < length;) {
+        const journal_desc_t *desc = (const journal_desc_t *)(buf + (size_t)pos * BLOCK_SIZE);
+        if (desc->magic != JOURNAL_DESC) {
+            break; // the commit block
+        }
+        for (int ii = 0; ii < desc->count; ++ii) {
+            lap_map[desc->bnums[ii] / 64] |= 1ULL << (desc->bnums[ii] % 64);
+        }
+        pos += 1 + desc->count;
+    }
+}
+
+// replays the committed transactions in the journal, returning how many
+// were found, or -1 on an I/O error
+static int journal_replay(unsigned first_seq) {
+    char *buf = malloc((size_t)journal_blocks * BLOCK_SIZE);
+    if (buf == NULL || read_blocks(buf, journal_start, journal_blocks) != 0) {
+        free(buf);
+        return -1;
+    }
+    unsigned seq = first_seq;
+    int pos = 1;
+    int replayed = 0;
+    for (;;) {
+        // walk the descriptors up to a commit block with a matching checksum
+        int start = pos;
+        int committed = 0;
+        unsigned hash = 2166136261u;
+        while (pos < journal_blocks) {
+            char *block = buf + (size_t)pos * BLOCK_SIZE;
+            journal_desc_t *desc = (journal_desc_t *)block;
+            journal_commit_t *commit = (journal_commit_t *)block;
+            if (desc->magic == JOURNAL_DESC && desc->seq == seq &&
+                desc->count >= 0 && desc->count <= desc_capacity() &&
+                pos + 1 + desc->count < journal_blocks) {
+                int valid = 1;
+                for (int ii = 0; ii < desc->count; ++ii) {
+                    valid &= desc->bnums[ii] > 0 && desc->bnums[ii] < BLOCK_COUNT;
+                }
+                if (!valid) {
+                    break;
+                }
+                hash = checksum(hash, block, (size_t)(1 + desc->count) * BLOCK_SIZE);
+                pos += 1 + desc->count;
+                continue;
+            }
+            committed = commit->magic == JOURNAL_COMMIT && commit->seq == seq &&
+                        commit->checksum == hash && pos > start;
+            break;
+        }
+        if (!committed) {
+            break; // torn or stale: the journal ends here
+        }
+        if (checkpoint(buf + (size_t)start * BLOCK_SIZE, pos - start) != 0) {
+            free(buf);
+            return -1;
+        }
+        pos++;
+        seq++;
+        replayed++;
+    }
+    free(buf);
+    journal_seq = seq;
+    return replayed;
+}
+
+// Open the journal of an image and replay its committed transactions.
+int journal_init(int fd, const superblock_t *sb) {
+    journal_fd = fd;
+    journal_start = sb->journal_start;
+    journal_blocks = sb->journal_blocks;
+    if (journal_blocks < journal_min_blocks(sb)) {
+        fprintf(stderr, "nufs: journal of %d blocks is too small, the image needs %d "
+                        "(reformat with mkfs.nufs -j)\n",
+                journal_blocks, journal_min_blocks(sb));
+        return -1;
+    }
+    journal_failed = 0;
+
+    journal_header_t hdr;
+    if (pread(fd, &hdr, sizeof(hdr), (off_t)journal_start * BLOCK_SIZE) != sizeof(hdr) ||
+        hdr.magic != JOURNAL_MAGIC) {
+        fprintf(stderr, "nufs: journal header is missing\n");
+        return -1;
+    }
+    int replayed = journal_replay(hdr.first_seq);
+    if (replayed < 0) {
+        return -1;
+    }
+    if (replayed > 0) {
+        TRACE(TRACE_INFO, TRACE_REPLAY, replayed, 0);
+        printf("nufs: replayed %d journal transactions\n", replayed);
+        if (flush_image() != 0) {
+            return -1;
+        }
+    }
+    if (journal_reset() != 0) {
+        return -1;
+    }
+
+    free(dirty_map);
+    dirty_map = calloc((BLOCK_COUNT + 63) / 64, sizeof(uint64_t));
+    free(lap_map);
+    lap_map = calloc((BLOCK_COUNT + 63) / 64, sizeof(uint64_t));
+    // leave room for a transaction to keep growing while it is committed
+    commit_threshold = (journal_blocks - 1) / 4;
+    if (commit_threshold < 1) {
+        commit_threshold = 1;
+    }
+    // as many blocks as fit after the header with their descriptors and
+    // the commit block
+    int per_desc = desc_capacity();
+    commit_limit = journal_blocks - 2;
+    while (commit_limit + (commit_limit + per_desc - 1) / per_desc > journal_blocks - 2) {
+        commit_limit--;
+    }
+    op_blocks = op_budget(sb);
+    return dirty_map == NULL || lap_map == NULL ? -1 : 0;
+}
+
+// Set how commits are made.
+void journal_configure(int interval_ms, int flush) {
+    pthread_mutex_lock(&wake_lock);
+    commit_interval = interval_ms > 0 ? interval_ms : JOURNAL_INTERVAL_MS;
+    flush_enabled = flush;
+    pthread_mutex_unlock(&wake_lock);
+}
+
+// a commit blocks new operations once it waits for the barrier, so a
+// steady stream of operations cannot starve it
+static void barrier_init() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&barrier, &attr);
+    pthread_rwlock_init(&readers, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+// commits the running transaction every commit_interval, or earlier
+// once it has grown past commit_threshold
+static void *committer_main(void *arg) {
+    pthread_mutex_lock(&wake_lock);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += commit_interval / 1000;
+        deadline.tv_nsec += (long)(commit_interval % 1000) * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        // a transaction that filled up during the last commit goes at once
+        if (__atomic_load_n(&dirty_count, __ATOMIC_RELAXED) < commit_threshold) {
+            pthread_cond_timedwait(&wake, &wake_lock, &deadline);
+        }
+        pthread_mutex_unlock(&wake_lock);
+        journal_commit();
+        pthread_mutex_lock(&wake_lock);
+    }
+    pthread_mutex_unlock(&wake_lock);
+    return NULL;
+}
+
+// The commit thread is started by the first operation rather than at
+// init, so that it runs in the process that serves the mount (fuse_main
+// forks when it daemonizes).
+static void committer_start() {
+    if (__atomic_load_n(&committer_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&wake_lock);
+    if (!committer_running && pthread_create(&committer, NULL, committer_main, NULL) == 0) {
+        __atomic_store_n(&committer_running, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&wake_lock);
+}
+
+// Enter an operation that changes metadata.
+void journal_begin() {
+    pthread_once(&barrier_once, barrier_init);
+    committer_start();
+    // Operations that outpace the committer commit in its place rather
+    // than grow the transaction past what the journal can hold.  Blocks
+    // changed by running operations count twice, which errs on the safe
+    // side.
+    int taken = __atomic_load_n(&reserved, __ATOMIC_RELAXED);
+    for (;;) {
+        int dirty = __atomic_load_n(&dirty_count, __ATOMIC_RELAXED);
+        if (dirty + taken + op_blocks > commit_limit) {
+            journal_commit();
+            taken = __atomic_load_n(&reserved, __ATOMIC_RELAXED);
+        } else if (__atomic_compare_exchange_n(&reserved, &taken, taken + op_blocks, 0,
+                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    pthread_rwlock_rdlock(&barrier);
+}
+
+// Leave an operation.
+void journal_end() {
+    pthread_rwlock_unlock(&barrier);
+    __atomic_fetch_sub(&reserved, op_blocks, __ATOMIC_RELAXED);
+}
+
+// Enter a read that keeps using data blocks after the inode lock is dropped.
+void journal_read_begin() {
+    pthread_once(&barrier_once, barrier_init);
+    pthread_rwlock_rdlock(&readers);
+}
+
+// Leave a read entered with journal_read_begin().
+void journal_read_end() {
+    pthread_rwlock_unlock(&readers);
+}
+
+// appends a block number to a growable list (caller holds list_lock)
+static void list_add(int **list, int *count, int *cap, int bnum) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *list = realloc(*list, *cap * sizeof(int));
+    }
+    (*list)[(*count)++] = bnum;
+}
+
+// Record a change to metadata in the running transaction.
+void journal_dirty(const void *addr, size_t len) {
+    size_t off = (const char *)addr - (const char *)blocks_get_block(0);
+    int first = off / BLOCK_SIZE;
+    int last = (off + len - 1) / BLOCK_SIZE;
+    for (int bnum = first; bnum <= last; ++bnum) {
+        uint64_t bit = 1ULL << (bnum % 64);
+        if (__atomic_fetch_or(&dirty_map[bnum / 64], bit, __ATOMIC_RELAXED) & bit) {
+            continue; // already part of the transaction
+        }
+        pthread_mutex_lock(&list_lock);
+        list_add(&dirty_list, &dirty_count, &dirty_cap, bnum);
+        int full = dirty_count == commit_threshold;
+        pthread_mutex_unlock(&list_lock);
+        if (full) {
+            // under wake_lock, so the committer cannot miss it between
+            // checking dirty_count and going to sleep
+            pthread_mutex_lock(&wake_lock);
+            pthread_cond_signal(&wake);
+            pthread_mutex_unlock(&wake_lock);
+        }
+    }
+}
+
+// Keep a freed block from being reused until the transaction commits.
+void journal_defer_free(int bnum) {
+    pthread_mutex_lock(&list_lock);
+    list_add(&freed_list, &freed_count, &freed_cap, bnum);
+    pthread_mutex_unlock(&list_lock);
+}
+
+static int int_cmp(const void *a, const void *b) {
+    int ia = *(const int *)a;
+    int ib = *(const int *)b;
+    return (ia > ib) - (ia < ib);
+}
+
+// Commit the running transaction and wait until it is durable.
+int journal_commit() {
+    pthread_once(&barrier_once, barrier_init);
+    pthread_mutex_lock(&commit_lock);
+
+    // Stop the world just long enough to copy the transaction out, laid
+    // out as it goes into the journal.
+    pthread_rwlock_wrlock(&barrier);
+    int count = dirty_count;
+    int per_desc = desc_capacity();
+    int length = count + (count + per_desc - 1) / per_desc + 1;
+    char *buf = count ? calloc(length, BLOCK_SIZE) : NULL;
+    qsort(dirty_list, count, sizeof(int), int_cmp);
+    int pos = 0;
+    for (int ii = 0; ii < count; ii += per_desc) {
+        journal_desc_t *desc = (journal_desc_t *)(buf + (size_t)pos * BLOCK_SIZE);
+        desc->magic = JOURNAL_DESC;
+        desc->seq = journal_seq;
+        desc->count = count - ii < per_desc ? count - ii : per_desc;
+        pos++;
+        for (int jj = 0; jj < desc->count; ++jj) {
+            int bnum = dirty_list[ii + jj];
+            desc->bnums[jj] = bnum;
+            memcpy(buf + (size_t)pos * BLOCK_SIZE, blocks_get_block(bnum), BLOCK_SIZE);
+            dirty_map[bnum / 64] &= ~(1ULL << (bnum % 64));
+            pos++;
+        }
+    }
+    int *freed = freed_list;
+    int nfreed = freed_count;
+    dirty_count = 0;
+    freed_list = 0;
+    freed_count = 0;
+    freed_cap = 0;
+    pthread_rwlock_unlock(&barrier);
+
+    int rv = 0;
+    if (count > 0) {
+        uint64_t started = stats_now();
+        journal_commit_t *commit = (journal_commit_t *)(buf + (size_t)pos * BLOCK_SIZE);
+        commit->magic = JOURNAL_COMMIT;
+        commit->seq = journal_seq;
+        commit->checksum = checksum(2166136261u, buf, (size_t)pos * BLOCK_SIZE);
+        if (journal_failed) {
+            rv = -1;
+        } else if (length > journal_blocks - 1) {
+            // operations reserve what they change, so this is a bug; writing
+            // the transaction home unprotected could tear the metadata
+            fprintf(stderr, "nufs: transaction of %d blocks does not fit the journal\n", count);
+            rv = -1;
+        } else {
+            // wrap around once the region is used up; what the earlier lap
+            // logged must be durable at home before it is overwritten
+            if (journal_head + length > journal_blocks) {
+                rv = flush_image();
+                rv = rv ? rv : journal_reset();
+            }
+            rv = rv ? rv : write_blocks(buf, journal_start + journal_head, length);
+            rv = rv ? rv : flush_image();
+            if (rv == 0) {
+                journal_head += length;
+                journal_seq++;
+                lap_mark(buf, length);
+                // home writes only need to be durable before the next wrap
+                rv = checkpoint(buf, length);
+            }
+        }
+        if (rv != 0 && !journal_failed) {
+            fprintf(stderr, "nufs: commit failed, no further changes reach the image\n");
+            journal_failed = 1;
+        }
+        uint64_t elapsed = stats_now() - started;
+        stats_record(STAT_JOURNAL_COMMIT, elapsed);
+        stats_record(STAT_JOURNAL_BLOCKS, count);
+        if (rv != 0) {
+            stats_error(STAT_JOURNAL_COMMIT);
+        }
+        TRACE(TRACE_INFO, TRACE_COMMIT, count, elapsed / 1000);
+    }
+    free(buf);
+
+    // A freed block logged in this lap may be reused for file data, which
+    // is written in place; replaying the old after-image would clobber it.
+    // The home copies are durable once flushed, so the lap can end here.
+    for (int ii = 0; ii < nfreed && !journal_failed; ++ii) {
+        if (lap_map[freed[ii] / 64] & (1ULL << (freed[ii] % 64))) {
+            rv = flush_image();
+            rv = rv ? rv : journal_reset();
+            journal_failed = rv != 0;
+            break;
+        }
+    }
+
+    // wait out the reads that may still be sending from the freed blocks
+    if (nfreed > 0) {
+        pthread_rwlock_wrlock(&readers);
+        pthread_rwlock_unlock(&readers);
+    }
+
+    // the frees are on disk now, so the blocks may be reused; handing
+    // them back a run at a time keeps the allocator's extents whole.  If
+    // they never got there, the blocks stay taken.
+    qsort(freed, nfreed, sizeof(int), int_cmp);
+    for (int ii = 0; ii < nfreed && !journal_failed;) {
+        int run = 1;
+        while (ii + run < nfreed && freed[ii + run] == freed[ii] + run) {
+            run++;
+        }
+        release_blocks(freed[ii], run);
+        ii += run;
+    }
+    free(freed);
+    pthread_mutex_unlock(&commit_lock);
+    return rv;
+}
+
+// Commit, write everything home and empty the journal.
+void journal_shutdown() {
+    if (committer_running) {
+        pthread_mutex_lock(&wake_lock);
+        stopping = 1;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&wake_lock);
+        pthread_join(committer, NULL);
+        committer_running = 0;
+        stopping = 0;
+    }
+    if (journal_commit() == 0 && flush_image() == 0) {
+        journal_reset();
+    }
+    free(dirty_map);
+    dirty_map = 0;
+    free(lap_map);
+    lap_map = 0;
+    free(dirty_list);
+    dirty_list = 0;
+    dirty_count = 0;
+    dirty_cap = 0;
+}
@@ -0,0 +1,133 @@
+/**
+ * @file journal.h
+ *
+ * A redo journal for metadata.
+ *
+ * Metadata (the bitmaps, group descriptors, inode table, directory blocks
+ * and extent blocks) is changed in a private mapping of the image, so no
+ * change reaches the image file on its own.  Each operation runs between
+ * journal_begin() and journal_end() and reports the metadata it changes
+ * with journal_dirty().  All operations since the last commit form one
+ * transaction.  A background thread commits it: the after-images of the
+ * changed blocks are appended to the journal region and made durable with
+ * a single flush, then written to their home locations.  Mounting replays
+ * the committed transactions that may not have reached home.
+ *
+ * File data is not journaled; it is written in place through the shared
+ * mapping.  Blocks freed by a transaction are not reused before it commits,
+ * so data written to a reused block never lands in a block that the
+ * on-disk metadata still gives to someone else.  Nor is a freed block that
+ * the journal still holds an after-image of reused before the journal is
+ * reset, so replay never writes stale metadata over data.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+
+#include "blocks.h"
+
+/**
+ * Open the journal of an image and replay its committed transactions.
+ *
+ * Must be called before the image is mapped.
+ *
+ * @param fd Open file descriptor of the image.
+ * @param sb Superblock of the image.
+ *
+ * @return 0 on success, -1 if the journal could not be read or replayed.
+ */
+int journal_init(int fd, const superblock_t *sb);
+
+/**
+ * Return the shortest journal that holds the transaction of one operation.
+ *
+ * Operations may change every block of the block bitmap and the group
+ * descriptor table, so the minimum grows with the image.
+ *
+ * @param sb Superblock of the image; its journal fields are not used.
+ *
+ * @return Length in blocks, header included.
+ */
+int journal_min_blocks(const superblock_t *sb);
+
+/**
+ * Write the empty journal of a freshly formatted image.
+ *
+ * @param journal Pointer to the first block of the journal region.
+ */
+void journal_format(void *journal);
+
+/**
+ * Set how commits are made.
+ *
+ * @param interval_ms Longest time a transaction stays open.
+ * @param flush Nonzero to flush each commit to disk; without it the
+ *              journal gives no crash safety.
+ */
+void journal_configure(int interval_ms, int flush);
+
+/**
+ * Enter an operation that changes metadata.
+ *
+ * Operations do not nest, and must call this before taking any other lock.
+ * Each one reserves room in the journal for the most blocks an operation
+ * can change; if the running transaction cannot make room, it is
+ * committed first.
+ */
+void journal_begin();
+
+/**
+ * Leave an operation entered with journal_begin().
+ */
+void journal_end();
+
+/**
+ * Record a change to metadata in the running transaction.
+ *
+ * @param addr Start of the changed bytes, in the metadata mapping.
+ * @param len Number of changed bytes.
+ */
+void journal_dirty(const void *addr, size_t len);
+
+/**
+ * Enter a read that keeps using data blocks after the inode lock is dropped,
+ * such as a reply sent straight from the image file.
+ *
+ * Blocks freed meanwhile by a truncate are not reused until the read ends.
+ * Must be called before taking the inode lock, and the read must not enter
+ * an operation before journal_read_end().
+ */
+void journal_read_begin();
+
+/**
+ * Leave a read entered with journal_read_begin().
+ */
+void journal_read_end();
+
+/**
+ * Keep a freed block from being reused until the running transaction
+ * commits, then release it with release_blocks().
+ *
+ * @param bnum The freed block.
+ */
+void journal_defer_free(int bnum);
+
+/**
+ * Commit the running transaction and wait until it is durable.
+ *
+ * Must not be called from within an operation.
+ *
+ * Once a commit fails, no later transaction is committed either, and
+ * blocks they free are not reused.
+ *
+ * @return 0 on success, -1 on an I/O error.
+ */
+int journal_commit();
+
+/**
+ * Commit, write everything home and empty the journal.
+ */
+void journal_shutdown();
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "journal.h"
+
+#define TEST_NAME "journal_test.img"
+
+// Logs a metadata block, frees it, reuses it for file data and then
+// crashes, leaving the transactions in the journal.
+int crash(void) {
+  if (blocks_format(TEST_NAME, 4 << 20, NUFS_DEFAULT_BLOCK_SIZE, 0, 0, 0) != 0 ||
+      blocks_init(TEST_NAME) != 0) {
+    return -1;
+  }
+
+  journal_begin();
+  int meta = alloc_block();
+  char *block = blocks_get_block(meta);
+  memset(block, 'M', BLOCK_SIZE);
+  journal_dirty(block, BLOCK_SIZE);
+  journal_end();
+  journal_commit();
+
+  journal_begin();
+  free_block(meta);
+  journal_end();
+  journal_commit();
+
+  journal_begin();
+  int got;
+  int data = alloc_blocks(meta, 1, &got);
+  memset(blocks_get_data(data), 'D', BLOCK_SIZE);
+  blocks_sync_data(data, 1, 1);
+  journal_end();
+  journal_commit();
+
+  printf("Logged block %d as metadata, reused block %d for data\n", meta, data);
+  return data;
+}
+
+int main(int argc, char **argv) {
+  unlink(TEST_NAME);
+  int fds[2];
+  pipe(fds);
+  fflush(stdout);
+  if (fork() == 0) {
+    int data = crash();
+    write(fds[1], &data, sizeof(data));
+    fflush(stdout);
+    _exit(0);
+  }
+  int data = -1;
+  read(fds[0], &data, sizeof(data));
+  wait(NULL);
+  if (data < 0) {
+    printf("Could not set up the image\n");
+    return 1;
+  }
+
+  // mounting replays what the crash left in the journal
+  blocks_init(TEST_NAME);
+  char *block = blocks_get_data(data);
+  printf("Block %d after replay starts with '%c' (expected 'D')\n", data, block[0]);
+  int ok = block[0] == 'D';
+  blocks_free();
+  unlink(TEST_NAME);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,51 @@
+// Formats a nufs disk image with a chosen geometry.
+//
+// Usage: mkfs.nufs [-b block_size] [-i inodes] [-j journal_blocks] [-g blocks_per_group] <image> <size>[K|M|G]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "blocks.h"
+
+// Parses a byte count with an optional K/M/G suffix.
+static size_t parse_size(const char *text) {
+	char *end;
+	size_t size = strtoull(text, &end, 10);
+	switch (*end) {
+	case 'G': case 'g': size <<= 10; // fall through
+	case 'M': case 'm': size <<= 10; // fall through
+	case 'K': case 'k': size <<= 10; end++; break;
+	}
+	return *end == '\0' ? size : 0;
+}
+
+int main(int argc, char *argv[]) {
+	int block_size = NUFS_DEFAULT_BLOCK_SIZE;
+	int inodes = 0;
+	int journal = 0;
+	int group = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:i:j:g:")) != -1) {
+		switch (opt) {
+		case 'b': block_size = atoi(optarg); break;
+		case 'i': inodes = atoi(optarg); break;
+		case 'j': journal = atoi(optarg); break;
+		case 'g': group = atoi(optarg); break;
+		default: goto usage;
+		}
+	}
+	if (argc - optind != 2) {
+		goto usage;
+	}
+	size_t size = parse_size(argv[optind + 1]);
+	if (size == 0) {
+		goto usage;
+	}
+	return blocks_format(argv[optind], size, block_size, inodes, journal, group) == 0 ? 0 : 1;
+
+usage:
+	fprintf(stderr, "Usage: %s [-b block_size] [-i inodes] [-j journal_blocks] "
+			"[-g blocks_per_group] <image> <size>[K|M|G]\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,73 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mount_options.h"
+
+// the options as given
+typedef struct raw_options {
+	char *durability;   // fsync (default), periodic or none
+	int flush_interval;
+	int io_size;
+	int keep_cache;
+} raw_options_t;
+
+static struct fuse_opt nufs_opts[] = {
+	{"durability=%s", offsetof(raw_options_t, durability), 0},
+	{"flush_interval=%d", offsetof(raw_options_t, flush_interval), 0},
+	{"io_size=%d", offsetof(raw_options_t, io_size), 0},
+	{"keep_cache", offsetof(raw_options_t, keep_cache), 1},
+	FUSE_OPT_END
+};
+
+// Take the nufs options out of the FUSE arguments.
+int mount_options_parse(struct fuse_args *args, mount_options_t *options) {
+	raw_options_t raw = {NULL, 5000, NUFS_IO_SIZE, 0};
+	if (fuse_opt_parse(args, &raw, nufs_opts, NULL) == -1) {
+		return -1;
+	}
+	if (raw.durability == NULL || strcmp(raw.durability, "fsync") == 0) {
+		options->durability = DURABILITY_FSYNC;
+	} else if (strcmp(raw.durability, "periodic") == 0) {
+		options->durability = DURABILITY_PERIODIC;
+	} else if (strcmp(raw.durability, "none") == 0) {
+		options->durability = DURABILITY_NONE;
+	} else {
+		fprintf(stderr, "nufs: unknown durability mode %s\n", raw.durability);
+		return -1;
+	}
+	if (raw.io_size < 4096) {
+		fprintf(stderr, "nufs: io_size must be at least 4096\n");
+		return -1;
+	}
+	if ((raw.io_size & (raw.io_size - 1)) != 0) {
+		fprintf(stderr, "nufs: io_size must be a power of two\n");
+		return -1;
+	}
+	if (raw.io_size > NUFS_IO_SIZE) {
+		// FUSE 2 would cap max_write here anyway
+		fprintf(stderr, "nufs: io_size %d lowered to %d\n", raw.io_size, NUFS_IO_SIZE);
+		raw.io_size = NUFS_IO_SIZE;
+	}
+	options->flush_interval = raw.flush_interval;
+	options->io_size = raw.io_size;
+	options->keep_cache = raw.keep_cache;
+
+	// Ask for large requests, so that a big write is one call rather than
+	// one per page. Options given on the command line come later and win.
+	char io_opts[128];
+	snprintf(io_opts, sizeof(io_opts), "-obig_writes,max_write=%d,max_read=%d,max_readahead=%d",
+			raw.io_size, raw.io_size, raw.io_size);
+	if (fuse_opt_insert_arg(args, 1, io_opts) == -1) {
+		return -1;
+	}
+	if (raw.keep_cache) {
+		// Cached names and attributes are invalidated as they change, so
+		// they can be kept for long (see nufs_ll.c).
+		char cache_opts[64];
+		snprintf(cache_opts, sizeof(cache_opts), "-oentry_timeout=%d,attr_timeout=%d",
+				NUFS_CACHE_TIMEOUT, NUFS_CACHE_TIMEOUT);
+		return fuse_opt_insert_arg(args, 1, cache_opts);
+	}
+	return 0;
+}
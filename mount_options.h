@@ -0,0 +1,51 @@
+/**
+ * @file mount_options.h
+ *
+ * The nufs-specific mount options, shared by both frontends:
+ *
+ *     -o durability=fsync|periodic|none  when written data is flushed
+ *     -o flush_interval=MS               period of periodic flushes
+ *     -o io_size=BYTES                   largest read and write request,
+ *                                        a power of two up to NUFS_IO_SIZE
+ *     -o keep_cache                      cache data and attributes for long
+ *
+ * They are taken out of the FUSE arguments, and FUSE's own request size
+ * options go in their place.
+ */
+#ifndef MOUNT_OPTIONS_H
+#define MOUNT_OPTIONS_H
+
+#include <fuse_opt.h>
+
+#include "storage.h"
+
+// Largest read and write requests asked of FUSE by default, and the
+// largest io_size. 128K is the most the FUSE 2 kernel interface passes in
+// one request.
+#define NUFS_IO_SIZE (128 * 1024)
+
+// Seconds the kernel may cache names and attributes under keep_cache.
+#define NUFS_CACHE_TIMEOUT 3600
+
+typedef struct mount_options {
+  durability_t durability; // see storage.h
+  int flush_interval;      // milliseconds between periodic flushes
+  int io_size;             // bytes per read and write request, at most
+  int keep_cache;          // keep file pages cached across opens
+} mount_options_t;
+
+/**
+ * Take the nufs options out of the FUSE arguments, and ask FUSE for
+ * requests of up to io_size bytes (big_writes, max_write, max_read and
+ * max_readahead).  Under keep_cache, also ask for entry_timeout and
+ * attr_timeout of NUFS_CACHE_TIMEOUT.  Those go before the other
+ * arguments, so FUSE options given on the command line override them.
+ *
+ * @param args The FUSE arguments.
+ * @param options Filled in with the options, or their defaults.
+ *
+ * @return 0 on success, -1 (after saying why) if an option is invalid.
+ */
+int mount_options_parse(struct fuse_args *args, mount_options_t *options);
+
+#endif
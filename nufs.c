@@ -4,51 +4,119 @@
 #include <bsd/string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "mount_options.h"
+#include "stats.h"
 #include "storage.h"
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
+#include <fuse_opt.h>
+
+// the nufs mount options (mount_options.h)
+static mount_options_t options;
+
+// The read-only virtual file at the root that shows the stats (stats.h).
+#define STATS_PATH "/.nufs_stats"
+
+static int is_stats(const char *path) {
+	return path != NULL && strcmp(path, STATS_PATH) == 0;
+}
+
+// The text of the stats file as of when it was opened, so that reads at
+// different offsets see one consistent snapshot.
+typedef struct stats_file {
+	size_t len;
+	char *text;
+} stats_file_t;
+
+// Gets the attributes of the stats file. Its size is that of the current
+// text; reads bypass the page cache, so a snapshot of another size is fine.
+static int stats_file_getattr(struct stat *st) {
+	size_t len;
+	char *text = stats_render(&len);
+	if (text == NULL) {
+		return -ENOMEM;
+	}
+	free(text);
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+	st->st_size = len;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	return 0;
+}
+
+// Opens the stats file, taking the snapshot.
+static int stats_file_open(struct fuse_file_info *fi) {
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
+	}
+	stats_file_t *sf = malloc(sizeof(stats_file_t));
+	if (sf == NULL || (sf->text = stats_render(&sf->len)) == NULL) {
+		free(sf);
+		return -ENOMEM;
+	}
+	fi->direct_io = 1;
+	fi->fh = (uintptr_t) sf;
+	return 0;
+}
+
+// Reads from the snapshot of an open stats file.
+static int stats_file_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	stats_file_t *sf = (stats_file_t *) (uintptr_t) fi->fh;
+	if (offset >= sf->len) {
+		return 0;
+	}
+	if (size > sf->len - offset) {
+		size = sf->len - offset;
+	}
+	memcpy(buf, sf->text + offset, size);
+	return size;
+}
 
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask) {
+	STATS_TIME(STAT_FUSE_ACCESS);
+	if (is_stats(path)) {
+		return STATS_RESULT((mask & W_OK) ? -EACCES : 0);
+	}
 	struct stat st;
 	int res = storage_stat(path, &st);
-	return (res == 0) ? 0 : -ENOENT;
+	return STATS_RESULT((res == 0) ? 0 : -ENOENT);
 }
 
 // Gets an object's attributes (type, permissions, size, etc).
 int nufs_getattr(const char *path, struct stat *st) {
+	STATS_TIME(STAT_FUSE_GETATTR);
+	if (is_stats(path)) {
+		return STATS_RESULT(stats_file_getattr(st));
+	}
 	int res = storage_stat(path, st);
 	if (res != 0) {
-		return -ENOENT;
+		return STATS_RESULT(-ENOENT);
 	}
 	return 0;
 }
 
-// Lists the contents of a directory
+// Lists the contents of a directory, resuming at offset. Entries are
+// passed straight from the directory blocks to filler, each with the
+// offset that follows it, until filler reports the buffer full.
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	struct stat st;
-	if (nufs_getattr(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
-		return -ENOENT;
-	}
-
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-
-	slist_t *names = storage_list(path);
-	for (slist_t *it = names; it != NULL; it = it->next) {
-		filler(buf, it->data, NULL, 0);
-	}
-
-	slist_free(names);
-	return 0;
+	STATS_TIME(STAT_FUSE_READDIR);
+	return STATS_RESULT(storage_readdir(path, offset, filler, buf) == 0 ? 0 : -ENOENT);
 }
 
 // mknod makes a filesystem object like a file or directory
@@ -57,8 +125,12 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
 // function.
 // Create a file node
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
+	STATS_TIME(STAT_FUSE_MKNOD);
+	if (is_stats(path)) {
+		return STATS_RESULT(-EEXIST);
+	}
 	int result = storage_mknod(path, mode);
-	return result;
+	return STATS_RESULT(result);
 	//	return storage_mknod(path, mode);
 }
 
@@ -66,69 +138,289 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
 // another system call; see section 2 of the manual
 // Create a directory
 int nufs_mkdir(const char *path, mode_t mode) {
-	return storage_mknod(path, mode | S_IFDIR);
+	STATS_TIME(STAT_FUSE_MKDIR);
+	if (is_stats(path)) {
+		return STATS_RESULT(-EEXIST);
+	}
+	return STATS_RESULT(storage_mknod(path, mode | S_IFDIR));
 }
 
 // Remove a file
 int nufs_unlink(const char *path) {
-	return storage_unlink(path);
+	STATS_TIME(STAT_FUSE_UNLINK);
+	if (is_stats(path)) {
+		return STATS_RESULT(-EACCES);
+	}
+	return STATS_RESULT(storage_unlink(path));
 }
 
 // Create a hard link
 int nufs_link(const char *from, const char *to) {
-	return storage_link(from, to);
+	STATS_TIME(STAT_FUSE_LINK);
+	if (is_stats(from) || is_stats(to)) {
+		return STATS_RESULT(-EACCES);
+	}
+	return STATS_RESULT(storage_link(from, to));
 }
 
 int nufs_rmdir(const char *path) {
+	STATS_TIME(STAT_FUSE_RMDIR);
 	int rv = -1;
 	printf("rmdir(%s) -> %d\n", path, rv);
-	return rv;
+	return STATS_RESULT(rv);
 }
 
 // Rename a file
 int nufs_rename(const char *from, const char *to) {
-	return storage_rename(from, to);
+	STATS_TIME(STAT_FUSE_RENAME);
+	if (is_stats(from) || is_stats(to)) {
+		return STATS_RESULT(-EACCES);
+	}
+	return STATS_RESULT(storage_rename(from, to));
 }
 
 // Change permissions.
 int nufs_chmod(const char *path, mode_t mode) {
-	return -ENOSYS; // Didn't implement
+	STATS_TIME(STAT_FUSE_CHMOD);
+	return STATS_RESULT(-ENOSYS); // Didn't implement
 }
 
 // Change file size
 int nufs_truncate(const char *path, off_t size) {
-	return storage_truncate(path, size);
+	STATS_TIME(STAT_FUSE_TRUNCATE);
+	if (is_stats(path)) {
+		return STATS_RESULT(-EACCES);
+	}
+	return STATS_RESULT(storage_truncate(path, size));
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible. The File open operation
+// Change the size of an open file
+int nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_FTRUNCATE);
+	if (is_stats(path)) {
+		return STATS_RESULT(-EACCES);
+	}
+	return STATS_RESULT(storage_ftruncate(fi->fh, size));
+}
+
+// Preallocates blocks for, or punches a hole in, a range of an open file
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t len,
+		struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_FALLOCATE);
+	if (is_stats(path)) {
+		return STATS_RESULT(-EACCES);
+	}
+	if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+		return STATS_RESULT(storage_punch_hole(fi->fh, offset, len));
+	}
+	if ((mode & ~FALLOC_FL_KEEP_SIZE) != 0) {
+		return STATS_RESULT(-EOPNOTSUPP);
+	}
+	return STATS_RESULT(storage_fallocate(fi->fh, offset, len, mode & FALLOC_FL_KEEP_SIZE));
+}
+
+// Gets the attributes of an open file
+int nufs_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_FGETATTR);
+	if (is_stats(path)) {
+		return STATS_RESULT(stats_file_getattr(st));
+	}
+	return STATS_RESULT(storage_fstat(fi->fh, st) == 0 ? 0 : -ENOENT);
+}
+
+// The file open operation: resolves the inode once and keeps it in
+// fi->fh, so reads and writes through the handle skip the path walk.
+// Under keep_cache, the kernel keeps the pages read by earlier opens.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-	return 0; // Nothing done.
+	STATS_TIME(STAT_FUSE_OPEN);
+	if (is_stats(path)) {
+		return STATS_RESULT(stats_file_open(fi));
+	}
+	fi->keep_cache = options.keep_cache;
+	return STATS_RESULT(storage_open(path, fi->flags, &fi->fh) == 0 ? 0 : -ENOENT);
+}
+
+// Create and open a file
+int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_CREATE);
+	if (is_stats(path)) {
+		return STATS_RESULT(-EEXIST);
+	}
+	fi->keep_cache = options.keep_cache;
+	return STATS_RESULT(storage_create(path, mode, fi->flags, &fi->fh));
 }
 
 // Read data from a file
 int nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	return storage_read(path, buf, size, offset);
+	STATS_TIME(STAT_FUSE_READ);
+	if (is_stats(path)) {
+		return stats_file_read(buf, size, offset, fi);
+	}
+	return STATS_RESULT(storage_read_fh(fi->fh, buf, size, offset));
 }
 
 // Write data to a file
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	return storage_write(path, buf, size, offset);
+	STATS_TIME(STAT_FUSE_WRITE);
+	return STATS_RESULT(storage_write_fh(fi->fh, buf, size, offset));
+}
+
+// Read data from a file with a single copy, straight from the image file.
+// FUSE replies only after this returns, too late to hand the map back, so
+// unlike the low-level frontend this one cannot reply from the image file
+// itself: blocks freed by a racing truncate could be reused by then.
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+		struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_READ_BUF);
+	struct fuse_bufvec *bv;
+	if (is_stats(path)) {
+		bv = malloc(sizeof(struct fuse_bufvec));
+		char *text = malloc(size);
+		if (bv == NULL || text == NULL) {
+			free(bv);
+			free(text);
+			return STATS_RESULT(-ENOMEM);
+		}
+		*bv = FUSE_BUFVEC_INIT(stats_file_read(text, size, offset, fi));
+		bv->buf[0].mem = text;
+		*bufp = bv;
+		return 0;
+	}
+	storage_run_t *runs;
+	int count = storage_map_fh(fi->fh, size, offset, &runs);
+	if (count < 0) {
+		return STATS_RESULT(-ENOMEM);
+	}
+	struct fuse_bufvec *src = malloc(sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+	size_t total = 0;
+	for (int ii = 0; ii < count; ++ii) {
+		total += runs[ii].len;
+	}
+	// FUSE frees the bufvec and the memory of its buffers once it replies
+	bv = malloc(sizeof(struct fuse_bufvec));
+	char *data = malloc(total ? total : 1);
+	ssize_t copied = -ENOMEM;
+	if (src != NULL && bv != NULL && data != NULL) {
+		*src = FUSE_BUFVEC_INIT(0);
+		src->count = count > 0 ? count : 1;
+		for (int ii = 0; ii < count; ++ii) {
+			struct fuse_buf *buf = &src->buf[ii];
+			buf->size = runs[ii].len;
+			buf->mem = runs[ii].mem;
+			buf->flags = runs[ii].mem ? 0 : FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			buf->fd = runs[ii].fd;
+			buf->pos = runs[ii].pos;
+		}
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(total);
+		dst.buf[0].mem = data;
+		copied = total ? fuse_buf_copy(&dst, src, 0) : 0;
+	}
+	storage_map_done(runs, count);
+	free(src);
+	if (copied < 0) {
+		free(bv);
+		free(data);
+		return STATS_RESULT((int) copied);
+	}
+	*bv = FUSE_BUFVEC_INIT(copied);
+	bv->buf[0].mem = data;
+	*bufp = bv;
+	return 0;
+}
+
+// Copies the next len bytes of a write request into dst, advancing the
+// request's bufvec.
+static int copy_write_buf(void *arg, char *dst, size_t len) {
+	struct fuse_bufvec dst_bv = FUSE_BUFVEC_INIT(len);
+	dst_bv.buf[0].mem = dst;
+	return fuse_buf_copy(&dst_bv, arg, 0) == (ssize_t) len ? 0 : -1;
+}
+
+// Write data to a file straight from the request (or the pipe it was
+// spliced into) to the mapped blocks.
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+		struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_WRITE_BUF);
+	size_t size = fuse_buf_size(buf);
+	return STATS_RESULT(storage_write_from_fh(fi->fh, copy_write_buf, buf, size, offset));
+}
+
+// Called on each close(2) of an open file
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_FLUSH);
+	if (is_stats(path)) {
+		return 0;
+	}
+	return STATS_RESULT(storage_flush(fi->fh) == 0 ? 0 : -EIO);
+}
+
+// Makes an open file's data and metadata durable
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_FSYNC);
+	if (is_stats(path)) {
+		return 0;
+	}
+	return STATS_RESULT(storage_fsync(fi->fh, datasync) == 0 ? 0 : -EIO);
+}
+
+// Makes a directory's entries durable
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_FSYNCDIR);
+	return STATS_RESULT(options.durability != DURABILITY_FSYNC || storage_sync() == 0 ? 0 : -EIO);
+}
+
+// Reports the size and usage of the file system
+int nufs_statfs(const char *path, struct statvfs *st) {
+	STATS_TIME(STAT_FUSE_STATFS);
+	return STATS_RESULT(storage_statfs(st));
+}
+
+// Called when the last reference to an open file goes away
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_RELEASE);
+	if (is_stats(path)) {
+		stats_file_t *sf = (stats_file_t *) (uintptr_t) fi->fh;
+		free(sf->text);
+		free(sf);
+		return 0;
+	}
+	return STATS_RESULT(storage_release(fi->fh));
 }
 
 // Set file access and modification times
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
-	return storage_set_time(path, ts);
+	STATS_TIME(STAT_FUSE_UTIMENS);
+	if (is_stats(path)) {
+		return STATS_RESULT(-EACCES);
+	}
+	return STATS_RESULT(storage_set_time(path, ts));
 }
 
-// Extended operations
+// Runs in the process serving the mount, once it is up.
+void *nufs_init(struct fuse_conn_info *conn) {
+	storage_set_durability(options.durability, options.flush_interval);
+	// let writes arrive in a pipe, and reads go out of the image file,
+	// by splice. Pages are copied rather than moved: the image file's
+	// cache stays where the data mapping expects it.
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+	return NULL;
+}
+
+// Commits outstanding changes when the file system is unmounted.
+void nufs_destroy(void *private_data) {
+	storage_destroy();
+}
+
+// Extended operations. NUFS_IOC_STAT reads one metric of the stats
+// (stats.h); it works on any open file.
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
 		unsigned int flags, void *data) {
-	int rv = -1;
-	printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
-	return rv;
+	STATS_TIME(STAT_FUSE_IOCTL);
+	if ((unsigned int) cmd == NUFS_IOC_STAT) {
+		nufs_stat_t *stat = data;
+		return STATS_RESULT(stats_read(stat->index, stat) == 0 ? 0 : -EINVAL);
+	}
+	return STATS_RESULT(-ENOTTY);
 }
 
 void nufs_init_ops(struct fuse_operations *ops) {
@@ -137,7 +429,7 @@ void nufs_init_ops(struct fuse_operations *ops) {
 	ops->getattr = nufs_getattr;
 	ops->readdir = nufs_readdir;
 	ops->mknod = nufs_mknod;
-	// ops->create   = nufs_create; // alternative to mknod
+	ops->create = nufs_create;
 	ops->mkdir = nufs_mkdir;
 	ops->link = nufs_link;
 	ops->unlink = nufs_unlink;
@@ -145,11 +437,23 @@ void nufs_init_ops(struct fuse_operations *ops) {
 	ops->rename = nufs_rename;
 	ops->chmod = nufs_chmod;
 	ops->truncate = nufs_truncate;
+	ops->ftruncate = nufs_ftruncate;
+	ops->fallocate = nufs_fallocate;
+	ops->fgetattr = nufs_fgetattr;
 	ops->open = nufs_open;
 	ops->read = nufs_read;
 	ops->write = nufs_write;
+	ops->read_buf = nufs_read_buf;
+	ops->write_buf = nufs_write_buf;
+	ops->flush = nufs_flush;
+	ops->fsync = nufs_fsync;
+	ops->fsyncdir = nufs_fsyncdir;
+	ops->statfs = nufs_statfs;
+	ops->release = nufs_release;
 	ops->utimens = nufs_utimens;
 	ops->ioctl = nufs_ioctl;
+	ops->init = nufs_init;
+	ops->destroy = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
@@ -164,10 +468,19 @@ int main(int argc, char *argv[]) {
     char* fs_data_file = argv[argc-1];
     // Remove the data file argument from the argument list
     argc--;
+    // Take out our own mount options
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (mount_options_parse(&args, &options) != 0) {
+        return 1;
+    }
     // Initialize the storage with the data file
-    storage_init(fs_data_file);
+    if (storage_init(fs_data_file) != 0) {
+        return 1;
+    }
     // Initialize FUSE operations
     nufs_init_ops(&nufs_ops);
     // Pass the remaining arguments to fuse_main
-    return fuse_main(argc, argv, &nufs_ops, NULL);
+    int rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+    fuse_opt_free_args(&args);
+    return rv;
 }
@@ -0,0 +1,771 @@
+// The low-level FUSE frontend. Requests name files by inode number
+// rather than by path, so neither FUSE nor nufs walks a path per call:
+// the kernel looks each name up once, keeps the inode number in its
+// dentry cache for entry_timeout seconds, and sends a forget when it
+// drops it. Every inode the kernel knows of stays pinned until then.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "mount_options.h"
+#include "stats.h"
+#include "storage.h"
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+#include <fuse_opt.h>
+
+// the nufs mount options (mount_options.h)
+static mount_options_t options;
+
+// How long the kernel may cache names and attributes, in seconds.
+typedef struct ll_options {
+	double entry_timeout;
+	double attr_timeout;
+} ll_options_t;
+
+static ll_options_t ll_options = {1.0, 1.0};
+
+static struct fuse_opt ll_opts[] = {
+	{"entry_timeout=%lf", offsetof(ll_options_t, entry_timeout), 0},
+	{"attr_timeout=%lf", offsetof(ll_options_t, attr_timeout), 0},
+	FUSE_OPT_END
+};
+
+// FUSE numbers the root FUSE_ROOT_ID (1); nufs numbers it 0.
+#define INO(inum) ((fuse_ino_t) (inum) + FUSE_ROOT_ID)
+#define INUM(ino) ((int) ((ino) - FUSE_ROOT_ID))
+
+// The read-only virtual file at the root that shows the stats (stats.h),
+// under a number no inode has.
+#define STATS_NAME ".nufs_stats"
+#define STATS_INO ((fuse_ino_t) INT_MAX + 2)
+
+// Cache invalidations. Under keep_cache the kernel holds names,
+// attributes and pages for long, and every change nufs makes that
+// affects them is followed by an invalidation. They are queued and sent
+// by a thread of their own: sending one from an operation could wait on
+// a lock the kernel holds until that operation replies.
+typedef struct inval {
+	fuse_ino_t ino;     // the inode, or the directory holding the entry
+	char *name;         // the entry to drop, or NULL for the inode
+	off_t off;          // first byte of cached data to drop, -1 for none
+	off_t len;          // bytes to drop, 0 for up to the end
+	struct inval *next;
+} inval_t;
+
+static struct fuse_chan *chan;
+static pthread_t inval_thread;
+static int inval_running = 0;
+static inval_t *inval_head = NULL;
+static inval_t *inval_last = NULL;
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_ready = PTHREAD_COND_INITIALIZER;
+
+// Queues an invalidation of an entry (name not NULL), or of an inode's
+// attributes and, unless off is -1, the given range of its pages.
+static void queue_inval(fuse_ino_t ino, const char *name, off_t off, off_t len) {
+	if (!inval_running) {
+		return;
+	}
+	inval_t *iv = malloc(sizeof(inval_t));
+	if (iv == NULL) {
+		return;
+	}
+	iv->ino = ino;
+	iv->name = NULL;
+	iv->off = off;
+	iv->len = len;
+	iv->next = NULL;
+	if (name != NULL && (iv->name = strdup(name)) == NULL) {
+		free(iv);
+		return;
+	}
+	pthread_mutex_lock(&inval_lock);
+	// a stream of writes to a file only needs its attributes dropped once
+	if (name == NULL && off < 0 && inval_last != NULL && inval_last->ino == ino
+			&& inval_last->name == NULL && inval_last->off < 0) {
+		free(iv);
+	} else {
+		if (inval_last != NULL) {
+			inval_last->next = iv;
+		} else {
+			inval_head = iv;
+		}
+		inval_last = iv;
+		pthread_cond_signal(&inval_ready);
+	}
+	pthread_mutex_unlock(&inval_lock);
+}
+
+// Sends one invalidation to the kernel. Failures are expected: the
+// kernel answers ENOENT for what it no longer caches.
+static void send_inval(inval_t *iv) {
+	STATS_TIME(STAT_FUSE_NOTIFY);
+	if (iv->name != NULL) {
+		fuse_lowlevel_notify_inval_entry(chan, iv->ino, iv->name, strlen(iv->name));
+	} else {
+		fuse_lowlevel_notify_inval_inode(chan, iv->ino, iv->off, iv->len);
+	}
+}
+
+// sends queued invalidations, in order, until stopped and drained
+static void *inval_main(void *arg) {
+	pthread_mutex_lock(&inval_lock);
+	for (;;) {
+		while (inval_head == NULL && inval_running) {
+			pthread_cond_wait(&inval_ready, &inval_lock);
+		}
+		inval_t *iv = inval_head;
+		if (iv == NULL) {
+			break;
+		}
+		inval_head = iv->next;
+		if (inval_head == NULL) {
+			inval_last = NULL;
+		}
+		pthread_mutex_unlock(&inval_lock);
+		send_inval(iv);
+		free(iv->name);
+		free(iv);
+		pthread_mutex_lock(&inval_lock);
+	}
+	pthread_mutex_unlock(&inval_lock);
+	return NULL;
+}
+
+// Replies with an error, counting it against the STATS_TIME metric.
+#define REPLY_ERR(req, err) fuse_reply_err((req), -STATS_RESULT(-(err)))
+
+static int is_stats(fuse_ino_t parent, const char *name) {
+	return parent == FUSE_ROOT_ID && strcmp(name, STATS_NAME) == 0;
+}
+
+// The text of the stats file as of when it was opened, so that reads at
+// different offsets see one consistent snapshot.
+typedef struct stats_file {
+	size_t len;
+	char *text;
+} stats_file_t;
+
+// Gets the attributes of the stats file. Its size is that of the current
+// text; reads bypass the page cache, so a snapshot of another size is fine.
+static int stats_file_getattr(struct stat *st) {
+	size_t len;
+	char *text = stats_render(&len);
+	if (text == NULL) {
+		return -ENOMEM;
+	}
+	free(text);
+	memset(st, 0, sizeof(struct stat));
+	st->st_ino = STATS_INO;
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+	st->st_size = len;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	return 0;
+}
+
+// Replies to a request for an entry with an inode and its attributes.
+// The inode was pinned for the kernel; if the reply does not reach it,
+// the kernel will never forget the entry, so the pin is dropped here.
+static void reply_entry(fuse_req_t req, int inum, const struct stat *st) {
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = INO(inum);
+	e.attr = *st;
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = ll_options.attr_timeout;
+	e.entry_timeout = ll_options.entry_timeout;
+	if (fuse_reply_entry(req, &e) != 0) {
+		storage_forget(inum, 1);
+	}
+}
+
+// Looks a name up in a directory
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	STATS_TIME(STAT_FUSE_LOOKUP);
+	if (is_stats(parent, name)) {
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		int rv = stats_file_getattr(&e.attr);
+		if (rv != 0) {
+			REPLY_ERR(req, -rv);
+			return;
+		}
+		e.ino = STATS_INO;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	struct stat st;
+	int inum = storage_lookup(INUM(parent), name, &st);
+	if (inum < 0) {
+		REPLY_ERR(req, ENOENT);
+		return;
+	}
+	reply_entry(req, inum, &st);
+}
+
+// Drops the kernel's references to an inode, made by lookups and the
+// like. The root and the stats file are never pinned.
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	STATS_TIME(STAT_FUSE_FORGET);
+	if (ino != FUSE_ROOT_ID && ino != STATS_INO) {
+		storage_forget(INUM(ino), nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+// Gets an object's attributes (type, permissions, size, etc).
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_GETATTR);
+	struct stat st;
+	if (ino == STATS_INO) {
+		int rv = stats_file_getattr(&st);
+		if (rv != 0) {
+			REPLY_ERR(req, -rv);
+			return;
+		}
+		fuse_reply_attr(req, &st, 0);
+		return;
+	}
+	int rv = fi != NULL ? storage_fstat(fi->fh, &st) : storage_stat_inum(INUM(ino), &st);
+	if (rv != 0) {
+		REPLY_ERR(req, ENOENT);
+		return;
+	}
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, ll_options.attr_timeout);
+}
+
+// Changes an object's attributes. Of those, nufs keeps only the size;
+// times are accepted and ignored, as by storage_set_time.
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+		struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_SETATTR);
+	if (ino == STATS_INO) {
+		REPLY_ERR(req, EACCES);
+		return;
+	}
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		REPLY_ERR(req, ENOSYS); // Didn't implement
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		int rv = fi != NULL ? storage_ftruncate(fi->fh, attr->st_size)
+				: storage_truncate_inum(INUM(ino), attr->st_size);
+		if (rv != 0) {
+			REPLY_ERR(req, EPERM);
+			return;
+		}
+		queue_inval(ino, NULL, attr->st_size, 0);
+	}
+	struct stat st;
+	if (storage_stat_inum(INUM(ino), &st) != 0) {
+		REPLY_ERR(req, ENOENT);
+		return;
+	}
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, ll_options.attr_timeout);
+}
+
+// Creates a file node or a directory and replies with its entry;
+// returns the error to reply with instead, or 0.
+static int make_node(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	if (is_stats(parent, name)) {
+		return EEXIST;
+	}
+	struct stat st;
+	int inum = storage_mknod_at(INUM(parent), name, mode, &st);
+	if (inum < 0) {
+		return EPERM;
+	}
+	reply_entry(req, inum, &st);
+	return 0;
+}
+
+// Create a file node
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		dev_t rdev) {
+	STATS_TIME(STAT_FUSE_MKNOD);
+	int err = make_node(req, parent, name, mode);
+	if (err != 0) {
+		REPLY_ERR(req, err);
+	}
+}
+
+// Create a directory
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	STATS_TIME(STAT_FUSE_MKDIR);
+	int err = make_node(req, parent, name, mode | S_IFDIR);
+	if (err != 0) {
+		REPLY_ERR(req, err);
+	}
+}
+
+// Remove a file
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	STATS_TIME(STAT_FUSE_UNLINK);
+	if (is_stats(parent, name)) {
+		REPLY_ERR(req, EACCES);
+		return;
+	}
+	if (storage_unlink_at(INUM(parent), name) != 0) {
+		REPLY_ERR(req, ENOENT);
+		return;
+	}
+	fuse_reply_err(req, 0);
+	queue_inval(parent, name, -1, 0);
+}
+
+// Rename a file
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname) {
+	STATS_TIME(STAT_FUSE_RENAME);
+	if (is_stats(parent, name) || is_stats(newparent, newname)) {
+		REPLY_ERR(req, EACCES);
+		return;
+	}
+	if (storage_rename_at(INUM(parent), name, INUM(newparent), newname) != 0) {
+		REPLY_ERR(req, EPERM);
+		return;
+	}
+	fuse_reply_err(req, 0);
+	queue_inval(parent, name, -1, 0);
+	queue_inval(newparent, newname, -1, 0);
+}
+
+// Create a hard link
+static void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+		const char *newname) {
+	STATS_TIME(STAT_FUSE_LINK);
+	if (ino == STATS_INO || is_stats(newparent, newname)) {
+		REPLY_ERR(req, EACCES);
+		return;
+	}
+	struct stat st;
+	if (storage_link_at(INUM(ino), INUM(newparent), newname, &st) != 0) {
+		REPLY_ERR(req, EPERM);
+		return;
+	}
+	reply_entry(req, INUM(ino), &st);
+}
+
+// Opens a file, keeping its inode in fi->fh; the stats file gets a
+// snapshot of the stats instead.
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_OPEN);
+	if (ino == STATS_INO) {
+		if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+			REPLY_ERR(req, EACCES);
+			return;
+		}
+		stats_file_t *sf = malloc(sizeof(stats_file_t));
+		if (sf == NULL || (sf->text = stats_render(&sf->len)) == NULL) {
+			free(sf);
+			REPLY_ERR(req, ENOMEM);
+			return;
+		}
+		fi->direct_io = 1;
+		fi->fh = (uintptr_t) sf;
+		if (fuse_reply_open(req, fi) != 0) {
+			free(sf->text);
+			free(sf);
+		}
+		return;
+	}
+	fi->keep_cache = options.keep_cache;
+	if (storage_open_inum(INUM(ino), fi->flags, &fi->fh) != 0) {
+		REPLY_ERR(req, ENOENT);
+		return;
+	}
+	if (fuse_reply_open(req, fi) != 0) {
+		storage_release(fi->fh);
+	}
+}
+
+// Create and open a file
+static void nufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_CREATE);
+	if (is_stats(parent, name)) {
+		REPLY_ERR(req, EEXIST);
+		return;
+	}
+	struct stat st;
+	fi->keep_cache = options.keep_cache;
+	int inum = storage_create_at(INUM(parent), name, mode, fi->flags, &fi->fh, &st);
+	if (inum < 0) {
+		REPLY_ERR(req, EPERM);
+		return;
+	}
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = INO(inum);
+	e.attr = st;
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = ll_options.attr_timeout;
+	e.entry_timeout = ll_options.entry_timeout;
+	if (fuse_reply_create(req, &e, fi) != 0) {
+		storage_release(fi->fh);
+		storage_forget(inum, 1);
+	}
+}
+
+// Read data from a file without copying it: the reply points at the
+// image file, and FUSE splices the pages from there when it can.
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_READ);
+	if (ino == STATS_INO) {
+		stats_file_t *sf = (stats_file_t *) (uintptr_t) fi->fh;
+		if (offset >= sf->len) {
+			size = 0;
+		} else if (size > sf->len - offset) {
+			size = sf->len - offset;
+		}
+		fuse_reply_buf(req, size ? sf->text + offset : NULL, size);
+		return;
+	}
+	storage_run_t *runs;
+	int count = storage_map_fh(fi->fh, size, offset, &runs);
+	if (count < 0) {
+		REPLY_ERR(req, ENOMEM);
+		return;
+	}
+	struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+	if (bv == NULL) {
+		REPLY_ERR(req, ENOMEM);
+	} else {
+		*bv = FUSE_BUFVEC_INIT(0);
+		bv->count = count > 0 ? count : 1;
+		for (int ii = 0; ii < count; ++ii) {
+			struct fuse_buf *buf = &bv->buf[ii];
+			buf->size = runs[ii].len;
+			buf->mem = runs[ii].mem;
+			buf->flags = runs[ii].mem ? 0 : FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			buf->fd = runs[ii].fd;
+			buf->pos = runs[ii].pos;
+		}
+		fuse_reply_data(req, bv, 0);
+		free(bv);
+	}
+	// the reply has been sent, so the blocks may be reused (unlike the
+	// high-level API, the low-level one also leaves the buffers to us)
+	storage_map_done(runs, count);
+}
+
+// Write data to a file
+static void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+		off_t offset, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_WRITE);
+	if (ino == STATS_INO) {
+		REPLY_ERR(req, EACCES);
+		return;
+	}
+	int rv = storage_write_fh(fi->fh, buf, size, offset);
+	if (rv < 0) {
+		REPLY_ERR(req, ENOSPC);
+		return;
+	}
+	fuse_reply_write(req, rv);
+	queue_inval(ino, NULL, -1, 0);
+}
+
+// Copies the next len bytes of a write request into dst, advancing the
+// request's bufvec.
+static int copy_write_buf(void *arg, char *dst, size_t len) {
+	struct fuse_bufvec dst_bv = FUSE_BUFVEC_INIT(len);
+	dst_bv.buf[0].mem = dst;
+	return fuse_buf_copy(&dst_bv, arg, 0) == (ssize_t) len ? 0 : -1;
+}
+
+// Write data to a file straight from the request (or the pipe it was
+// spliced into) to the mapped blocks.
+static void nufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf,
+		off_t offset, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_WRITE_BUF);
+	if (ino == STATS_INO) {
+		REPLY_ERR(req, EACCES);
+		return;
+	}
+	size_t size = fuse_buf_size(buf);
+	int rv = storage_write_from_fh(fi->fh, copy_write_buf, buf, size, offset);
+	if (rv < 0) {
+		REPLY_ERR(req, ENOSPC);
+		return;
+	}
+	fuse_reply_write(req, rv);
+	queue_inval(ino, NULL, -1, 0);
+}
+
+// Called on each close(2) of an open file
+static void nufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_FLUSH);
+	if (ino == STATS_INO) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+	fuse_reply_err(req, storage_flush(fi->fh) == 0 ? 0 : -STATS_RESULT(-EIO));
+}
+
+// Makes an open file's data and metadata durable
+static void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_FSYNC);
+	if (ino == STATS_INO) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+	fuse_reply_err(req, storage_fsync(fi->fh, datasync) == 0 ? 0 : -STATS_RESULT(-EIO));
+}
+
+// Called when the last reference to an open file goes away
+static void nufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_RELEASE);
+	if (ino == STATS_INO) {
+		stats_file_t *sf = (stats_file_t *) (uintptr_t) fi->fh;
+		free(sf->text);
+		free(sf);
+	} else {
+		storage_release(fi->fh);
+	}
+	fuse_reply_err(req, 0);
+}
+
+// A readdir reply being filled: entries go into buf until size is reached.
+typedef struct dir_buf {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+} dir_buf_t;
+
+// Adds an entry to a readdir reply; returns 1 once it is full.
+static int fill_dir_buf(void *arg, const char *name, const struct stat *st, off_t next) {
+	dir_buf_t *db = arg;
+	struct stat entry = *st;
+	entry.st_ino = INO(st->st_ino);
+	size_t len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used, name,
+			&entry, next);
+	if (len > db->size - db->used) {
+		return 1;
+	}
+	db->used += len;
+	return 0;
+}
+
+// Lists the contents of a directory, resuming at offset. Entries are
+// passed straight from the directory blocks into the reply.
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_READDIR);
+	dir_buf_t db = {req, malloc(size), size, 0};
+	if (db.buf == NULL) {
+		REPLY_ERR(req, ENOMEM);
+		return;
+	}
+	if (storage_readdir_inum(INUM(ino), offset, fill_dir_buf, &db) != 0) {
+		REPLY_ERR(req, ENOENT);
+	} else {
+		fuse_reply_buf(req, db.buf, db.used);
+	}
+	free(db.buf);
+}
+
+// Makes a directory's entries durable
+static void nufs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+		struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_FSYNCDIR);
+	int ok = options.durability != DURABILITY_FSYNC || storage_sync() == 0;
+	fuse_reply_err(req, ok ? 0 : -STATS_RESULT(-EIO));
+}
+
+// Reports the size and usage of the file system
+static void nufs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	STATS_TIME(STAT_FUSE_STATFS);
+	struct statvfs st;
+	int rv = storage_statfs(&st);
+	if (rv != 0) {
+		REPLY_ERR(req, -rv);
+		return;
+	}
+	fuse_reply_statfs(req, &st);
+}
+
+// Checks access to a file the kernel already knows exists.
+static void nufs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+	STATS_TIME(STAT_FUSE_ACCESS);
+	if (ino == STATS_INO && (mask & W_OK)) {
+		REPLY_ERR(req, EACCES);
+		return;
+	}
+	fuse_reply_err(req, 0);
+}
+
+// Preallocates blocks for, or punches a hole in, a range of an open file
+static void nufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+		off_t len, struct fuse_file_info *fi) {
+	STATS_TIME(STAT_FUSE_FALLOCATE);
+	if (ino == STATS_INO) {
+		REPLY_ERR(req, EACCES);
+		return;
+	}
+	int rv;
+	if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+		rv = storage_punch_hole(fi->fh, offset, len);
+	} else if ((mode & ~FALLOC_FL_KEEP_SIZE) == 0) {
+		rv = storage_fallocate(fi->fh, offset, len, mode & FALLOC_FL_KEEP_SIZE);
+	} else {
+		REPLY_ERR(req, EOPNOTSUPP);
+		return;
+	}
+	if (rv != 0) {
+		REPLY_ERR(req, -rv);
+		return;
+	}
+	fuse_reply_err(req, 0);
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		queue_inval(ino, NULL, offset, len);
+	} else {
+		queue_inval(ino, NULL, -1, 0);
+	}
+}
+
+// Extended operations. NUFS_IOC_STAT reads one metric of the stats
+// (stats.h); it works on any open file.
+static void nufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+		struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz,
+		size_t out_bufsz) {
+	STATS_TIME(STAT_FUSE_IOCTL);
+	if ((unsigned int) cmd != NUFS_IOC_STAT) {
+		REPLY_ERR(req, ENOTTY);
+		return;
+	}
+	nufs_stat_t stat;
+	if (in_bufsz < sizeof(stat) || out_bufsz < sizeof(stat)) {
+		REPLY_ERR(req, EINVAL);
+		return;
+	}
+	memcpy(&stat, in_buf, sizeof(stat));
+	if (stats_read(stat.index, &stat) != 0) {
+		REPLY_ERR(req, EINVAL);
+		return;
+	}
+	fuse_reply_ioctl(req, 0, &stat, sizeof(stat));
+}
+
+// Runs in the process serving the mount, once it is up.
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	storage_set_durability(options.durability, options.flush_interval);
+	// let writes arrive in a pipe, and reads go out of the image file,
+	// by splice (see nufs.c)
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+	if (options.keep_cache) {
+		inval_running = 1;
+		if (pthread_create(&inval_thread, NULL, inval_main, NULL) != 0) {
+			inval_running = 0;
+		}
+	}
+}
+
+// Commits outstanding changes when the file system is unmounted.
+static void nufs_ll_destroy(void *userdata) {
+	if (inval_running) {
+		pthread_mutex_lock(&inval_lock);
+		inval_running = 0;
+		pthread_cond_signal(&inval_ready);
+		pthread_mutex_unlock(&inval_lock);
+		pthread_join(inval_thread, NULL);
+	}
+	storage_destroy();
+}
+
+static void nufs_ll_init_ops(struct fuse_lowlevel_ops *ops) {
+	memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+	ops->init = nufs_ll_init;
+	ops->destroy = nufs_ll_destroy;
+	ops->lookup = nufs_ll_lookup;
+	ops->forget = nufs_ll_forget;
+	ops->getattr = nufs_ll_getattr;
+	ops->setattr = nufs_ll_setattr;
+	ops->mknod = nufs_ll_mknod;
+	ops->mkdir = nufs_ll_mkdir;
+	ops->unlink = nufs_ll_unlink;
+	ops->rename = nufs_ll_rename;
+	ops->link = nufs_ll_link;
+	ops->open = nufs_ll_open;
+	ops->create = nufs_ll_create;
+	ops->read = nufs_ll_read;
+	ops->write = nufs_ll_write;
+	ops->write_buf = nufs_ll_write_buf;
+	ops->flush = nufs_ll_flush;
+	ops->fsync = nufs_ll_fsync;
+	ops->release = nufs_ll_release;
+	ops->readdir = nufs_ll_readdir;
+	ops->fsyncdir = nufs_ll_fsyncdir;
+	ops->statfs = nufs_ll_statfs;
+	ops->access = nufs_ll_access;
+	ops->fallocate = nufs_ll_fallocate;
+	ops->ioctl = nufs_ll_ioctl;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3) {
+		printf("Usage: %s [FUSE options] <mount point> <filesystem data file>\n", argv[0]);
+		return 1;
+	}
+	// the data file comes last, after the FUSE arguments
+	char *fs_data_file = argv[argc - 1];
+	argc--;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (mount_options_parse(&args, &options) != 0
+			|| fuse_opt_parse(&args, &ll_options, ll_opts, NULL) == -1) {
+		return 1;
+	}
+	char *mountpoint;
+	int multithreaded;
+	int foreground;
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) {
+		return 1;
+	}
+	if (storage_init(fs_data_file) != 0) {
+		return 1;
+	}
+	struct fuse_lowlevel_ops ops;
+	nufs_ll_init_ops(&ops);
+
+	int rv = -1;
+	struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+	chan = ch;
+	if (ch != NULL) {
+		struct fuse_session *se = fuse_lowlevel_new(&args, &ops, sizeof(ops), NULL);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) == 0) {
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				rv = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			// calls destroy, which commits and closes the image
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return rv == 0 ? 0 : 1;
+}
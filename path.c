@@ -0,0 +1,20 @@
+#include "path.h"
+
+// Gets the next component of a path, advancing the cursor past it.
+int path_next(const char **cursor, path_name_t *comp) {
+    const char *pos = *cursor;
+    while (*pos == '/') {
+        pos++;
+    }
+    if (*pos == '\0') {
+        *cursor = pos;
+        return 0;
+    }
+    comp->name = pos;
+    while (*pos != '/' && *pos != '\0') {
+        pos++;
+    }
+    comp->len = pos - comp->name;
+    *cursor = pos;
+    return 1;
+}
@@ -0,0 +1,29 @@
+/**
+ * @file path.h
+ *
+ * Zero-copy path tokenizer.
+ *
+ * Components are returned as (pointer, length) views into the original
+ * path string, so walking a path neither allocates nor copies.
+ */
+#ifndef PATH_H
+#define PATH_H
+
+typedef struct path_name {
+  const char *name; // start of the component within the path
+  int len;          // length of the component (not NUL-terminated)
+} path_name_t;
+
+/**
+ * Get the next component of a path.
+ *
+ * Leading, trailing and repeated slashes are skipped.
+ *
+ * @param cursor Position in the path; advanced past the component.
+ * @param comp Set to the component found.
+ *
+ * @return 1 if a component was found, 0 at the end of the path.
+ */
+int path_next(const char **cursor, path_name_t *comp);
+
+#endif
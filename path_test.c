@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+#include "path.h"
+
+void print_components(const char *path) {
+  const char *cursor = path;
+  path_name_t comp;
+
+  printf("\"%s\":", path);
+  while (path_next(&cursor, &comp)) {
+    printf(" [%.*s]", comp.len, comp.name);
+  }
+  putchar('\n');
+}
+
+int main(int argc, char **argv) {
+  print_components("/");
+  print_components("/one");
+  print_components("/one/two/three");
+  print_components("//doubled//slashes/");
+  print_components("relative/path");
+  return 0;
+}
@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define STATS_METRIC_NAME(id, name, unit) {name, unit},
+static const struct {
+    const char *name;
+    const char *unit;
+} metric_info[] = {STATS_METRICS(STATS_METRIC_NAME)};
+#undef STATS_METRIC_NAME
+
+typedef struct stats_counter {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_counter_t;
+
+// The counters of one thread. Only the owner writes them, with plain
+// loads and stores, so recording takes no lock and no atomic
+// read-modify-write. A shard outlives its thread: it is handed to the next
+// thread that needs one, counts and all.
+typedef struct stats_shard {
+    int owned; // a thread is using the shard
+    stats_counter_t metrics[STAT_COUNT];
+} __attribute__((aligned(64))) stats_shard_t;
+
+static stats_shard_t shards[STATS_SHARDS];
+// shared by the threads that found no free shard, updated atomically
+static stats_shard_t overflow;
+
+// counts copied in from elsewhere, and the function copying them
+static uint64_t set_counts[STAT_COUNT];
+static void (*stats_source)();
+
+static __thread stats_shard_t *my_shard = 0;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+
+// hands a thread's shard back when the thread exits
+static void shard_release(void *shard) {
+    __atomic_store_n(&((stats_shard_t *)shard)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void shard_key_init() {
+    pthread_key_create(&shard_key, shard_release);
+}
+
+// claims a free shard for the calling thread, or the overflow shard
+static stats_shard_t *claim_shard() {
+    pthread_once(&shard_once, shard_key_init);
+    for (int ii = 0; ii < STATS_SHARDS; ++ii) {
+        int unowned = 0;
+        if (__atomic_compare_exchange_n(&shards[ii].owned, &unowned, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            pthread_setspecific(shard_key, &shards[ii]);
+            return my_shard = &shards[ii];
+        }
+    }
+    return my_shard = &overflow;
+}
+
+// adds to a counter of the calling thread's shard
+static void counter_add(stats_shard_t *shard, uint64_t *counter, uint64_t value) {
+    if (shard == &overflow) {
+        __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+// Read the monotonic clock.
+uint64_t stats_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// the histogram bucket of a value
+static int bucket_of(uint64_t value) {
+    int bucket = value ? 64 - __builtin_clzll(value) : 0;
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// Record a value into a metric.
+void stats_record(int metric, uint64_t value) {
+    stats_shard_t *shard = my_shard ? my_shard : claim_shard();
+    stats_counter_t *ctr = &shard->metrics[metric];
+    counter_add(shard, &ctr->count, 1);
+    counter_add(shard, &ctr->sum, value);
+    counter_add(shard, &ctr->buckets[bucket_of(value)], 1);
+}
+
+// Count a failed operation against a metric.
+void stats_error(int metric) {
+    stats_shard_t *shard = my_shard ? my_shard : claim_shard();
+    counter_add(shard, &shard->metrics[metric].errors, 1);
+}
+
+// adds one shard's counters of a metric into stat
+static void sum_shard(stats_shard_t *shard, int metric, nufs_stat_t *stat) {
+    stats_counter_t *ctr = &shard->metrics[metric];
+    stat->count += __atomic_load_n(&ctr->count, __ATOMIC_RELAXED);
+    stat->errors += __atomic_load_n(&ctr->errors, __ATOMIC_RELAXED);
+    stat->sum += __atomic_load_n(&ctr->sum, __ATOMIC_RELAXED);
+    for (int bb = 0; bb < STATS_BUCKETS; ++bb) {
+        stat->buckets[bb] += __atomic_load_n(&ctr->buckets[bb], __ATOMIC_RELAXED);
+    }
+}
+
+// Set the count of a metric that is kept elsewhere.
+void stats_set_count(int metric, uint64_t count) {
+    __atomic_store_n(&set_counts[metric], count, __ATOMIC_RELAXED);
+}
+
+// Set the function that refreshes the copied-in counts.
+void stats_set_source(void (*source)()) {
+    __atomic_store_n(&stats_source, source, __ATOMIC_RELEASE);
+}
+
+// calls the stats source, if there is one
+static void refresh() {
+    void (*source)() = __atomic_load_n(&stats_source, __ATOMIC_ACQUIRE);
+    if (source != NULL) {
+        source();
+    }
+}
+
+// sums the shards of one metric, without refreshing
+static void read_metric(int metric, nufs_stat_t *stat) {
+    memset(stat, 0, sizeof(nufs_stat_t));
+    stat->index = metric;
+    strncpy(stat->name, metric_info[metric].name, sizeof(stat->name) - 1);
+    strncpy(stat->unit, metric_info[metric].unit, sizeof(stat->unit) - 1);
+    // shards that were never claimed are all zeros
+    for (int ii = 0; ii < STATS_SHARDS; ++ii) {
+        sum_shard(&shards[ii], metric, stat);
+    }
+    sum_shard(&overflow, metric, stat);
+    stat->count += __atomic_load_n(&set_counts[metric], __ATOMIC_RELAXED);
+}
+
+// Sum the shards of one metric.
+int stats_read(int metric, nufs_stat_t *stat) {
+    if (metric < 0 || metric >= STAT_COUNT) {
+        return -1;
+    }
+    refresh();
+    read_metric(metric, stat);
+    return 0;
+}
+
+// Render the totals of every metric as text.
+char *stats_render(size_t *len) {
+    // a metric line is at most the names plus (3 + STATS_BUCKETS) numbers
+    size_t cap = 128 + (size_t)STAT_COUNT * (48 + (3 + STATS_BUCKETS) * 21);
+    char *text = malloc(cap);
+    if (text == NULL) {
+        return NULL;
+    }
+    size_t pos = snprintf(text, cap, "# name unit count errors sum buckets[%d] (log2)\n",
+                          STATS_BUCKETS);
+    refresh();
+    for (int mm = 0; mm < STAT_COUNT; ++mm) {
+        nufs_stat_t stat;
+        read_metric(mm, &stat);
+        pos += snprintf(text + pos, cap - pos, "%s %s %llu %llu %llu", stat.name, stat.unit,
+                        (unsigned long long)stat.count, (unsigned long long)stat.errors,
+                        (unsigned long long)stat.sum);
+        for (int bb = 0; bb < STATS_BUCKETS; ++bb) {
+            pos += snprintf(text + pos, cap - pos, " %llu",
+                            (unsigned long long)stat.buckets[bb]);
+        }
+        pos += snprintf(text + pos, cap - pos, "\n");
+    }
+    *len = pos;
+    return text;
+}
+
+// Ends a STATS_TIME scope.
+void stats_timer_end(stats_timer_t *timer) {
+    stats_record(timer->metric, stats_now() - timer->start);
+}
+
+// Counts an error against a STATS_TIME scope if rv is negative.
+int stats_timer_result(stats_timer_t *timer, int rv) {
+    if (rv < 0) {
+        stats_error(timer->metric);
+    }
+    return rv;
+}
@@ -0,0 +1,204 @@
+/**
+ * @file stats.h
+ *
+ * Operation counters and latency histograms.
+ *
+ * Every metric keeps a count, a sum and a histogram of the values recorded
+ * into it: latencies in nanoseconds, sizes in bytes, or scan lengths.  The
+ * histogram has log2 buckets: bucket 0 counts zeros, bucket i counts values
+ * in [2^(i-1), 2^i), and the last bucket also counts everything larger.
+ *
+ * Each thread updates its own shard of the counters, so recording never
+ * contends with other threads; reading sums the shards.  The totals are
+ * readable as text from the virtual file /.nufs_stats at the root of the
+ * mount, and one metric at a time through the NUFS_IOC_STAT ioctl.
+ * Counters kept by other modules, such as the dentry cache's, are copied
+ * in as counts by the stats source just before they are read.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define STATS_BUCKETS 32 // histogram buckets per metric
+#define STATS_SHARDS 64  // threads with a shard of their own at once
+
+// the metrics: id, name, unit of the recorded values
+#define STATS_METRICS(X)                                                       \
+  X(STAT_FUSE_LOOKUP, "fuse.lookup", "ns")                                     \
+  X(STAT_FUSE_FORGET, "fuse.forget", "ns")                                     \
+  X(STAT_FUSE_ACCESS, "fuse.access", "ns")                                     \
+  X(STAT_FUSE_GETATTR, "fuse.getattr", "ns")                                   \
+  X(STAT_FUSE_READDIR, "fuse.readdir", "ns")                                   \
+  X(STAT_FUSE_MKNOD, "fuse.mknod", "ns")                                       \
+  X(STAT_FUSE_MKDIR, "fuse.mkdir", "ns")                                       \
+  X(STAT_FUSE_UNLINK, "fuse.unlink", "ns")                                     \
+  X(STAT_FUSE_LINK, "fuse.link", "ns")                                         \
+  X(STAT_FUSE_RMDIR, "fuse.rmdir", "ns")                                       \
+  X(STAT_FUSE_RENAME, "fuse.rename", "ns")                                     \
+  X(STAT_FUSE_CHMOD, "fuse.chmod", "ns")                                       \
+  X(STAT_FUSE_SETATTR, "fuse.setattr", "ns")                                   \
+  X(STAT_FUSE_TRUNCATE, "fuse.truncate", "ns")                                 \
+  X(STAT_FUSE_FTRUNCATE, "fuse.ftruncate", "ns")                               \
+  X(STAT_FUSE_FGETATTR, "fuse.fgetattr", "ns")                                 \
+  X(STAT_FUSE_OPEN, "fuse.open", "ns")                                         \
+  X(STAT_FUSE_CREATE, "fuse.create", "ns")                                     \
+  X(STAT_FUSE_READ, "fuse.read", "ns")                                         \
+  X(STAT_FUSE_WRITE, "fuse.write", "ns")                                       \
+  X(STAT_FUSE_READ_BUF, "fuse.read_buf", "ns")                                 \
+  X(STAT_FUSE_WRITE_BUF, "fuse.write_buf", "ns")                               \
+  X(STAT_FUSE_FLUSH, "fuse.flush", "ns")                                       \
+  X(STAT_FUSE_FSYNC, "fuse.fsync", "ns")                                       \
+  X(STAT_FUSE_FSYNCDIR, "fuse.fsyncdir", "ns")                                 \
+  X(STAT_FUSE_STATFS, "fuse.statfs", "ns")                                     \
+  X(STAT_FUSE_RELEASE, "fuse.release", "ns")                                   \
+  X(STAT_FUSE_UTIMENS, "fuse.utimens", "ns")                                   \
+  X(STAT_FUSE_IOCTL, "fuse.ioctl", "ns")                                       \
+  X(STAT_FUSE_FALLOCATE, "fuse.fallocate", "ns")                               \
+  X(STAT_FUSE_NOTIFY, "fuse.notify", "ns")                                     \
+  X(STAT_STORAGE_LOOKUP, "storage.lookup", "ns")                               \
+  X(STAT_STORAGE_FORGET, "storage.forget", "ns")                               \
+  X(STAT_STORAGE_STAT, "storage.stat", "ns")                                   \
+  X(STAT_STORAGE_READ, "storage.read", "ns")                                   \
+  X(STAT_STORAGE_WRITE, "storage.write", "ns")                                 \
+  X(STAT_STORAGE_TRUNCATE, "storage.truncate", "ns")                           \
+  X(STAT_STORAGE_MKNOD, "storage.mknod", "ns")                                 \
+  X(STAT_STORAGE_UNLINK, "storage.unlink", "ns")                               \
+  X(STAT_STORAGE_LINK, "storage.link", "ns")                                   \
+  X(STAT_STORAGE_RENAME, "storage.rename", "ns")                               \
+  X(STAT_STORAGE_SET_TIME, "storage.set_time", "ns")                           \
+  X(STAT_STORAGE_READDIR, "storage.readdir", "ns")                             \
+  X(STAT_STORAGE_OPEN, "storage.open", "ns")                                   \
+  X(STAT_STORAGE_CREATE, "storage.create", "ns")                               \
+  X(STAT_STORAGE_FSTAT, "storage.fstat", "ns")                                 \
+  X(STAT_STORAGE_READ_FH, "storage.read_fh", "ns")                             \
+  X(STAT_STORAGE_WRITE_FH, "storage.write_fh", "ns")                           \
+  X(STAT_STORAGE_MAP_FH, "storage.map_fh", "ns")                               \
+  X(STAT_STORAGE_WRITE_FROM_FH, "storage.write_from_fh", "ns")                 \
+  X(STAT_STORAGE_FTRUNCATE, "storage.ftruncate", "ns")                         \
+  X(STAT_STORAGE_FALLOCATE, "storage.fallocate", "ns")                         \
+  X(STAT_STORAGE_PUNCH_HOLE, "storage.punch_hole", "ns")                       \
+  X(STAT_STORAGE_FLUSH, "storage.flush", "ns")                                 \
+  X(STAT_STORAGE_FSYNC, "storage.fsync", "ns")                                 \
+  X(STAT_STORAGE_RELEASE, "storage.release", "ns")                             \
+  X(STAT_STORAGE_SYNC, "storage.sync", "ns")                                   \
+  X(STAT_STORAGE_STATFS, "storage.statfs", "ns")                               \
+  X(STAT_PATH_LOOKUP, "path.lookup", "ns")                                     \
+  X(STAT_ALLOC_BLOCK_SCAN, "alloc.block_scan", "groups")                       \
+  X(STAT_ALLOC_INODE_SCAN, "alloc.inode_scan", "groups")                       \
+  X(STAT_IO_READ, "io.read", "bytes")                                          \
+  X(STAT_IO_WRITE, "io.write", "bytes")                                        \
+  X(STAT_JOURNAL_COMMIT, "journal.commit", "ns")                               \
+  X(STAT_JOURNAL_BLOCKS, "journal.blocks", "blocks")                           \
+  X(STAT_DCACHE_HITS, "dcache.hits", "lookups")                                \
+  X(STAT_DCACHE_MISSES, "dcache.misses", "lookups")                            \
+  X(STAT_DCACHE_NEGATIVE_HITS, "dcache.negative_hits", "lookups")
+
+#define STATS_METRIC_ID(id, name, unit) id,
+enum stats_metric { STATS_METRICS(STATS_METRIC_ID) STAT_COUNT };
+#undef STATS_METRIC_ID
+
+/**
+ * The totals of one metric, as returned by NUFS_IOC_STAT.
+ */
+typedef struct nufs_stat {
+  int32_t index; // in: the metric to read, from 0 up to the first EINVAL
+  char name[28];
+  char unit[8];
+  uint64_t count;  // values recorded
+  uint64_t errors; // operations that failed
+  uint64_t sum;    // sum of the values
+  uint64_t buckets[STATS_BUCKETS];
+} nufs_stat_t;
+
+#define NUFS_IOC_STAT _IOWR('N', 1, nufs_stat_t)
+
+/**
+ * Read the monotonic clock.
+ *
+ * @return Nanoseconds since an arbitrary point.
+ */
+uint64_t stats_now();
+
+/**
+ * Record a value into a metric.
+ *
+ * @param metric The metric.
+ * @param value The value (a latency, size or scan length).
+ */
+void stats_record(int metric, uint64_t value);
+
+/**
+ * Count a failed operation against a metric.
+ *
+ * @param metric The metric.
+ */
+void stats_error(int metric);
+
+/**
+ * Set the count of a metric that is kept elsewhere and copied in by the
+ * stats source; it is added to what the shards hold.
+ *
+ * @param metric The metric.
+ * @param count Its current count.
+ */
+void stats_set_count(int metric, uint64_t count);
+
+/**
+ * Set the function that refreshes the copied-in counts (stats_set_count)
+ * before the metrics are read or rendered.
+ *
+ * @param source The function, or NULL for none.
+ */
+void stats_set_source(void (*source)());
+
+/**
+ * Sum the shards of one metric.
+ *
+ * @param metric The metric.
+ * @param stat Filled in with its name, unit and totals.
+ *
+ * @return 0 on success, -1 if there is no such metric.
+ */
+int stats_read(int metric, nufs_stat_t *stat);
+
+/**
+ * Render the totals of every metric as text, one line per metric:
+ *
+ *     name unit count errors sum bucket0 ... bucket31
+ *
+ * preceded by a comment line starting with '#'.
+ *
+ * @param len Set to the length of the text.
+ *
+ * @return The text (NUL-terminated), to be freed by the caller, or NULL if
+ *         out of memory.
+ */
+char *stats_render(size_t *len);
+
+// times the enclosing scope into a metric (see STATS_TIME)
+typedef struct stats_timer {
+  int metric;
+  uint64_t start;
+} stats_timer_t;
+
+void stats_timer_end(stats_timer_t *timer);
+int stats_timer_result(stats_timer_t *timer, int rv);
+
+/**
+ * Record the time from here to the end of the enclosing scope into a
+ * metric, however the scope is left.
+ */
+#define STATS_TIME(metric)                                                     \
+  stats_timer_t stats_timer_ __attribute__((cleanup(stats_timer_end))) = {     \
+      (metric), stats_now()}
+
+/**
+ * Evaluate to rv, counting an error against the STATS_TIME metric of the
+ * enclosing scope if rv is negative.
+ */
+#define STATS_RESULT(rv) stats_timer_result(&stats_timer_, (rv))
+
+#endif
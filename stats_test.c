@@ -0,0 +1,73 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "stats.h"
+
+#define THREADS 8
+#define RECORDS 100000
+
+void *record_values(void *arg) {
+  for (int i = 0; i < RECORDS; i++) {
+    stats_record(STAT_IO_WRITE, i % 4096);
+  }
+  stats_error(STAT_IO_WRITE);
+  return NULL;
+}
+
+void print_stat(int metric) {
+  nufs_stat_t stat;
+  stats_read(metric, &stat);
+  printf("%s (%s): count %llu, errors %llu, sum %llu\n", stat.name, stat.unit,
+         (unsigned long long) stat.count, (unsigned long long) stat.errors,
+         (unsigned long long) stat.sum);
+  for (int b = 0; b < STATS_BUCKETS; b++) {
+    if (stat.buckets[b]) {
+      printf("  bucket %2d: %llu\n", b, (unsigned long long) stat.buckets[b]);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, record_values, NULL);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  print_stat(STAT_IO_WRITE);
+
+  {
+    STATS_TIME(STAT_PATH_LOOKUP);
+  }
+  print_stat(STAT_PATH_LOOKUP);
+
+  // the dentry cache's counters are copied in when the stats are read
+  stats_set_source(dcache_report_stats);
+  int inum;
+  dcache_insert(1, "there", 5, 7);
+  dcache_insert(1, "gone", 4, -1);
+  dcache_lookup(1, "there", 5, &inum);
+  dcache_lookup(1, "there", 5, &inum);
+  dcache_lookup(1, "gone", 4, &inum);
+  dcache_lookup(1, "unknown", 7, &inum);
+  nufs_stat_t hits, misses, negative;
+  stats_read(STAT_DCACHE_HITS, &hits);
+  stats_read(STAT_DCACHE_MISSES, &misses);
+  stats_read(STAT_DCACHE_NEGATIVE_HITS, &negative);
+  printf("%s %llu, %s %llu, %s %llu\n", hits.name, (unsigned long long) hits.count,
+         misses.name, (unsigned long long) misses.count, negative.name,
+         (unsigned long long) negative.count);
+  int failed = hits.count != 3 || misses.count != 1 || negative.count != 1;
+
+  size_t len;
+  char *text = stats_render(&len);
+  printf("Rendered %zu bytes, first line: %.*s", len, (int) (strchr(text, '\n') - text + 1), text);
+  failed |= strstr(text, "\ndcache.hits lookups 3 ") == NULL;
+  free(text);
+  printf("%s\n", failed ? "FAILED" : "All checks passed");
+  return failed;
+}
@@ -1,230 +1,752 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include "storage.h"
 #include "inode.h"
+#include "journal.h"
+#include "dcache.h"
 #include "directory.h"
 #include "blocks.h"
-#include "util.h"
-
-// functions from inode
-int inode_path_lookup(const char *path);
-void read_from_file(int inode, char *buf, size_t size, off_t offset);
-void write_to_file(int inode, const char *buf, size_t size, off_t offset);
+#include "path.h"
+#include "stats.h"
 
 // Initialize the storage system.
-void storage_init(const char *path) {
+int storage_init(const char *path) {
     // Initialize the blocks system with the disk image file path
-    	blocks_init(path);
-    // Additional initialization steps can be added here if needed.
-    // For example, initializing inodes or directories if required.
+    if (blocks_init(path) != 0) {
+        return -1;
+    }
+    // Set up the inodes; a freshly formatted image also gets its root.
+    inodes_init();
+    stats_set_source(dcache_report_stats);
+    return 0;
 }
 
-// Retrieve file or directory metadata.
-int storage_stat(const char *path, struct stat *st) {
-    // Find the inode number for the given path.
-    int inum = inode_path_lookup(path);
-    if (inum < 0) {
-        return -1; // Path not found.
+static durability_t durability = DURABILITY_FSYNC;
+static int flush_interval = 0; // milliseconds, for DURABILITY_PERIODIC
+static pthread_t flusher;
+static int flusher_running = 0;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_stop = PTHREAD_COND_INITIALIZER;
+
+// Flush all written data, then commit the metadata that refers to it.
+int storage_sync() {
+    STATS_TIME(STAT_STORAGE_SYNC);
+    int rv = blocks_sync_data(0, BLOCK_COUNT, 1);
+    return journal_commit() | rv;
+}
+
+// flushes everything every flush_interval until storage_destroy()
+static void *flusher_main(void *arg) {
+    pthread_mutex_lock(&flusher_lock);
+    while (flusher_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += flush_interval / 1000;
+        deadline.tv_nsec += (long)(flush_interval % 1000) * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        if (pthread_cond_timedwait(&flusher_stop, &flusher_lock, &deadline) == 0) {
+            continue; // woken to stop
+        }
+        pthread_mutex_unlock(&flusher_lock);
+        storage_sync();
+        pthread_mutex_lock(&flusher_lock);
     }
-    // Get the inode using the inode number.
-    inode_t *inode = get_inode(inum);
-    if (!inode) {
-        return -1; // Inode not found.
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+// Choose when data and metadata are flushed. Starts the background
+// flusher for DURABILITY_PERIODIC, so call it from the process that
+// serves the mount.
+void storage_set_durability(durability_t mode, int interval_ms) {
+    durability = mode;
+    flush_interval = interval_ms;
+    switch (mode) {
+    case DURABILITY_FSYNC:
+        journal_configure(0, 1);
+        break;
+    case DURABILITY_PERIODIC:
+        journal_configure(interval_ms, 1);
+        if (!flusher_running && interval_ms > 0) {
+            flusher_running = 1;
+            if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+                flusher_running = 0;
+            }
+        }
+        break;
+    case DURABILITY_NONE:
+        journal_configure(0, 0);
+        break;
+    }
+}
+
+// Commit outstanding changes and close the storage system.
+void storage_destroy() {
+    stats_set_source(NULL);
+    if (flusher_running) {
+        pthread_mutex_lock(&flusher_lock);
+        flusher_running = 0;
+        pthread_cond_signal(&flusher_stop);
+        pthread_mutex_unlock(&flusher_lock);
+        pthread_join(flusher, NULL);
     }
+    if (durability != DURABILITY_NONE) {
+        blocks_sync_data(0, BLOCK_COUNT, 1);
+    }
+    blocks_free();
+}
+
+// Report the size and usage of the file system.
+int storage_statfs(struct statvfs *st) {
+    STATS_TIME(STAT_STORAGE_STATFS);
+    superblock_t *sb = blocks_superblock();
+    int free_blocks, free_inodes;
+    blocks_usage(&free_blocks, &free_inodes);
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = sb->block_count - sb->data_start;
+    st->f_bfree = free_blocks;
+    st->f_bavail = free_blocks;
+    st->f_files = sb->inode_count;
+    st->f_ffree = free_inodes;
+    st->f_favail = free_inodes;
+    st->f_namemax = DIR_NAME_LENGTH - 1;
+    return 0;
+}
+
+// An open file: the inode resolved at open time, kept pinned until release.
+typedef struct open_file {
+    int inum;   // the open inode
+    int flags;  // open(2) flags
+    off_t next; // offset just past the last read or write
+    int streak; // consecutive requests that continued at next
+} open_file_t;
+
+static int mknod_inode(const char *path, int mode);
+
+// Get the open file behind a handle.
+static open_file_t *open_file(uint64_t fh) {
+    return (open_file_t *)(uintptr_t)fh;
+}
+
+// Track whether a handle is being accessed sequentially. Concurrent
+// requests on one handle may race here; the result is only a hint.
+static void note_access(open_file_t *of, off_t offset, size_t size) {
+    off_t next = __atomic_load_n(&of->next, __ATOMIC_RELAXED);
+    int streak = __atomic_load_n(&of->streak, __ATOMIC_RELAXED);
+    __atomic_store_n(&of->streak, offset == next ? streak + 1 : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&of->next, offset + size, __ATOMIC_RELAXED);
+}
+
+// Fill in stat data for an inode.
+static int stat_inode(int inum, struct stat *st) {
+    inode_t *inode = get_inode(inum);
     // Populate the stat structure with inode data.
+    memset(st, 0, sizeof(struct stat));
+    inode_lock_shared(inum);
+    st->st_ino = inum;
     st->st_mode = inode->mode;
     st->st_nlink = inode->refs;
     st->st_size = inode->size;
+    // holes take no space, so this can be less than st_size
+    st->st_blocks = (blkcnt_t)inode_stored_blocks(inode) * (BLOCK_SIZE / 512);
     st->st_uid = getuid();  // Assuming the file belongs to the current user.
     st->st_gid = getgid();  // Assuming the file belongs to the current user's group.
     // Other stat fields can be set here if needed.
+    inode_unlock(inum);
     return 0; // Success.
 }
 
-// Read data from a file.
-int storage_read(const char *path, char *buf, size_t size, off_t offset) {
-    // Find the inode for the given path.
-    int inum = inode_path_lookup(path);
-    if (inum < 0) {
-        return -1; // File not found.
-    }
+// Read data from an inode.
+static int read_inode(int inum, char *buf, size_t size, off_t offset) {
     inode_t *inode = get_inode(inum);
-    if (!inode) {
-        return -1; // Inode not found.
+    inode_lock_shared(inum);
+    // Nothing to read at or past the end of the file.
+    if (offset >= inode->size) {
+        inode_unlock(inum);
+        return 0;
     }
     // Adjust size if it exceeds the file size from the offset.
     if (offset + size > inode->size) {
         size = inode->size - offset;
     }
     // Read data into buffer.
-    read_from_file(inum, buf, size, offset);
-    return size; // Number of bytes read.
+    int rv = read_from_file(inode, buf, size, offset);
+    inode_unlock(inum);
+    stats_record(STAT_IO_READ, rv > 0 ? rv : 0);
+    return rv; // Number of bytes read.
 }
 
-// Write data to a file.
-int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
-    // Find the inode for the given path.
-    int inum = inode_path_lookup(path);
-    if (inum < 0) {
-        return -1; // File not found.
-    }
+// Write data to an inode, from buf, or else pulled from source.
+static int write_inode(int inum, const char *buf, storage_source_t source, void *arg,
+                       size_t size, off_t offset) {
     inode_t *inode = get_inode(inum);
-    if (!inode) {
-        return -1; // Inode not found.
+    // Sizes are ints on disk.
+    if (offset < 0 || offset + size > INT_MAX) {
+        return -1;
     }
+    journal_begin();
+    inode_lock(inum);
     // Ensure the inode is large enough to accommodate the write.
+    int old_size = inode->size;
+    int rv = 0;
     if (offset + size > inode->size) {
         int grow_size = offset + size - inode->size;
-        if (grow_inode(inode, grow_size) < 0) {
-            return -1; // Failed to grow inode.
-        }
+        rv = grow_inode(inode, grow_size);
     }
     // Write data from buffer to file.
-    write_to_file(inum, buf, size, offset);
-    return size; // Number of bytes written.
+    if (rv >= 0) {
+        rv = buf != NULL ? write_to_file(inode, buf, size, offset)
+                         : write_to_file_from(inode, source, arg, size, offset);
+    }
+    // A failed or short write (e.g. out of space) only extends the file
+    // as far as it got.
+    off_t end = rv > 0 ? offset + rv : 0;
+    if (inode->size > old_size && inode->size > end) {
+        shrink_inode(inode, inode->size - (end > old_size ? end : old_size));
+    }
+    inode_unlock(inum);
+    journal_end();
+    stats_record(STAT_IO_WRITE, rv > 0 ? rv : 0);
+    return rv; // Number of bytes written, or -1 if the inode could not grow.
 }
 
-// Truncate or extend a file to a specified length.
-int storage_truncate(const char *path, off_t size) {
-    // Find the inode for the given path.
-    int inum = inode_path_lookup(path);
-    if (inum < 0) {
-        return -1; // File not found.
+// Map the data of a read from an inode onto the image file. Returns the
+// number of runs, or -1 if out of memory. Unless it fails, the blocks stay
+// put until storage_map_done().
+static int map_inode(int inum, size_t size, off_t offset, storage_run_t **runs) {
+    inode_t *inode = get_inode(inum);
+    journal_read_begin();
+    inode_lock_shared(inum);
+    if (offset >= inode->size) {
+        size = 0;
+    } else if (offset + size > inode->size) {
+        size = inode->size - offset;
+    }
+    int max = size / BLOCK_SIZE + 2;
+    file_run_t *map = malloc(max * sizeof(file_run_t));
+    storage_run_t *out = calloc(max, sizeof(storage_run_t));
+    int count = map != NULL && out != NULL ? 0 : -1;
+    if (count == 0 && size > 0 && (inode->flags & INODE_INLINE)) {
+        // inline data lives in the inode table, so it is copied out
+        out[0].mem = malloc(size);
+        out[0].len = out[0].mem ? read_from_file(inode, out[0].mem, size, offset) : 0;
+        count = out[0].mem ? 1 : -1;
+    } else if (count == 0 && size > 0) {
+        count = inode_map_data(inode, size, offset, map);
+        for (int ii = 0; ii < count; ++ii) {
+            out[ii].fd = blocks_data_fd();
+            out[ii].pos = map[ii].pos;
+            out[ii].len = map[ii].len;
+            // holes are not in the image file either
+            if (map[ii].pos < 0 && (out[ii].mem = calloc(1, map[ii].len)) == NULL) {
+                count = -1;
+            }
+        }
     }
+    inode_unlock(inum);
+    free(map);
+    if (count < 0) {
+        for (int ii = 0; out != NULL && ii < max; ++ii) {
+            free(out[ii].mem);
+        }
+        free(out);
+        out = NULL;
+        journal_read_end();
+    }
+    *runs = out;
+    return count;
+}
+
+// Truncate or extend an inode to a specified length.
+static int truncate_inode(int inum, off_t size) {
     inode_t *inode = get_inode(inum);
-    if (!inode) {
-        return -1; // Inode not found.
+    int rv = 0;
+    // Sizes are ints on disk.
+    if (size < 0 || size > INT_MAX) {
+        return -1;
     }
+    journal_begin();
+    inode_lock(inum);
     // Adjust the file size.
     if (size > inode->size) {
         // Extend the file.
         int grow_size = size - inode->size;
         if (grow_inode(inode, grow_size) < 0) {
-            return -1; // Failed to grow inode.
+            rv = -1; // Failed to grow inode.
         }
     } else if (size < inode->size) {
         // Truncate the file.
         int shrink_size = inode->size - size;
         if (shrink_inode(inode, shrink_size) < 0) {
-            return -1; // Failed to shrink inode.
+            rv = -1; // Failed to shrink inode.
         }
     }
-    return 0; // Success.
+    inode_unlock(inum);
+    journal_end();
+    return rv;
 }
 
-// Create a new file or directory.
-int storage_mknod(const char *path, int mode) {
-    // extract parent path and lookup the inode of the parent directory
-    char parent_path[256];
-    extract_parent_path(path, parent_path);
-    int parent_inum = inode_path_lookup(parent_path);
-    // check if parent directory exists
-    if (parent_inum < 0) {
-        return -1;
+// Drop one link to an inode, freeing it once nothing refers to it
+// (caller holds the inode lock).
+static void drop_link(int inum) {
+    // cached entries of a removed directory must not outlive its inum
+    if (S_ISDIR(get_inode(inum)->mode)) {
+        dcache_purge(inum);
     }
-    // get parent inode
-    inode_t *parent_inode = get_inode(parent_inum);
-    if (!parent_inode) {
-        return -1;
+    inode_unlink(inum);
+}
+
+// Retrieve file or directory metadata.
+int storage_stat(const char *path, struct stat *st) {
+    STATS_TIME(STAT_STORAGE_STAT);
+    // Find the inode number for the given path.
+    int inum = inode_path_lookup(path);
+    if (inum < 0) {
+        return -1; // Path not found.
     }
-    // allocate new inode
-    int inum = alloc_inode(mode);
-    // check if new inode allocation is successful
+    return stat_inode(inum, st);
+}
+
+// Read data from a file.
+int storage_read(const char *path, char *buf, size_t size, off_t offset) {
+    STATS_TIME(STAT_STORAGE_READ);
+    // Find the inode for the given path.
+    int inum = inode_path_lookup(path);
     if (inum < 0) {
+        return -1; // File not found.
+    }
+    return read_inode(inum, buf, size, offset);
+}
+
+// Write data to a file.
+int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+    STATS_TIME(STAT_STORAGE_WRITE);
+    // Find the inode for the given path.
+    int inum = inode_path_lookup(path);
+    if (inum < 0) {
+        return -1; // File not found.
+    }
+    return write_inode(inum, buf, NULL, NULL, size, offset);
+}
+
+// Truncate or extend a file to a specified length.
+int storage_truncate(const char *path, off_t size) {
+    STATS_TIME(STAT_STORAGE_TRUNCATE);
+    // Find the inode for the given path.
+    int inum = inode_path_lookup(path);
+    if (inum < 0) {
+        return -1; // File not found.
+    }
+    return truncate_inode(inum, size);
+}
+
+// Open an inode, pinning it for the handle's lifetime.
+static int open_inode(int inum, int flags, uint64_t *fh) {
+    open_file_t *of = calloc(1, sizeof(open_file_t));
+    if (of == NULL) {
         return -1;
     }
-    // get filename and add it to the parent directory
-    const char *name = get_filename_from_path(path);
-    if (directory_put(parent_inode, name, inum) < 0) {
-        free_inode(inum);
+    of->inum = inum;
+    of->flags = flags;
+    inode_lock(inum);
+    inode_pin(inum);
+    inode_unlock(inum);
+    *fh = (uintptr_t)of;
+    return 0;
+}
+
+// Open a file, resolving its inode once for the handle's lifetime.
+int storage_open(const char *path, int flags, uint64_t *fh) {
+    STATS_TIME(STAT_STORAGE_OPEN);
+    int inum = inode_path_lookup(path);
+    if (inum < 0) {
+        return -1; // File not found.
+    }
+    return open_inode(inum, flags, fh);
+}
+
+// Create a file and open it.
+int storage_create(const char *path, int mode, int flags, uint64_t *fh) {
+    STATS_TIME(STAT_STORAGE_CREATE);
+    int inum = mknod_inode(path, mode);
+    if (inum < 0) {
         return -1;
     }
-    // success
+    return open_inode(inum, flags, fh);
+}
+
+// Retrieve metadata of an open file.
+int storage_fstat(uint64_t fh, struct stat *st) {
+    STATS_TIME(STAT_STORAGE_FSTAT);
+    return stat_inode(open_file(fh)->inum, st);
+}
+
+// Read data from an open file.
+int storage_read_fh(uint64_t fh, char *buf, size_t size, off_t offset) {
+    STATS_TIME(STAT_STORAGE_READ_FH);
+    open_file_t *of = open_file(fh);
+    int rv = read_inode(of->inum, buf, size, offset);
+    if (rv > 0) {
+        note_access(of, offset, rv);
+    }
+    return rv;
+}
+
+// Write data to an open file.
+int storage_write_fh(uint64_t fh, const char *buf, size_t size, off_t offset) {
+    STATS_TIME(STAT_STORAGE_WRITE_FH);
+    open_file_t *of = open_file(fh);
+    int rv = write_inode(of->inum, buf, NULL, NULL, size, offset);
+    if (rv > 0) {
+        note_access(of, offset, rv);
+    }
+    return rv;
+}
+
+// Map the data of a read from an open file, for the caller to copy from
+// the image file without an intermediate buffer.
+int storage_map_fh(uint64_t fh, size_t size, off_t offset, storage_run_t **runs) {
+    STATS_TIME(STAT_STORAGE_MAP_FH);
+    open_file_t *of = open_file(fh);
+    int count = map_inode(of->inum, size, offset, runs);
+    size_t total = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        total += (*runs)[ii].len;
+    }
+    stats_record(STAT_IO_READ, total);
+    if (total > 0) {
+        note_access(of, offset, total);
+    }
+    return count;
+}
+
+// Hand back the runs of a mapped read once its data is sent, letting
+// blocks freed meanwhile be reused.
+void storage_map_done(storage_run_t *runs, int count) {
+    for (int ii = 0; ii < count; ++ii) {
+        free(runs[ii].mem);
+    }
+    free(runs);
+    journal_read_end();
+}
+
+// Write data to an open file, pulling it from source straight into the
+// file's blocks.
+int storage_write_from_fh(uint64_t fh, storage_source_t source, void *arg, size_t size,
+                          off_t offset) {
+    STATS_TIME(STAT_STORAGE_WRITE_FROM_FH);
+    open_file_t *of = open_file(fh);
+    int rv = write_inode(of->inum, NULL, source, arg, size, offset);
+    if (rv > 0) {
+        note_access(of, offset, rv);
+    }
+    return rv;
+}
+
+// Truncate or extend an open file.
+int storage_ftruncate(uint64_t fh, off_t size) {
+    STATS_TIME(STAT_STORAGE_FTRUNCATE);
+    return truncate_inode(open_file(fh)->inum, size);
+}
+
+// checks a range for storage_fallocate() and storage_punch_hole()
+static int check_range(inode_t *inode, off_t offset, off_t len) {
+    if (S_ISDIR(inode->mode)) {
+        return -EISDIR;
+    }
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    // Sizes are ints on disk.
+    if (offset + len > INT_MAX) {
+        return -EFBIG;
+    }
     return 0;
 }
 
-// Remove a file.
-int storage_unlink(const char *path) {
-    // get parent path
-    char parent_path[256];
-    extract_parent_path(path, parent_path);
-    int parent_inum = inode_path_lookup(parent_path);
+// Reserve blocks for a range of an open file, extending the file over it
+// unless keep_size is set.
+int storage_fallocate(uint64_t fh, off_t offset, off_t len, int keep_size) {
+    STATS_TIME(STAT_STORAGE_FALLOCATE);
+    int inum = open_file(fh)->inum;
+    inode_t *inode = get_inode(inum);
+    int rv = check_range(inode, offset, len);
+    if (rv != 0) {
+        return rv;
+    }
+    journal_begin();
+    inode_lock(inum);
+    rv = inode_reserve(inode, offset, len);
+    if (rv == 0 && !keep_size && offset + len > inode->size) {
+        rv = grow_inode(inode, offset + len - inode->size) < 0 ? -1 : 0;
+    }
+    inode_unlock(inum);
+    journal_end();
+    return rv == 0 ? 0 : -ENOSPC;
+}
+
+// Deallocate a range of an open file, leaving its size as it is.
+int storage_punch_hole(uint64_t fh, off_t offset, off_t len) {
+    STATS_TIME(STAT_STORAGE_PUNCH_HOLE);
+    int inum = open_file(fh)->inum;
+    int rv = check_range(get_inode(inum), offset, len);
+    if (rv != 0) {
+        return rv;
+    }
+    journal_begin();
+    inode_lock(inum);
+    // splitting an extent may need an overflow block
+    rv = inode_punch(get_inode(inum), offset, len);
+    inode_unlock(inum);
+    journal_end();
+    return rv == 0 ? 0 : -ENOSPC;
+}
+
+// Flush an open file on close. Data goes straight to the image mapping,
+// so there is nothing buffered per handle; writeback of the file's dirty
+// blocks is started so that a later fsync has less to wait for.
+int storage_flush(uint64_t fh) {
+    STATS_TIME(STAT_STORAGE_FLUSH);
+    if (durability == DURABILITY_NONE) {
+        return 0;
+    }
+    open_file_t *of = open_file(fh);
+    inode_lock_shared(of->inum);
+    int rv = inode_sync(get_inode(of->inum), 0);
+    inode_unlock(of->inum);
+    return rv;
+}
+
+// Make an open file durable: its dirty data blocks, then its metadata
+// through a journal commit (for datasync too, since a write may have grown
+// the file). Outside DURABILITY_FSYNC this returns at once.
+int storage_fsync(uint64_t fh, int datasync) {
+    STATS_TIME(STAT_STORAGE_FSYNC);
+    if (durability != DURABILITY_FSYNC) {
+        return 0;
+    }
+    open_file_t *of = open_file(fh);
+    inode_lock_shared(of->inum);
+    int rv = inode_sync(get_inode(of->inum), 1);
+    inode_unlock(of->inum);
+    return journal_commit() | rv;
+}
+
+// Close a handle, freeing the inode if it was unlinked while open.
+int storage_release(uint64_t fh) {
+    STATS_TIME(STAT_STORAGE_RELEASE);
+    open_file_t *of = open_file(fh);
+    journal_begin();
+    inode_lock(of->inum);
+    inode_unpin(of->inum);
+    inode_unlock(of->inum);
+    journal_end();
+    free(of);
+    return 0;
+}
+
+// Create a new file or directory in a directory, returning its inode
+// number. The new inode gets pins pins before its name becomes visible.
+static int mknod_at(int parent_inum, path_name_t name, int mode, int pins) {
+    inode_t *parent_inode = get_inode(parent_inum);
+    journal_begin();
+    inode_lock(parent_inum);
+    int inum = -1;
+    // the name may have been taken since the walk
+    if (parent_inode->refs > 0 &&
+        directory_lookup(parent_inode, name.name, name.len) < 0) {
+        // allocate new inode
+        inum = alloc_inode(mode, parent_inum);
+    }
+    // add it to the parent directory
+    if (inum >= 0 && directory_put(parent_inode, name.name, name.len, inum) < 0) {
+        free_inode(inum);
+        inum = -1;
+    }
+    for (int ii = 0; inum >= 0 && ii < pins; ++ii) {
+        inode_pin(inum);
+    }
+    inode_unlock(parent_inum);
+    journal_end();
+    return inum;
+}
+
+// Create a new file or directory, returning its inode number.
+static int mknod_inode(const char *path, int mode) {
+    // resolve the parent directory and the new name in one walk
+    int parent_inum;
+    path_name_t name;
+    if (inode_path_resolve(path, &parent_inum, &name) >= 0) {
+        return -1; // already exists
+    }
     // check if parent directory exists
     if (parent_inum < 0) {
-        return -1; // Parent directory not found.
+        return -1;
     }
-    // get inode of parent directory
+    return mknod_at(parent_inum, name, mode, 0);
+}
+
+// Create a new file or directory.
+int storage_mknod(const char *path, int mode) {
+    STATS_TIME(STAT_STORAGE_MKNOD);
+    return mknod_inode(path, mode) < 0 ? -1 : 0;
+}
+
+// Remove the entry name of a directory, which was found to refer to inum.
+static int unlink_at(int parent_inum, path_name_t name, int inum) {
     inode_t *parent_inode = get_inode(parent_inum);
-    // get filename from path
-    const char *name = get_filename_from_path(path);
-    // delete the link from parent directory
-    if (directory_delete(parent_inode, name) < 0) {
-        return -1; // File removal failed.
+    int locked[] = {parent_inum, inum};
+    journal_begin();
+    inode_lock_many(locked, 2);
+    // delete the link from parent directory, unless it changed since the walk
+    int rv = -1;
+    if (directory_lookup(parent_inode, name.name, name.len) == inum) {
+        directory_delete(parent_inode, name.name, name.len);
+        // the inode goes once its last link is gone and nobody has it open
+        drop_link(inum);
+        rv = 0;
     }
+    inode_unlock_many(locked, 2);
+    journal_end();
+    return rv;
+}
 
-    return 0; // Success.
+// Remove a file.
+int storage_unlink(const char *path) {
+    STATS_TIME(STAT_STORAGE_UNLINK);
+    // resolve the parent directory and the name in one walk
+    int parent_inum;
+    path_name_t name;
+    int inum = inode_path_resolve(path, &parent_inum, &name);
+    // check if the file exists
+    if (inum < 0) {
+        return -1; // File not found.
+    }
+    return unlink_at(parent_inum, name, inum);
+}
+
+// Link an inode into a directory under a new name, pinning it pins times.
+static int link_at(int inum_from, int parent_inum_to, path_name_t name_to, int pins) {
+    inode_t *parent_inode_to = get_inode(parent_inum_to);
+    inode_t *inode_from = get_inode(inum_from);
+    int locked[] = {parent_inum_to, inum_from};
+    journal_begin();
+    inode_lock_many(locked, 2);
+    // create a new link, unless the source is gone or the name was taken
+    int rv = -1;
+    if (inode_from->refs > 0 &&
+        directory_lookup(parent_inode_to, name_to.name, name_to.len) < 0 &&
+        directory_put(parent_inode_to, name_to.name, name_to.len, inum_from) == 0) {
+        inode_link(inum_from);
+        for (int ii = 0; ii < pins; ++ii) {
+            inode_pin(inum_from);
+        }
+        rv = 0;
+    }
+    inode_unlock_many(locked, 2);
+    journal_end();
+    return rv;
 }
 
 // Create a link to a file.
 int storage_link(const char *from, const char *to) {
+    STATS_TIME(STAT_STORAGE_LINK);
     // get inode of source file
     int inum_from = inode_path_lookup(from);
     // check if source file exists
     if (inum_from < 0) {
         return -1; // Source file not found.
     }
-    // get parent path from provided link
-    char parent_path_to[256];
-    extract_parent_path(to, parent_path_to);
-    int parent_inum_to = inode_path_lookup(parent_path_to);
+    // resolve the target directory and the new name
+    int parent_inum_to;
+    path_name_t name_to;
+    if (inode_path_resolve(to, &parent_inum_to, &name_to) >= 0) {
+        return -1; // Target already exists.
+    }
     // check if target directory exists
     if (parent_inum_to < 0) {
         return -1; // Target directory not found.
     }
-    // get inode of target directory
+    return link_at(inum_from, parent_inum_to, name_to, 0);
+}
+
+// Renames are serialized, so the two parent directories of one rename are
+// never locked in the opposite order by another.
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Move the entry name_from of a directory to name_to in another, where
+// the names were found to refer to inum_from and inum_to (-1 if none).
+// The caller holds rename_lock, within a journal operation.
+static int rename_at(int parent_inum_from, path_name_t name_from, int inum_from,
+                     int parent_inum_to, path_name_t name_to, int inum_to) {
+    inode_t *parent_inode_from = get_inode(parent_inum_from);
     inode_t *parent_inode_to = get_inode(parent_inum_to);
-    // get filename for new link
-    const char *name_to = get_filename_from_path(to);
-    // create a new link
-    if (directory_put(parent_inode_to, name_to, inum_from) < 0) {
-        return -1; // Link creation failed.
+    // both parents and both files, locked in the global lock order
+    int locked[] = {parent_inum_from, parent_inum_to, inum_from, inum_to};
+    inode_lock_many(locked, 4);
+    int rv = 0;
+    if (directory_lookup(parent_inode_from, name_from.name, name_from.len) != inum_from ||
+        directory_lookup(parent_inode_to, name_to.name, name_to.len) != inum_to) {
+        rv = -1; // Changed since the walk.
+    } else if (inum_to != inum_from) {
+        // The new name is in place before the old one goes, so a rename that
+        // fails (a full image, when the target directory has to grow)
+        // changes nothing. An existing target is taken over in place, which
+        // needs no space. The dentry cache is kept in step: the old name
+        // turns negative, the new one points at the moved inode, and entries
+        // under a moved directory stay valid because they are keyed by its
+        // inum.
+        if (inum_to >= 0) {
+            rv = directory_replace(parent_inode_to, name_to.name, name_to.len, inum_from);
+        } else {
+            rv = directory_put(parent_inode_to, name_to.name, name_to.len, inum_from);
+        }
+        if (rv == 0) {
+            directory_delete(parent_inode_from, name_from.name, name_from.len);
+            if (inum_to >= 0) {
+                drop_link(inum_to);
+            }
+        }
     }
-
-    return 0; // Success.
+    inode_unlock_many(locked, 4);
+    return rv;
 }
 
-// Rename or move a file or directory.
+// Rename or move a file or directory. The whole rename is one journal
+// operation, so a crash leaves either the old name or the new one.
 int storage_rename(const char *from, const char *to) {
-    // Unlink the target if it exists.
-    storage_unlink(to);
-    // get inode of source file
-    int inum_from = inode_path_lookup(from);
-    if (inum_from < 0) {
-        return -1; // Source file not found.
+    STATS_TIME(STAT_STORAGE_RENAME);
+    journal_begin();
+    pthread_mutex_lock(&rename_lock);
+    // resolve source and target, one walk each
+    int parent_inum_from;
+    path_name_t name_from;
+    int inum_from = inode_path_resolve(from, &parent_inum_from, &name_from);
+    int parent_inum_to;
+    path_name_t name_to;
+    int inum_to = inode_path_resolve(to, &parent_inum_to, &name_to);
+    if (inum_from < 0 || parent_inum_to < 0) {
+        pthread_mutex_unlock(&rename_lock);
+        journal_end();
+        return -1; // Source file or target directory not found.
     }
-    // get parent path from source path
-    char parent_path_from[256];
-    extract_parent_path(from, parent_path_from);
-    // get inode of parent directory
-    int parent_inum_from = inode_path_lookup(parent_path_from);
-    // get pointer for inode of parent directory
-    inode_t *parent_inode_from = get_inode(parent_inum_from);
-    const char *name_from = get_filename_from_path(from);
-    // delete file from sourec
-    directory_delete(parent_inode_from, name_from);
-    // get parent path from target path
-    char parent_path_to[256];
-    extract_parent_path(to, parent_path_to);
-    int parent_inum_to = inode_path_lookup(parent_path_to);
-    // get file name and inode of parent directory
-    inode_t *parent_inode_to = get_inode(parent_inum_to);
-    const char *name_to = get_filename_from_path(to);
-    // add a new entry for the directory
-    directory_put(parent_inode_to, name_to, inum_from);
-    return 0; // Success.
+    int rv = rename_at(parent_inum_from, name_from, inum_from, parent_inum_to, name_to, inum_to);
+    pthread_mutex_unlock(&rename_lock);
+    journal_end();
+    return rv;
 }
 
 // Set file access and modification times.
 int storage_set_time(const char *path, const struct timespec ts[2]) {
+    STATS_TIME(STAT_STORAGE_SET_TIME);
     // get inode of file
     int inum = inode_path_lookup(path);
     if (inum < 0) {
@@ -238,19 +760,201 @@ int storage_set_time(const char *path, const struct timespec ts[2]) {
     return 0; // Success.
 }
 
-// List the contents of a directory.
-slist_t* storage_list(const char* path) {
-    // get inode of file
-    int inum = inode_path_lookup(path);
+// passes directory entries on to a storage_fill_t
+typedef struct readdir_ctx {
+    storage_fill_t fill;
+    void *buf;
+} readdir_ctx_t;
+
+// reports one entry, with the inode number and file type its stat needs
+static int readdir_visit(void *arg, const char *name, int inum, long next) {
+    readdir_ctx_t *ctx = arg;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = inum;
+    st.st_mode = get_inode(inum)->mode;
+    return ctx->fill(ctx->buf, name, &st, next + 2);
+}
+
+// Lists a directory, whose parent is parent (-1 if unknown), from a given
+// offset.
+static int readdir_inode(int inum, int parent, off_t offset, storage_fill_t fill, void *buf) {
+    inode_t *inode = get_inode(inum);
+    if (!S_ISDIR(inode->mode)) {
+        return -1;
+    }
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR;
+    st.st_ino = inum;
+    if (offset < 1 && fill(buf, ".", &st, 1)) {
+        return 0;
+    }
+    st.st_ino = parent < 0 ? inum : parent; // the root is its own parent
+    if (offset < 2 && fill(buf, "..", &st, 2)) {
+        return 0;
+    }
+    readdir_ctx_t ctx = {fill, buf};
+    inode_lock_shared(inum);
+    directory_iterate(inode, offset > 2 ? offset - 2 : 0, readdir_visit, &ctx);
+    inode_unlock(inum);
+    return 0;
+}
+
+// List a directory from a given offset, without copying the entries.
+// Offsets 1 and 2 follow "." and ".."; the other entries come in the
+// order of directory_iterate, whose positions are offset by 2.
+int storage_readdir(const char *path, off_t offset, storage_fill_t fill, void *buf) {
+    STATS_TIME(STAT_STORAGE_READDIR);
+    int parent;
+    path_name_t leaf;
+    int inum = inode_path_resolve(path, &parent, &leaf);
     if (inum < 0) {
-        return NULL; // Directory not found.
+        return -1; // Directory not found.
     }
-    // get pointer to file's inode
-    inode_t* inode = get_inode(inum);
-    if (!inode || !(inode->mode & 040000)) { // Check if it's a directory.
-        return NULL;
+    return readdir_inode(inum, parent, offset, fill, buf);
+}
+
+// Inode-based entry points. Names are single components here, and every
+// inode reported back as an entry is pinned once for the caller.
+
+// Look up a name in a directory, pinning the inode found if asked to.
+static int lookup_at(int parent_inum, path_name_t name, int pin) {
+    inode_t *parent_inode = get_inode(parent_inum);
+    inode_lock_shared(parent_inum);
+    int inum = parent_inode->refs > 0 && S_ISDIR(parent_inode->mode)
+                   ? directory_lookup(parent_inode, name.name, name.len)
+                   : -1;
+    // the entry keeps the inode allocated until it is pinned
+    if (inum >= 0 && pin) {
+        inode_pin(inum);
     }
-    // return the list of directories
-    return directory_list(path);
+    inode_unlock(parent_inum);
+    return inum;
+}
+
+// wraps a NUL-terminated name
+static path_name_t name_of(const char *name) {
+    path_name_t pn = {name, (int)strlen(name)};
+    return pn;
 }
 
+// Find a name in a directory, pinning the inode found and filling in its
+// stat. Returns the inode number, or -1 if there is no such entry.
+int storage_lookup(int parent, const char *name, struct stat *st) {
+    STATS_TIME(STAT_STORAGE_LOOKUP);
+    int inum = lookup_at(parent, name_of(name), 1);
+    if (inum < 0) {
+        return -1;
+    }
+    stat_inode(inum, st);
+    return inum;
+}
+
+// Drop count pins taken by entry points, freeing the inode if that was
+// the last reference to it.
+void storage_forget(int inum, unsigned long count) {
+    STATS_TIME(STAT_STORAGE_FORGET);
+    journal_begin();
+    inode_lock(inum);
+    while (count-- > 0) {
+        inode_unpin(inum);
+    }
+    inode_unlock(inum);
+    journal_end();
+}
+
+// Retrieve metadata of an inode.
+int storage_stat_inum(int inum, struct stat *st) {
+    STATS_TIME(STAT_STORAGE_STAT);
+    return stat_inode(inum, st);
+}
+
+// Truncate or extend an inode.
+int storage_truncate_inum(int inum, off_t size) {
+    STATS_TIME(STAT_STORAGE_TRUNCATE);
+    return truncate_inode(inum, size);
+}
+
+// Create a file or directory in a directory.
+int storage_mknod_at(int parent, const char *name, int mode, struct stat *st) {
+    STATS_TIME(STAT_STORAGE_MKNOD);
+    int inum = mknod_at(parent, name_of(name), mode, 1);
+    if (inum >= 0) {
+        stat_inode(inum, st);
+    }
+    return inum;
+}
+
+// Create a file in a directory and open it.
+int storage_create_at(int parent, const char *name, int mode, int flags, uint64_t *fh,
+                      struct stat *st) {
+    STATS_TIME(STAT_STORAGE_CREATE);
+    open_file_t *of = calloc(1, sizeof(open_file_t));
+    if (of == NULL) {
+        return -1;
+    }
+    // one pin for the entry, one for the handle
+    int inum = mknod_at(parent, name_of(name), mode, 2);
+    if (inum < 0) {
+        free(of);
+        return -1;
+    }
+    of->inum = inum;
+    of->flags = flags;
+    *fh = (uintptr_t)of;
+    stat_inode(inum, st);
+    return inum;
+}
+
+// Open an inode.
+int storage_open_inum(int inum, int flags, uint64_t *fh) {
+    STATS_TIME(STAT_STORAGE_OPEN);
+    return open_inode(inum, flags, fh);
+}
+
+// Remove a name from a directory.
+int storage_unlink_at(int parent, const char *name) {
+    STATS_TIME(STAT_STORAGE_UNLINK);
+    path_name_t pn = name_of(name);
+    int inum = lookup_at(parent, pn, 0);
+    if (inum < 0) {
+        return -1;
+    }
+    return unlink_at(parent, pn, inum);
+}
+
+// Link an inode into a directory.
+int storage_link_at(int inum, int parent, const char *name, struct stat *st) {
+    STATS_TIME(STAT_STORAGE_LINK);
+    if (link_at(inum, parent, name_of(name), 1) != 0) {
+        return -1;
+    }
+    stat_inode(inum, st);
+    return 0;
+}
+
+// Move a name from one directory to another.
+int storage_rename_at(int parent, const char *name, int new_parent, const char *new_name) {
+    STATS_TIME(STAT_STORAGE_RENAME);
+    path_name_t from = name_of(name);
+    path_name_t to = name_of(new_name);
+    journal_begin();
+    pthread_mutex_lock(&rename_lock);
+    int inum_from = lookup_at(parent, from, 0);
+    int inum_to = lookup_at(new_parent, to, 0);
+    int rv = -1;
+    if (inum_from >= 0 && S_ISDIR(get_inode(new_parent)->mode)) {
+        rv = rename_at(parent, from, inum_from, new_parent, to, inum_to);
+    }
+    pthread_mutex_unlock(&rename_lock);
+    journal_end();
+    return rv;
+}
+
+// List a directory, as storage_readdir() does. A directory does not record
+// its parent, so ".." carries the directory's own number.
+int storage_readdir_inum(int inum, off_t offset, storage_fill_t fill, void *buf) {
+    STATS_TIME(STAT_STORAGE_READDIR);
+    return readdir_inode(inum, -1, offset, fill, buf);
+}
@@ -7,14 +7,25 @@
 #ifndef NUFS_STORAGE_H
 #define NUFS_STORAGE_H
 
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "slist.h"
+// When written data and metadata are flushed to the image.
+typedef enum durability {
+  DURABILITY_FSYNC,    // by fsync; metadata is also committed every second
+  DURABILITY_PERIODIC, // every flush interval, in the background
+  DURABILITY_NONE,     // never explicitly; for scratch data
+} durability_t;
 
-void storage_init(const char *path);
+int storage_init(const char *path);
+void storage_set_durability(durability_t mode, int interval_ms);
+void storage_destroy();
+int storage_statfs(struct statvfs *st);
+int storage_sync();
 int storage_stat(const char *path, struct stat *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
@@ -24,6 +35,67 @@ int storage_unlink(const char *path);
 int storage_link(const char *from, const char *to);
 int storage_rename(const char *from, const char *to);
 int storage_set_time(const char *path, const struct timespec ts[2]);
-slist_t *storage_list(const char *path);
+
+// Called by storage_readdir for each entry with its name, a stat holding
+// its inode number and mode, and the offset to resume after it. Returns
+// nonzero to stop (the signature of FUSE's fuse_fill_dir_t).
+typedef int (*storage_fill_t)(void *buf, const char *name, const struct stat *st, off_t next);
+int storage_readdir(const char *path, off_t offset, storage_fill_t fill, void *buf);
+
+// Open files. A handle (stored in fuse_file_info::fh) keeps its inode
+// resolved and pinned, so I/O through it needs no path lookup and an
+// unlinked file stays readable until its last handle is released.
+int storage_open(const char *path, int flags, uint64_t *fh);
+int storage_create(const char *path, int mode, int flags, uint64_t *fh);
+int storage_fstat(uint64_t fh, struct stat *st);
+int storage_read_fh(uint64_t fh, char *buf, size_t size, off_t offset);
+int storage_write_fh(uint64_t fh, const char *buf, size_t size, off_t offset);
+int storage_ftruncate(uint64_t fh, off_t size);
+
+// Zero-copy I/O through a handle. A read is mapped to runs of the image
+// file, which shares its pages with the mapping the data is written
+// through; what is not stored there (holes, inline data) comes as memory
+// the caller frees, along with the runs, with storage_map_done() once the
+// data is sent. Until then blocks freed by a racing truncate or punch are
+// not reused, so the runs never show another file's data.
+typedef struct storage_run {
+  void *mem;  // the data, if not NULL
+  int fd;     // otherwise, the image file...
+  off_t pos;  // ...at this byte offset
+  size_t len; // bytes in the run
+} storage_run_t;
+int storage_map_fh(uint64_t fh, size_t size, off_t offset, storage_run_t **runs);
+void storage_map_done(storage_run_t *runs, int count);
+// Copies the next len bytes of the data being written to dst; returns 0,
+// or -1 if they cannot be had.
+typedef int (*storage_source_t)(void *arg, char *dst, size_t len);
+int storage_write_from_fh(uint64_t fh, storage_source_t source, void *arg, size_t size,
+                          off_t offset);
+// Reserved blocks read as zeros until written; see inode.h. These two
+// return 0 or a negated errno: EINVAL for a bad range, EFBIG for one past
+// the largest file, EISDIR for a directory and ENOSPC when out of space.
+int storage_fallocate(uint64_t fh, off_t offset, off_t len, int keep_size);
+int storage_punch_hole(uint64_t fh, off_t offset, off_t len);
+int storage_flush(uint64_t fh);
+int storage_fsync(uint64_t fh, int datasync);
+int storage_release(uint64_t fh);
+
+// Inode-based entry points, for the low-level frontend: directories are
+// given by inode number and names are single components. Each inode
+// reported as an entry (lookup, mknod, create, link) is pinned once, like
+// an open file, until storage_forget drops the pin; an unlinked inode
+// stays allocated while pinned.
+int storage_lookup(int parent, const char *name, struct stat *st);
+void storage_forget(int inum, unsigned long count);
+int storage_stat_inum(int inum, struct stat *st);
+int storage_truncate_inum(int inum, off_t size);
+int storage_mknod_at(int parent, const char *name, int mode, struct stat *st);
+int storage_create_at(int parent, const char *name, int mode, int flags, uint64_t *fh,
+                      struct stat *st);
+int storage_open_inum(int inum, int flags, uint64_t *fh);
+int storage_unlink_at(int parent, const char *name);
+int storage_link_at(int inum, int parent, const char *name, struct stat *st);
+int storage_rename_at(int parent, const char *name, int new_parent, const char *new_name);
+int storage_readdir_inum(int inum, off_t offset, storage_fill_t fill, void *buf);
 
 #endif
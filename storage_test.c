@@ -0,0 +1,128 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "storage.h"
+
+#define TEST_NAME "storage_test.img"
+#define BS NUFS_DEFAULT_BLOCK_SIZE
+
+// data blocks stored for a file, holes excluded
+long stored_blocks(const char *path) {
+  struct stat st;
+  storage_stat(path, &st);
+  return st.st_blocks / (BS / 512);
+}
+
+// whether the bytes [from, to) of a file read as c
+int reads_as(const char *path, off_t from, off_t to, char c) {
+  static char buf[6 * BS];
+  int got = storage_read(path, buf, to - from, from);
+  for (int i = 0; i < got; i++) {
+    if (buf[i] != c) {
+      return 0;
+    }
+  }
+  return got == to - from;
+}
+
+int main(int argc, char **argv) {
+  unlink(TEST_NAME);
+  if (blocks_format(TEST_NAME, 8 << 20, BS, 0, 0, 0) != 0 ||
+      storage_init(TEST_NAME) != 0) {
+    printf("Could not set up the image\n");
+    return 1;
+  }
+  int failed = 0;
+  static char data[6 * BS];
+  memset(data, 'x', sizeof(data));
+
+  uint64_t fh;
+  storage_create("/f", S_IFREG | 0644, 0, &fh);
+  storage_write_fh(fh, data, sizeof(data), 0);
+  printf("Wrote 6 blocks: %ld stored\n", stored_blocks("/f"));
+  failed |= stored_blocks("/f") != 6;
+
+  // a range that overflows the on-disk size is refused, not ignored
+  int rv = storage_punch_hole(fh, 2 * BS, 1L << 44);
+  printf("Punch of 2^44 bytes: %d, %ld stored\n", rv, stored_blocks("/f"));
+  failed |= rv != -EFBIG || stored_blocks("/f") != 6 || !reads_as("/f", 0, 6 * BS, 'x');
+
+  // the edges of a range are zeroed, and only they
+  rv = storage_punch_hole(fh, BS + 100, 50);
+  printf("Punch inside block 1: %d, %ld stored\n", rv, stored_blocks("/f"));
+  failed |= rv != 0 || stored_blocks("/f") != 6 || !reads_as("/f", BS + 100, BS + 150, 0) ||
+            !reads_as("/f", BS, BS + 100, 'x') || !reads_as("/f", BS + 150, 2 * BS, 'x');
+
+  // a range reaching far past the end frees up to the end
+  rv = storage_punch_hole(fh, 2 * BS + 10, INT_MAX - 2 * BS - 10);
+  printf("Punch to INT_MAX: %d, %ld stored\n", rv, stored_blocks("/f"));
+  failed |= rv != 0 || stored_blocks("/f") != 3 || !reads_as("/f", 2 * BS + 10, 6 * BS, 0) ||
+            !reads_as("/f", 2 * BS, 2 * BS + 10, 'x');
+
+  // a range past the end has nothing to free
+  rv = storage_punch_hole(fh, 1 << 20, BS);
+  struct stat st;
+  storage_stat("/f", &st);
+  printf("Punch past the end: %d, size %ld\n", rv, (long) st.st_size);
+  failed |= rv != 0 || st.st_size != 6 * BS || stored_blocks("/f") != 3;
+
+  // bad ranges and directories are told apart
+  uint64_t dir;
+  storage_mknod("/dir", S_IFDIR | 0755);
+  storage_open("/dir", 0, &dir);
+  int einval = storage_punch_hole(fh, -1, BS);
+  int eisdir = storage_fallocate(dir, 0, BS, 0);
+  printf("Errors: %d for a negative offset, %d for a directory\n", einval, eisdir);
+  failed |= einval != -EINVAL || eisdir != -EISDIR || storage_fallocate(fh, 0, 0, 0) != -EINVAL;
+  storage_release(dir);
+
+  // blocks reserved past the end are freed by a punch over them
+  int free_before, free_inodes;
+  blocks_usage(&free_before, &free_inodes);
+  rv = storage_fallocate(fh, 6 * BS, 4 * BS, 1);
+  int free_reserved;
+  blocks_usage(&free_reserved, &free_inodes);
+  storage_stat("/f", &st);
+  failed |= rv != 0 || st.st_size != 6 * BS || free_reserved != free_before - 4;
+  rv = storage_punch_hole(fh, 6 * BS, 4 * BS);
+  int free_after;
+  blocks_usage(&free_after, &free_inodes);
+  printf("Punch of 4 blocks reserved past the end: %d, free %d -> %d -> %d\n", rv,
+         free_before, free_reserved, free_after);
+  failed |= rv != 0 || free_after != free_before;
+
+  storage_release(fh);
+
+  // a rename that needs a block the image does not have changes nothing
+  storage_mknod("/d", S_IFDIR | 0755);
+  char path[64];
+  for (int i = 0; i < BS / 64; i++) {
+    snprintf(path, sizeof(path), "/d/e%02d", i);
+    storage_mknod(path, S_IFREG | 0644);
+  }
+  uint64_t big;
+  storage_create("/big", S_IFREG | 0644, 0, &big);
+  for (off_t pos = 0; storage_write_fh(big, data, BS, pos) > 0; pos += BS) {
+  }
+  storage_release(big);
+  int f_inum = storage_stat("/f", &st) == 0 ? (int) st.st_ino : -1;
+  rv = storage_rename("/f", "/d/moved");
+  printf("Rename into a full directory on a full image: %d\n", rv);
+  failed |= rv != -1 || storage_stat("/f", &st) != 0 || storage_stat("/d/moved", &st) == 0;
+
+  // an existing target is replaced without taking space
+  rv = storage_rename("/f", "/d/e00");
+  printf("Rename over an existing entry on a full image: %d\n", rv);
+  failed |= rv != 0 || storage_stat("/f", &st) == 0 || storage_stat("/d/e00", &st) != 0 ||
+            (int) st.st_ino != f_inum;
+
+  storage_destroy();
+  unlink(TEST_NAME);
+  printf("%s\n", failed ? "FAILED" : "All checks passed");
+  return failed;
+}
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_EVENT_NAME(id, name) name,
+static const char *event_names[] = {TRACE_EVENTS(TRACE_EVENT_NAME)};
+#undef TRACE_EVENT_NAME
+
+// Return the name of an event.
+const char *trace_event_name(int event) {
+    return event >= 0 && event < TRACE_EVENT_COUNT ? event_names[event] : "?";
+}
+
+#ifdef NUFS_TRACE
+
+// level in effect until the trace file is open: nothing is recorded
+static int32_t no_trace = TRACE_OFF;
+volatile int32_t *trace_level = &no_trace;
+
+static trace_header_t *header = 0;
+static __thread trace_ring_t *my_ring = 0;
+static __thread int ring_claimed = 0;
+// A ring outlives its thread: it is handed to the next thread that needs
+// one, as are the stats shards.
+static int ring_owned[TRACE_RINGS];
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+// Create the trace file for a disk image and start recording into it.
+void trace_open(const char *image_path) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.trace", image_path);
+    size_t size = sizeof(trace_header_t) + (size_t)TRACE_RINGS * sizeof(trace_ring_t);
+    int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, size) != 0) {
+        perror(path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    void *base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror(path);
+        return;
+    }
+    header = base;
+    header->magic = TRACE_MAGIC;
+    header->version = TRACE_VERSION;
+    const char *level = getenv("NUFS_TRACE_LEVEL");
+    header->level = level ? atoi(level) : TRACE_INFO;
+    trace_level = &header->level;
+}
+
+// hands a thread's ring back when the thread exits; its records stay
+// readable until the next owner claims it
+static void ring_release(void *ring) {
+    trace_ring_t *rings = (trace_ring_t *)(header + 1);
+    int slot = (trace_ring_t *)ring - rings;
+    __atomic_store_n(&ring_owned[slot], 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init() {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+// claims a free ring for the calling thread, or leaves it without one
+static trace_ring_t *claim_ring() {
+    pthread_once(&ring_once, ring_key_init);
+    ring_claimed = 1;
+    trace_ring_t *rings = (trace_ring_t *)(header + 1);
+    for (int slot = 0; slot < TRACE_RINGS; ++slot) {
+        int unowned = 0;
+        if (!__atomic_compare_exchange_n(&ring_owned[slot], &unowned, 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        trace_ring_t *ring = &rings[slot];
+        // skip the records of the previous owner, so that none is listed
+        // under the new one
+        if (ring->head > 0) {
+            __atomic_store_n(&ring->head, ring->head + TRACE_RING_RECORDS, __ATOMIC_RELEASE);
+        }
+        ring->thread = syscall(SYS_gettid);
+        int used = __atomic_load_n(&header->rings, __ATOMIC_RELAXED);
+        while (used <= slot && !__atomic_compare_exchange_n(&header->rings, &used, slot + 1, 0,
+                                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        pthread_setspecific(ring_key, ring);
+        return my_ring = ring;
+    }
+    __atomic_fetch_add(&header->dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Append a record to the calling thread's ring.
+void trace_record(int level, int event, int64_t arg0, int64_t arg1) {
+    trace_ring_t *ring = my_ring;
+    if (ring == NULL && (ring_claimed || (ring = claim_ring()) == NULL)) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // only this thread writes the ring
+    uint64_t head = ring->head;
+    trace_record_t *rec = &ring->records[head % TRACE_RING_RECORDS];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+    rec->event = event;
+    rec->level = level;
+    __atomic_store_n(&rec->seq, (uint32_t)(head + 1), __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
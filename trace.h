@@ -0,0 +1,122 @@
+/**
+ * @file trace.h
+ *
+ * Binary event tracing.
+ *
+ * Trace points record fixed-size binary records into a ring buffer owned
+ * by the calling thread, so recording takes no lock and does no I/O.  The
+ * rings live in a shared mapping of a trace file next to the disk image
+ * (<image>.trace), which trace_dump decodes, also while nufs is running.
+ *
+ * Tracing is compiled in only when NUFS_TRACE is defined (make TRACE=1).
+ * Otherwise the TRACE macros expand to nothing and their arguments are
+ * not evaluated.  When compiled in, a record is written only if its level
+ * is at most the current trace level.  The level lives in the trace file,
+ * so `trace_dump -l` changes it at runtime.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x4543524e // "NRCE"
+#define TRACE_VERSION 1
+
+#define TRACE_RINGS 64          // threads that can trace at once
+#define TRACE_RING_RECORDS 4096 // records kept per thread (a power of two)
+
+// trace levels
+#define TRACE_OFF 0
+#define TRACE_INFO 1  // rare events: mounts, journal commits
+#define TRACE_DEBUG 2 // every allocation and free
+
+// the events, with the meaning of their two arguments
+#define TRACE_EVENTS(X)                                                        \
+  X(TRACE_MOUNT, "mount")               /* block count, block size */          \
+  X(TRACE_ALLOC_BLOCKS, "alloc_blocks") /* first block, count */               \
+  X(TRACE_FREE_BLOCK, "free_block")     /* first block, count */               \
+  X(TRACE_ALLOC_INODE, "alloc_inode")   /* inum, group */                      \
+  X(TRACE_FREE_INODE, "free_inode")     /* inum, 0 */                          \
+  X(TRACE_COMMIT, "commit")             /* blocks logged, microseconds */      \
+  X(TRACE_REPLAY, "replay")             /* transactions replayed, 0 */
+
+#define TRACE_EVENT_ID(id, name) id,
+enum trace_event { TRACE_EVENTS(TRACE_EVENT_ID) TRACE_EVENT_COUNT };
+#undef TRACE_EVENT_ID
+
+/**
+ * One trace record.
+ *
+ * seq is the record's position in its ring plus one; it is cleared while
+ * the record is being written, so readers can skip torn records.
+ */
+typedef struct trace_record {
+  uint64_t time;  // CLOCK_MONOTONIC, nanoseconds
+  int64_t arg0;
+  int64_t arg1;
+  uint32_t seq;
+  uint16_t event; // enum trace_event
+  uint16_t level;
+} trace_record_t;
+
+// the ring of one thread
+typedef struct trace_ring {
+  int32_t thread; // kernel thread id of the last owner, 0 if never claimed
+  uint32_t _reserved;
+  uint64_t head;  // records written so far
+  trace_record_t records[TRACE_RING_RECORDS];
+} trace_ring_t;
+
+// start of the trace file, followed by TRACE_RINGS rings
+typedef struct trace_header {
+  int32_t magic;   // TRACE_MAGIC
+  int32_t version; // TRACE_VERSION
+  int32_t level;   // records above this level are not written
+  int32_t rings;   // rings in use so far (a ring is reused once its thread exits)
+  int32_t dropped; // threads that found no free ring
+  int32_t _reserved[11];
+} trace_header_t;
+
+/**
+ * Return the name of an event.
+ *
+ * @param event An event id.
+ *
+ * @return The event's name, or "?" for an unknown id.
+ */
+const char *trace_event_name(int event);
+
+#ifdef NUFS_TRACE
+
+extern volatile int32_t *trace_level;
+
+/**
+ * Create the trace file for a disk image and start recording into it.
+ *
+ * The initial level comes from $NUFS_TRACE_LEVEL (TRACE_INFO if unset).
+ *
+ * @param image_path Path to the disk image.
+ */
+void trace_open(const char *image_path);
+
+/**
+ * Append a record to the calling thread's ring.
+ */
+void trace_record(int level, int event, int64_t arg0, int64_t arg1);
+
+#define TRACE_OPEN(image_path) trace_open(image_path)
+#define TRACE(level, event, arg0, arg1)                                        \
+  do {                                                                         \
+    if (__builtin_expect(*trace_level >= (level), 0)) {                        \
+      trace_record((level), (event), (arg0), (arg1));                          \
+    }                                                                          \
+  } while (0)
+
+#else
+
+#define TRACE_OPEN(image_path) ((void) 0)
+#define TRACE(level, event, arg0, arg1) ((void) 0)
+
+#endif
+
+#endif
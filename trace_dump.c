@@ -0,0 +1,111 @@
+// Decodes the trace file written by a nufs built with TRACE=1.
+//
+// Usage: trace_dump [-l level] <image>.trace
+//
+// Prints every record still in the rings, oldest first. With -l, sets the
+// trace level of the running nufs instead.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// a decoded record and the thread that wrote it
+typedef struct entry {
+	trace_record_t rec;
+	int thread;
+} entry_t;
+
+static int entry_cmp(const void *a, const void *b) {
+	uint64_t ta = ((const entry_t *) a)->rec.time;
+	uint64_t tb = ((const entry_t *) b)->rec.time;
+	return (ta > tb) - (ta < tb);
+}
+
+// copies out the records of a ring that are complete, returning how many
+static int read_ring(trace_ring_t *ring, entry_t *out) {
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > TRACE_RING_RECORDS ? head - TRACE_RING_RECORDS : 0;
+	int count = 0;
+	for (uint64_t ii = first; ii < head; ++ii) {
+		trace_record_t *rec = &ring->records[ii % TRACE_RING_RECORDS];
+		uint32_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		out[count].rec = *rec;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq != (uint32_t) (ii + 1) || __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq) {
+			continue; // overwritten while we read it
+		}
+		out[count].thread = ring->thread;
+		count++;
+	}
+	return count;
+}
+
+int main(int argc, char *argv[]) {
+	int level = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "l:")) != -1) {
+		switch (opt) {
+		case 'l': level = atoi(optarg); break;
+		default: goto usage;
+		}
+	}
+	if (argc - optind != 1) {
+		goto usage;
+	}
+
+	int fd = open(argv[optind], level >= 0 ? O_RDWR : O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	size_t size = sizeof(trace_header_t) + (size_t) TRACE_RINGS * sizeof(trace_ring_t);
+	if ((size_t) st.st_size < size) {
+		fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+		return 1;
+	}
+	int prot = level >= 0 ? PROT_READ | PROT_WRITE : PROT_READ;
+	trace_header_t *header = mmap(0, size, prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED || header->magic != TRACE_MAGIC ||
+			header->version != TRACE_VERSION) {
+		fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+		return 1;
+	}
+
+	if (level >= 0) {
+		__atomic_store_n(&header->level, level, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	trace_ring_t *rings = (trace_ring_t *) (header + 1);
+	int nrings = header->rings < TRACE_RINGS ? header->rings : TRACE_RINGS;
+	entry_t *entries = malloc((size_t) TRACE_RINGS * TRACE_RING_RECORDS * sizeof(entry_t));
+	int count = 0;
+	for (int ii = 0; ii < nrings; ++ii) {
+		count += read_ring(&rings[ii], entries + count);
+	}
+	qsort(entries, count, sizeof(entry_t), entry_cmp);
+
+	printf("# level %d, %d threads, %d without a ring\n", header->level,
+			nrings, header->dropped);
+	for (int ii = 0; ii < count; ++ii) {
+		trace_record_t *rec = &entries[ii].rec;
+		printf("%llu.%09llu %d %s %lld %lld\n",
+				(unsigned long long) (rec->time / 1000000000),
+				(unsigned long long) (rec->time % 1000000000),
+				entries[ii].thread, trace_event_name(rec->event),
+				(long long) rec->arg0, (long long) rec->arg1);
+	}
+	free(entries);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-l level] <image>.trace\n", argv[0]);
+	return 1;
+}
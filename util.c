@@ -1,16 +1,9 @@
-#include <string.h>
-
-// Extracts the parent path from a given file path.
-void extract_parent_path(const char* path, char* parent_path) {
-    strcpy(parent_path, path);
-    char* last_slash = strrchr(parent_path, '/');
-    if (last_slash) {
-        *last_slash = '\0'; // Truncate the string at the last slash.
+// Hashes a name (FNV-1a).
+unsigned name_hash(const char* name, int len) {
+    unsigned hash = 2166136261u;
+    for (int ii = 0; ii < len; ++ii) {
+        hash ^= (unsigned char)name[ii];
+        hash *= 16777619u;
     }
-}
-
-// Extracts the file name from a given file path.
-const char* get_filename_from_path(const char* path) {
-    const char* last_slash = strrchr(path, '/');
-    return last_slash ? last_slash + 1 : path;
+    return hash;
 }
@@ -2,7 +2,6 @@
 #define UTIL_H
 
 // Function declarations
-void extract_parent_path(const char* path, char* parent_path);
-const char* get_filename_from_path(const char* path);
+unsigned name_hash(const char* name, int len);
 
 #endif